@@ -1,18 +1,40 @@
 #include "DataLoader.hpp"
 
+#if defined(__APPLE__)
 #include <mach-o/dyld.h>
+#else
+#include <unistd.h>
+#endif // __APPLE__
 #include <limits.h>
 #include <libgen.h>
+#include <stdlib.h>
+#include <stdexcept>
+
+using std::runtime_error;
 
 DataLoader::DataLoader () {
   char path[PATH_MAX + 1];
   char absolute_path[PATH_MAX + 1];
+#if defined(__APPLE__)
   uint32_t size = sizeof(path);
-  if (_NSGetExecutablePath(path, &size) == 0) {
-    realpath(path, absolute_path);
-  } else {
-    //TODO: Throw error
+  if (_NSGetExecutablePath(path, &size) != 0
+      || realpath(path, absolute_path) == NULL) {
+    throw runtime_error("Could not determine the executable path");
+  }
+#else
+  // Linux compute nodes: resolve the executable through procfs
+  const ssize_t length = readlink("/proc/self/exe", path, PATH_MAX);
+
+  if (length == -1) {
+    throw runtime_error("Could not read /proc/self/exe");
+  }
+
+  path[length] = '\0';
+
+  if (realpath(path, absolute_path) == NULL) {
+    throw runtime_error("Could not resolve the executable path");
   }
+#endif // __APPLE__
 
   rootDirectory = dirname(absolute_path);
 }
@@ -0,0 +1,118 @@
+#include "HeadlessRunner.hpp"
+#include "io/SnapshotWriter.hpp"
+#include "io/StatisticsWriter.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <climits>
+#include <sys/time.h>
+
+using std::cout;
+using std::endl;
+
+
+// Wall clock in seconds; glfwGetTime is not available without a window
+static double wallTime(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+void HeadlessRunner::run(const ConfigParameters &parameters,
+                         Solver &simulation) const {
+#if defined(USE_DEBUG)
+  cout << "[START] HeadlessRunner" << endl;
+#endif // USE_DEBUG
+
+  const unsigned int numParticles = simulation.getNumberParticles();
+
+  RunState state;
+
+  // Init
+  simulation.init();
+
+  simulation.initCells();
+
+  const bool restarted = !parameters.restartFile.empty();
+
+  if (restarted) {
+    simulation.loadCheckpoint(parameters.restartFile, state);
+    cout << "restarted at time " << state.time
+         << " (step " << state.steps << ")" << endl;
+  }
+
+  const unsigned int startSteps = state.steps;
+  // Stops at the end time or after the step limit, whichever comes first
+  const unsigned int endSteps = parameters.maxSteps > 0
+                                ? startSteps + parameters.maxSteps : UINT_MAX;
+
+  // Part and VTK output, the initial state is snapshot 0
+  SnapshotWriter snapshots(parameters, simulation);
+
+  if (!restarted) {
+    snapshots.afterStep(state.steps, state.time);
+  }
+
+  // Reduced on the device, only a small block is read back
+  StatisticsWriter statistics(parameters, simulation);
+
+  // Steps overlap with the snapshot output, the last one is waited for
+  // so wall time covers the device work
+  const double start = wallTime();
+
+  do {
+    simulation.step();
+
+    state.time += parameters.timeStepLength;
+    ++state.steps;
+
+    snapshots.afterStep(state.steps, state.time);
+    statistics.afterStep(state.steps, state.time);
+
+    if (parameters.checkpointOutFreq > 0
+        && state.steps % parameters.checkpointOutFreq == 0) {
+      simulation.saveCheckpoint(parameters.checkpointOutName, state);
+    }
+
+#if defined(USE_DEBUG)
+    cout << "Time: " << state.time << endl;
+#endif // USE_DEBUG
+
+  } while (state.time <= parameters.timeEnd && state.steps < endSteps);
+
+  simulation.finishStep();
+
+  const double elapsed = wallTime() - start;
+  const unsigned int steps = state.steps - startSteps;
+
+  cout << "particles: " << numParticles << endl;
+  cout << "steps: " << steps << endl;
+  cout << "elapsed: " << elapsed << " s" << endl;
+  cout << "steps/s: " << steps / elapsed << endl;
+
+  const map<string, double> &counters = simulation.getProfiler().getCounters();
+
+  for (map<string, double>::const_iterator cit = counters.begin();
+       cit != counters.end(); ++cit) {
+    cout << cit->first << ": " << cit->second << endl;
+  }
+
+  if ( snapshots.isEnabled() ) {
+    cout << "snapshot stalls: " << snapshots.getNumberStalls() << endl;
+  }
+
+  if ( statistics.isEnabled() ) {
+    cout << "statistics: " << statistics.getFilename() << endl;
+  }
+
+  if ( simulation.getProfiler().isEnabled() ) {
+    std::ofstream ofs( parameters.profileOutName.c_str() );
+    simulation.getProfiler().writeJSON(ofs);
+    cout << "kernel profile: " << parameters.profileOutName << endl;
+  }
+
+#if defined(USE_DEBUG)
+  cout << "[END] HeadlessRunner" << endl;
+#endif // USE_DEBUG
+}
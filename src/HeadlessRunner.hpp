@@ -0,0 +1,26 @@
+#ifndef __HEADLESS_RUNNER_HPP
+#define __HEADLESS_RUNNER_HPP
+
+#include "hesp.hpp"
+#include "Parameters.hpp"
+#include "Solver.hpp"
+
+
+/**
+ *  \brief  Steps a solver to time_end without any window or rendering.
+ */
+class HeadlessRunner {
+private:
+  // Avoid copy
+  HeadlessRunner &operator=(const HeadlessRunner &other);
+  HeadlessRunner (const HeadlessRunner &other);
+
+public:
+  HeadlessRunner () {}
+
+  void run(const ConfigParameters &parameters,
+           Solver &simulation) const;
+
+};
+
+#endif // __HEADLESS_RUNNER_HPP
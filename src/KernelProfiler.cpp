@@ -0,0 +1,145 @@
+#include "KernelProfiler.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+using std::sort;
+using std::endl;
+
+
+// Durations kept per kernel for the percentiles
+static const size_t _RESERVOIR_SIZE = 4096;
+
+
+cl::Event *
+KernelProfiler::event(const string &name) {
+  if (!mEnabled) {
+    return NULL;
+  }
+
+  mPending.push_back( pair<string, cl::Event>( name, cl::Event() ) );
+
+  return &mPending.back().second;
+}
+
+void
+KernelProfiler::collect(void) {
+  for (deque< pair<string, cl::Event> >::const_iterator cit = mPending.begin();
+       cit != mPending.end(); ++cit) {
+    const cl_ulong start = cit->second.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+    const cl_ulong end = cit->second.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+
+    this->add(cit->first, (end - start) * 1e-6);
+  }
+
+  mPending.clear();
+}
+
+void
+KernelProfiler::addSample(const string &name, const double milliseconds) {
+  this->add(name, milliseconds);
+}
+
+void
+KernelProfiler::add(const string &name, const double milliseconds) {
+  Stats &stats = mSamples[name];
+
+  stats.min = stats.count == 0 ? milliseconds
+              : std::min(stats.min, milliseconds);
+  stats.max = stats.count == 0 ? milliseconds
+              : std::max(stats.max, milliseconds);
+  stats.total += milliseconds;
+  ++stats.count;
+
+  // Reservoir sampling: the n-th duration replaces a kept one with
+  // probability _RESERVOIR_SIZE / n
+  if (stats.reservoir.size() < _RESERVOIR_SIZE) {
+    stats.reservoir.push_back(milliseconds);
+  } else {
+    const size_t k = mRandom() % stats.count;
+
+    if (k < _RESERVOIR_SIZE) {
+      stats.reservoir[k] = milliseconds;
+    }
+  }
+}
+
+// JSON has no NaN or infinity
+static void
+writeNumber(ostream &os, const double value) {
+  if ( std::isfinite(value) ) {
+    os << value;
+  } else {
+    os << "null";
+  }
+}
+
+// Nearest-rank percentile of sorted samples
+static double
+percentile(const vector<double> &sorted, const double p) {
+  size_t rank = (size_t) std::ceil(p / 100.0 * sorted.size());
+
+  if (rank > 0) {
+    --rank;
+  }
+
+  return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+// Orders kernels by descending total time
+static bool
+byTotal(const pair<double, string> &a, const pair<double, string> &b) {
+  return a.first > b.first;
+}
+
+void
+KernelProfiler::writeJSON(ostream &os) const {
+  vector< pair<double, string> > order;
+
+  for (map<string, Stats>::const_iterator cit = mSamples.begin();
+       cit != mSamples.end(); ++cit) {
+    order.push_back( pair<double, string>(cit->second.total, cit->first) );
+  }
+
+  sort(order.begin(), order.end(), byTotal);
+
+  double total = 0.0;
+
+  for (size_t k = 0; k < order.size(); ++k) {
+    total += order[k].first;
+  }
+
+  os << "{" << endl;
+  os << "  \"unit\": \"ms\"," << endl;
+  os << "  \"total\": " << total << "," << endl;
+  os << "  \"kernels\": [";
+
+  for (size_t k = 0; k < order.size(); ++k) {
+    const Stats &stats = mSamples.find(order[k].second)->second;
+    vector<double> sorted = stats.reservoir;
+    sort(sorted.begin(), sorted.end());
+
+    os << (k == 0 ? "" : ",") << endl;
+    os << "    { \"name\": \"" << order[k].second << "\""
+       << ", \"count\": " << stats.count
+       << ", \"total\": " << stats.total
+       << ", \"min\": " << stats.min
+       << ", \"max\": " << stats.max
+       << ", \"p50\": " << percentile(sorted, 50.0)
+       << ", \"p99\": " << percentile(sorted, 99.0)
+       << " }";
+  }
+
+  os << endl << "  ]," << endl;
+  os << "  \"counters\": {";
+
+  for (map<string, double>::const_iterator cit = mCounters.begin();
+       cit != mCounters.end(); ++cit) {
+    os << (cit == mCounters.begin() ? "" : ",") << endl;
+    os << "    \"" << cit->first << "\": ";
+    writeNumber(os, cit->second);
+  }
+
+  os << endl << "  }" << endl;
+  os << "}" << endl;
+}
@@ -0,0 +1,129 @@
+#ifndef __KERNEL_PROFILER_HPP
+#define __KERNEL_PROFILER_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <utility>
+#include <ostream>
+#include <random>
+
+#include "hesp.hpp"
+
+using std::string;
+using std::vector;
+using std::deque;
+using std::map;
+using std::pair;
+using std::ostream;
+
+
+/**
+ *  \brief  Collects per-kernel execution times.
+ *
+ *  OpenCL launches hand in an event slot obtained from event() and are
+ *  read out with collect() once the queue has finished, so the pipeline
+ *  is never serialized for timing. Backends without events add samples
+ *  directly. Samples are aggregated per kernel name; count, total, min
+ *  and max are exact, percentiles come from a bounded reservoir so long
+ *  runs do not grow without limit.
+ */
+class KernelProfiler {
+private:
+  // Avoid copy
+  KernelProfiler &operator=(const KernelProfiler &other);
+  KernelProfiler (const KernelProfiler &other);
+
+public:
+  KernelProfiler () : mEnabled(false) {}
+
+  void
+  setEnabled(const bool enabled) {
+    mEnabled = enabled;
+  }
+
+  bool
+  isEnabled(void) const {
+    return mEnabled;
+  }
+
+  /**
+   *  \brief  Returns an event to pass to an enqueue call, NULL if disabled.
+   */
+  cl::Event *
+  event(const string &name);
+
+  /**
+   *  \brief  Reads the times of all pending events; the queue must have
+   *          finished.
+   */
+  void
+  collect(void);
+
+  /**
+   *  \brief  Drops the samples so far, e.g. of warm-up steps; the queue
+   *          must have finished.
+   */
+  void
+  clearSamples(void) {
+    mPending.clear();
+    mSamples.clear();
+  }
+
+  /**
+   *  \brief  Adds a measured duration in milliseconds.
+   */
+  void
+  addSample(const string &name, const double milliseconds);
+
+  /**
+   *  \brief  Sets a named value reported with the timings, e.g. how often
+   *          a buffer was rebuilt. Recorded even if timing is disabled.
+   */
+  void
+  setCounter(const string &name, const double value) {
+    mCounters[name] = value;
+  }
+
+  const map<string, double> &
+  getCounters(void) const {
+    return mCounters;
+  }
+
+  /**
+   *  \brief  Writes count, total, min, max, p50 and p99 per kernel and
+   *          all counters.
+   */
+  void
+  writeJSON(ostream &os) const;
+
+private:
+  // Running aggregates and a uniform sample of the durations
+  struct Stats {
+    size_t count;
+    double total;
+    double min;
+    double max;
+    vector<double> reservoir;
+
+    Stats () : count(0), total(0.0), min(0.0), max(0.0) {}
+  };
+
+  void
+  add(const string &name, const double milliseconds);
+
+  bool mEnabled;
+
+  // deque keeps the handed out event pointers valid while growing
+  deque< pair<string, cl::Event> > mPending;
+
+  map<string, Stats> mSamples;
+
+  // Fixed seed, profiles of identical runs pick the same samples
+  std::minstd_rand mRandom;
+
+  map<string, double> mCounters;
+};
+
+#endif // __KERNEL_PROFILER_HPP
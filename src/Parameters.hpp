@@ -9,6 +9,14 @@
 using std::string;
 
 
+// Neighbour search of the OpenCL backend
+enum NeighbourSearch {
+  NEIGHBOUR_SEARCH_LINKED_CELL, /**< atomic linked lists per cell */
+  NEIGHBOUR_SEARCH_RADIX, /**< particles radix sorted by cell */
+  NEIGHBOUR_SEARCH_COUNTING /**< particles counting sorted by cell */
+};
+
+
 struct ConfigParameters {
   string partInputFile;
   cl_float timeStepLength;
@@ -17,7 +25,12 @@ struct ConfigParameters {
   string partOutNameBase;
   cl_uint vtkOutFreq;
   string vtkOutNameBase;
+  // Local size of one-dimensional launches, 0 lets the runtime choose
   cl_uint clWorkGroupSize1D;
+  // Tuned local sizes per device are read from here, empty disables the
+  // file; autotune measures them again and updates the file
+  string tuningDir;
+  bool autotune;
   cl_float xMin;
   cl_float xMax;
   cl_float yMin;
@@ -28,6 +41,112 @@ struct ConfigParameters {
   cl_float yN;
   cl_float zN;
   cl_float restDensity;
+  cl_uint checkpointOutFreq;
+  string checkpointOutName;
+  string profileOutName;
+  // Diagnostics reduced on the device, one row every statisticsOutFreq
+  // steps, 0 disables them
+  cl_uint statisticsOutFreq;
+  string statisticsOutName;
+  string restartFile;
+  NeighbourSearch neighbourSearch;
+  bool reorderParticles;
+  bool neighbourLists;
+  cl_uint maxNeighbours;
+  cl_float neighbourSkin;
+  bool fusedUpdate;
+  bool tiledSolver;
+  bool structOfArrays;
+  // Cells keyed along a Z-order curve instead of row by row
+  bool mortonCells;
+  // Cells hashed into a table sized by the particle count instead of a
+  // grid over the whole domain, 0 sizes the table automatically
+  bool hashedCells;
+  cl_uint hashTableSize;
+  cl_uint solverIterations;
+  bool adaptiveSolver;
+  cl_uint solverMinIterations;
+  cl_uint solverMaxIterations;
+  cl_float solverTolerance;
+  cl_uint substeps;
+  cl_float renderFps;
+  // Steps to run before stopping at the latest, 0 only stops at timeEnd
+  cl_uint maxSteps;
+
+  // Parameters missing in the .par file keep these values
+  ConfigParameters ()
+    : timeStepLength(0.0f),
+      timeEnd(0.0f),
+      partOutFreq(0),
+      partOutNameBase("part_"),
+      vtkOutFreq(0),
+      vtkOutNameBase("vtk_"),
+      clWorkGroupSize1D(0),
+      tuningDir("tuning"),
+      autotune(false),
+      xMin(0.0f),
+      xMax(0.0f),
+      yMin(0.0f),
+      yMax(0.0f),
+      zMin(0.0f),
+      zMax(0.0f),
+      xN(0.0f),
+      yN(0.0f),
+      zN(0.0f),
+      restDensity(0.0f),
+      checkpointOutFreq(0),
+      checkpointOutName("checkpoint.chk"),
+      profileOutName("profile.json"),
+      statisticsOutFreq(0),
+      statisticsOutName("statistics.csv"),
+      neighbourSearch(NEIGHBOUR_SEARCH_LINKED_CELL),
+      reorderParticles(false),
+      neighbourLists(false),
+      maxNeighbours(64),
+      neighbourSkin(0.0f),
+      fusedUpdate(false),
+      tiledSolver(false),
+      structOfArrays(false),
+      mortonCells(false),
+      hashedCells(false),
+      hashTableSize(0),
+      solverIterations(4),
+      adaptiveSolver(false),
+      solverMinIterations(2),
+      solverMaxIterations(8),
+      solverTolerance(0.01f),
+      substeps(1),
+      renderFps(0.0f),
+      maxSteps(0) {}
 };
 
+
+// Entries of the cell arrays, Morton keys go up to the key of the last
+// cell and leave gaps for coordinates beyond the grid
+inline cl_uint
+cellSlots(const ConfigParameters &parameters) {
+  if (parameters.mortonCells) {
+    return mortonKey(parameters.xN - 1, parameters.yN - 1,
+                     parameters.zN - 1) + 1;
+  }
+
+  return parameters.xN * parameters.yN * parameters.zN;
+}
+
+// Entries of the hash table of hashedCells, a power of two of at least
+// twice the particles unless given
+inline cl_uint
+hashTableSlots(const ConfigParameters &parameters,
+               const size_t numParticles) {
+  const cl_ulong wanted = parameters.hashTableSize > 0
+                          ? parameters.hashTableSize : 2 * numParticles;
+  cl_ulong slots = 1;
+
+  while (slots < wanted && slots < ((cl_ulong) 1 << 31)) {
+    slots <<= 1;
+  }
+
+  return slots;
+}
+
 #endif // __PARAMETERS_HPP
@@ -1,6 +1,9 @@
 #ifndef __PARTICLE_HPP
 #define __PARTICLE_HPP
 
+#include <vector>
+#include <cstddef>
+
 #include "hesp.hpp"
 
 static const int DIMENSIONS = 3;
@@ -13,4 +16,86 @@ struct Particle {
   cl_float a[DIMENSIONS]; /**< Position Z */
 };
 
+
+/**
+ *  \brief  Read-only view of particle data without copying it.
+ *
+ *  Covers both a vector<Particle> (array of structs) and separate float
+ *  arrays per field (struct of arrays, e.g. a memory mapped .pbf file).
+ *  Fields given as NULL read as 1 for the mass and 0 otherwise. The
+ *  viewed memory has to outlive the view.
+ */
+class ParticleView {
+public:
+  ParticleView ()
+    : mCount(0),
+      mStride(0),
+      mMass(NULL) {
+    for (int d = 0; d < DIMENSIONS; ++d) {
+      mPosition[d] = NULL;
+      mVelocity[d] = NULL;
+    }
+  }
+
+  explicit ParticleView (const std::vector<Particle> &particles)
+    : mCount( particles.size() ),
+      mStride( sizeof(Particle) ),
+      mMass(NULL) {
+    const Particle *p = particles.empty() ? NULL : &particles[0];
+
+    mMass = p ? (const char *) &p->m : NULL;
+
+    for (int d = 0; d < DIMENSIONS; ++d) {
+      mPosition[d] = p ? (const char *) &p->x[d] : NULL;
+      mVelocity[d] = p ? (const char *) &p->v[d] : NULL;
+    }
+  }
+
+  ParticleView (const size_t count,
+                const cl_float *mass,
+                const cl_float *const position[DIMENSIONS],
+                const cl_float *const velocity[DIMENSIONS])
+    : mCount(count),
+      mStride( sizeof(cl_float) ),
+      mMass( (const char *) mass ) {
+    for (int d = 0; d < DIMENSIONS; ++d) {
+      mPosition[d] = (const char *) position[d];
+      mVelocity[d] = (const char *) velocity[d];
+    }
+  }
+
+  size_t
+  size(void) const {
+    return mCount;
+  }
+
+  cl_float
+  mass(const size_t i) const {
+    return mMass ? at(mMass, i) : 1.0f;
+  }
+
+  cl_float
+  position(const size_t i, const int d) const {
+    return mPosition[d] ? at(mPosition[d], i) : 0.0f;
+  }
+
+  cl_float
+  velocity(const size_t i, const int d) const {
+    return mVelocity[d] ? at(mVelocity[d], i) : 0.0f;
+  }
+
+private:
+  cl_float
+  at(const char *field, const size_t i) const {
+    return *(const cl_float *) (field + i * mStride);
+  }
+
+  size_t mCount;
+  size_t mStride;
+
+  const char *mMass;
+  const char *mPosition[DIMENSIONS];
+  const char *mVelocity[DIMENSIONS];
+};
+
 #endif // __PARTICLE_HPP
@@ -1,9 +1,13 @@
 #include "Runner.hpp"
+#include "io/SnapshotWriter.hpp"
+#include "io/StatisticsWriter.hpp"
 
 #include <sstream>
+#include <fstream>
 #include <cstdio>
 #include <functional>
 #include <numeric>
+#include <climits>
 
 #if defined(MAKE_VIDEO)
 #include <unistd.h>
@@ -24,16 +28,14 @@ static const int WINDOW_HEIGHT = 720;
 void Runner::run(const ConfigParameters &parameters,
                  Simulation &simulation,
                  CVisual &renderer) const {
-  cl_float wave = 0.0f;
-  bool shouldGenerateWaves = false;
-
 #if defined(USE_DEBUG)
   cout << "[START] Runner" << endl;
 #endif // USE_DEBUG
 
   const unsigned int numParticles = simulation.getNumberParticles();
 
-  cl_float time = 0.0f;
+  // Time, step count and wave generator phase, restored from a checkpoint
+  RunState state;
 
   // System sizes
   const cl_float4 sizesMin = simulation.getSizesMin();
@@ -42,13 +44,27 @@ void Runner::run(const ConfigParameters &parameters,
   // Init
   simulation.init();
 
-#if defined(USE_LINKEDCELL)
   simulation.initCells();
-#endif // USE_LINKEDCELL
 
   renderer.initSystemVisual(sizesMin, sizesMax);
   renderer.initParticlesVisual(numParticles);
 
+  const bool restarted = !parameters.restartFile.empty();
+
+  if (restarted) {
+    simulation.loadCheckpoint(parameters.restartFile, state);
+  }
+
+  // Part and VTK output, the initial state is snapshot 0
+  SnapshotWriter snapshots(parameters, simulation);
+
+  if (!restarted) {
+    snapshots.afterStep(state.steps, state.time);
+  }
+
+  // Reduced on the device, only a small block is read back
+  StatisticsWriter statistics(parameters, simulation);
+
 #if defined(MAKE_VIDEO)
   const string cmd = "ffmpeg -r 30 -f rawvideo -pix_fmt rgb24 "
                      "-s 1280x720 -an -i - -threads 2 -preset slow "
@@ -78,44 +94,74 @@ void Runner::run(const ConfigParameters &parameters,
   double start, end;
   std::vector<double> times;
 
+  // A frame runs a fixed number of substeps, or as many as fit into the
+  // frame time if a render rate is given
+  const double frameLength = parameters.renderFps > 0.0f
+                             ? 1.0 / parameters.renderFps : 0.0;
+  const unsigned int startSteps = state.steps;
+  // Stops at the end time or after the step limit, whichever comes first
+  const unsigned int endSteps = parameters.maxSteps > 0
+                                ? startSteps + parameters.maxSteps : UINT_MAX;
+
   do {
     start = glfwGetTime();
-    simulation.step();
-
-    //#if defined(USE_DEBUG)
-    // printf("physics:           %f msec\n", (end - start) * 1000);
-    //#endif // USE_DEBUG
 
-    time += parameters.timeStepLength;
+    unsigned int substeps = 0;
 
-    if (shouldGenerateWaves) {
-      static const cl_float wave_push_length = (sizesMax.s[0]
-          - sizesMin.s[0]) / 3.0f;
-      static const cl_float wave_frequency = 1.0f;
-      static const cl_float wave_start = -M_PI / 2.0f;
+    // Steps are only enqueued, the host does not wait in between
+    do {
+      simulation.step();
 
-      const cl_float waveValue = sin(2.0f * M_PI * wave_frequency
-                                     * wave + wave_start)
-                                 * wave_push_length / 2.0f
-                                 + wave_push_length / 2.0f;
+      state.time += parameters.timeStepLength;
+      ++state.steps;
+      ++substeps;
+
+      snapshots.afterStep(state.steps, state.time);
+      statistics.afterStep(state.steps, state.time);
+
+      if (state.generateWaves) {
+        static const cl_float wave_push_length = (sizesMax.s[0]
+            - sizesMin.s[0]) / 3.0f;
+        static const cl_float wave_frequency = 1.0f;
+        static const cl_float wave_start = -M_PI / 2.0f;
+
+        const cl_float waveValue = sin(2.0f * M_PI * wave_frequency
+                                       * state.wavePhase + wave_start)
+                                   * wave_push_length / 2.0f
+                                   + wave_push_length / 2.0f;
+
+        simulation.setWaveGenerator(waveValue);
+        state.wavePhase += parameters.timeStepLength;
+      }
+
+      // After the wave update, so the generator of the next step is saved
+      // together with its phase
+      if (parameters.checkpointOutFreq > 0
+          && state.steps % parameters.checkpointOutFreq == 0) {
+        simulation.saveCheckpoint(parameters.checkpointOutName, state);
+      }
+    } while (state.time <= parameters.timeEnd && state.steps < endSteps
+             && (frameLength > 0.0 ? glfwGetTime() - start < frameLength
+                 : substeps < parameters.substeps));
 
-      simulation.setWaveGenerator(waveValue);
-      wave += parameters.timeStepLength;
-    }
+    //#if defined(USE_DEBUG)
+    // printf("physics:           %f msec\n", (end - start) * 1000);
+    //#endif // USE_DEBUG
 
     // start = glfwGetTime();
 
-    // Visualize particles
-    renderer.visualizeParticles();
-    renderer.checkInput(shouldGenerateWaves);
+    // Visualize particles of the frame before, the device works on the
+    // steps just enqueued meanwhile
+    renderer.visualizeParticles( simulation.presentFrame() );
+    renderer.checkInput(state.generateWaves);
 
     // end = glfwGetTime();
     //#if defined(USE_DEBUG)
     // printf("graphics:          %f msec\n", (end - start) * 1000);
     //#endif // USE_DEBUG
 
-    if ( !shouldGenerateWaves ) {
-      wave = 0.0f;
+    if ( !state.generateWaves ) {
+      state.wavePhase = 0.0f;
     }
 
     end = glfwGetTime();
@@ -127,10 +173,12 @@ void Runner::run(const ConfigParameters &parameters,
 #endif
 
 #if defined(USE_DEBUG)
-    cout << "Time: " << time << endl;
+    cout << "Time: " << state.time << endl;
 #endif // USE_DEBUG
 
-  } while (time <= parameters.timeEnd);
+  } while (state.time <= parameters.timeEnd && state.steps < endSteps);
+
+  simulation.finishStep();
 
   double sum = std::accumulate(times.begin(), times.end(), 0.0);
   double mean = sum / times.size();
@@ -148,6 +196,21 @@ void Runner::run(const ConfigParameters &parameters,
   cout << "mean: " << mean << endl;
   cout << "median: " << median << endl;
   cout << "std: " << stdev << endl;
+  cout << "steps per frame: "
+       << (double) (state.steps - startSteps) / times.size() << endl;
+
+  const map<string, double> &counters = simulation.getProfiler().getCounters();
+
+  for (map<string, double>::const_iterator cit = counters.begin();
+       cit != counters.end(); ++cit) {
+    cout << cit->first << ": " << cit->second << endl;
+  }
+
+  if ( simulation.getProfiler().isEnabled() ) {
+    std::ofstream ofs( parameters.profileOutName.c_str() );
+    simulation.getProfiler().writeJSON(ofs);
+    cout << "kernel profile: " << parameters.profileOutName << endl;
+  }
 
 #if defined(USE_DEBUG)
   cout << "[END] Runner" << endl;
@@ -1,6 +1,8 @@
 #include "Simulation.hpp"
 
 #include <cstdio>
+#include <cstring>
+#include <sstream>
 
 #if defined(__APPLE__)
 #include <OpenGL/OpenGL.h>
@@ -20,41 +22,191 @@ using std::max;
 using std::ceil;
 
 
-#if !defined(USE_LINKEDCELL)
+// Work-groups and their size for the reductions
+static const unsigned int _REDUCTION_GROUPS = 64;
+static const unsigned int _REDUCTION_ITEMS = 128;
+
+// Work-items per cell and staged particles per tile of the tiled solver
+static const unsigned int _TILE_ITEMS = 64;
+
+// Steps enqueued before the host waits for them
+static const unsigned int _MAX_PENDING_STEPS = 8;
+
 // RADIX SORT CONSTANTS
 static const unsigned int _ITEMS = 16;
 static const unsigned int _GROUPS = 16;
 static const unsigned int _BITS = 6;
 static const unsigned int _RADIX = 1 << _BITS;
-static unsigned int _NKEYS = 0;
 static const unsigned int _HISTOSPLIT = 512;
-#endif
+static const unsigned int _MAXMEMCACHE = std::max(_HISTOSPLIT, _ITEMS * _GROUPS
+                                         * _RADIX / _HISTOSPLIT);
+
+// Work-group size of the counting sort scan, each item scans two counts
+static const unsigned int _SCAN_ITEMS = 128;
+
+
+vector<string>
+Simulation::kernelFiles(void) {
+  static const char *files[] = {
+    "predict_positions.cl",
+    "init_cells_old.cl",
+    "update_cells.cl",
+    "compute_scaling.cl",
+    "compute_delta.cl",
+    "compute_scaling_tiled.cl",
+    "compute_delta_tiled.cl",
+    "update_predicted.cl",
+    "update_velocities.cl",
+    "apply_vorticity_and_viscosity.cl",
+    "update_positions.cl",
+    "calc_hash.cl",
+    "radix_histogram.cl",
+    "radix_scan.cl",
+    "radix_paste.cl",
+    "radix_reorder.cl",
+    "init_cells.cl",
+    "find_cells.cl",
+    "counting_sort.cl",
+    "permute_particles.cl",
+    "build_neighbour_lists.cl",
+    "max_displacement.cl",
+    "density_error.cl",
+    "statistics.cl"
+  };
+
+  return vector<string>( files, files + sizeof(files) / sizeof(files[0]) );
+}
 
+string
+Simulation::buildOptions(const ConfigParameters &parameters,
+                         const size_t numParticles) {
+  std::ostringstream clflags;
+  clflags << "-cl-mad-enable -cl-no-signed-zeros -cl-fast-relaxed-math ";
+
+#ifdef USE_DEBUG
+  clflags << "-DUSE_DEBUG ";
+#endif // USE_DEBUG
+
+  // Selects the cell arguments of the kernels walking neighbour cells
+  if (parameters.neighbourSearch == NEIGHBOUR_SEARCH_LINKED_CELL) {
+    clflags << "-DUSE_LINKEDCELL ";
+  }
+
+  if (parameters.reorderParticles) {
+    clflags << "-DUSE_SORTED_PARTICLES ";
+  }
+
+  if (parameters.neighbourLists) {
+    clflags << "-DUSE_NEIGHBOUR_LISTS ";
+  }
+
+  if (parameters.fusedUpdate) {
+    clflags << "-DUSE_FUSED_UPDATE ";
+  }
+
+  if (parameters.mortonCells) {
+    clflags << "-DUSE_MORTON ";
+  }
+
+  if (parameters.hashedCells) {
+    clflags << "-DUSE_HASHED_CELLS -DHASH_TABLE_SIZE="
+            << hashTableSlots(parameters, numParticles) << "u ";
+  }
+
+  // Component planes of the particle buffers are a particle count apart
+  if (parameters.structOfArrays) {
+    clflags << "-DUSE_SOA -DPARTICLE_STRIDE=" << numParticles << " ";
+  }
+
+  clflags << std::showpoint;
+  clflags << "-DSYSTEM_MIN_X=" << parameters.xMin << "f ";
+  clflags << "-DSYSTEM_MAX_X=" << parameters.xMax << "f ";
+  clflags << "-DSYSTEM_MIN_Y=" << parameters.yMin << "f ";
+  clflags << "-DSYSTEM_MAX_Y=" << parameters.yMax << "f ";
+  clflags << "-DSYSTEM_MIN_Z=" << parameters.zMin << "f ";
+  clflags << "-DSYSTEM_MAX_Z=" << parameters.zMax << "f ";
+  clflags << "-DNUMBER_OF_CELLS_X=" << parameters.xN << "f ";
+  clflags << "-DNUMBER_OF_CELLS_Y=" << parameters.yN << "f ";
+  clflags << "-DNUMBER_OF_CELLS_Z=" << parameters.zN << "f ";
+  clflags << "-DCELL_LENGTH_X=" << (parameters.xMax - parameters.xMin) / parameters.xN << "f ";
+  clflags << "-DCELL_LENGTH_Y=" << (parameters.yMax - parameters.yMin) / parameters.yN << "f ";
+  clflags << "-DCELL_LENGTH_Z=" << (parameters.zMax - parameters.zMin) / parameters.zN << "f ";
+  clflags << "-DTIMESTEP=" << parameters.timeStepLength << "f ";
+  clflags << "-DREST_DENSITY=" << parameters.restDensity << "f ";
+  float h = (parameters.xMax - parameters.xMin) / parameters.xN;
+  clflags << "-DPBF_H=" << h << "f ";
+  clflags << "-DPBF_H_2=" << pow(h, 2) << "f ";
+  clflags << "-DPOLY6_FACTOR=" << 315.0f / (64.0f * M_PI * pow(h, 9)) << "f ";
+  clflags << "-DGRAD_SPIKY_FACTOR=" << 45.0f / (M_PI * pow(h, 6)) << "f ";
+  // Neighbour lists include the skin, which may reach beyond the
+  // adjacent cells
+  const float radius = h + parameters.neighbourSkin;
+  clflags << "-DNEIGHBOUR_RADIUS_2=" << radius * radius << "f ";
+  clflags << "-DNEIGHBOUR_CELL_RANGE=" << (int) ceil(radius / h) << " ";
+
+  return clflags.str();
+}
 
 Simulation::Simulation(const ConfigParameters &parameters,
-                       const vector<Particle> &particles,
+                       const ParticleView &particles,
                        const map<string, cl::Kernel> kernels,
                        const cl::Context &clContext,
                        const cl::Device &clDevice,
-                       const GLuint sharingBufferID)
+                       const GLuint sharingBufferID,
+                       const GLuint renderBufferID)
   : mCLContext(clContext),
     mCLDevice(clDevice),
     mKernels(kernels),
+    mTuner(clDevice, parameters.clWorkGroupSize1D, parameters.tuningDir),
     mTimestepLength(parameters.timeStepLength),
     mTimeEnd(parameters.timeEnd),
+    mRestDensity(parameters.restDensity),
     mNumParticles( particles.size() ),
+    mCellCount( parameters.hashedCells
+                ? hashTableSlots( parameters, particles.size() )
+                : cellSlots(parameters) ),
     mBufferSizeParticles( particles.size() * sizeof(cl_float4) ),
-    mBufferSizeCells( parameters.xN *parameters.yN *parameters.zN
-                      * sizeof(cl_int) ),
+    mBufferSizeCells( mCellCount * sizeof(cl_int) ),
     mBufferSizeParticlesList( particles.size() * sizeof(cl_int) ),
     mBufferSizeScalingFactors( particles.size() * sizeof(cl_float) ),
     mParticles(particles),
     mPositions(NULL),
     mVelocities(NULL),
+    mNeighbourSearch(parameters.neighbourSearch),
+    mReorderParticles(parameters.reorderParticles
+                      && parameters.neighbourSearch
+                      != NEIGHBOUR_SEARCH_LINKED_CELL),
+    mStructOfArrays(parameters.structOfArrays),
+    mFusedUpdate(parameters.fusedUpdate),
+    mTiledSolver(parameters.tiledSolver && mReorderParticles
+                 && !parameters.neighbourLists),
+    mUseNeighbourLists(parameters.neighbourLists),
+    mMaxNeighbours(parameters.maxNeighbours),
+    mNeighbourOverflows(_MAX_PENDING_STEPS, 0),
+    mNeighbourOverflowTotal(0),
+    mNeighbourSkin(parameters.neighbourSkin),
+    mRebuildNeighbours(true),
+    mNeighbourBuilds(0),
+    mSteps(0),
+    mStepsPending(0),
+    mPendingIterations(0),
+    mSolverIterations(parameters.solverIterations),
+    mAdaptiveSolver(parameters.adaptiveSolver),
+    mSolverMinIterations(parameters.solverMinIterations),
+    mSolverMaxIterations(parameters.solverMaxIterations),
+    mSolverTolerance(parameters.solverTolerance),
+    mSolverIterationsTotal(0),
+    mMaxDensityError(0.0f),
+    mAverageDensityError(0.0f),
     mCells(NULL),
     mParticlesList(NULL),
     mWaveGenerator(0.0f),
-    mSharingBufferID(sharingBufferID) {
+    mSharingBufferID(sharingBufferID),
+    mRenderBufferID(renderBufferID),
+    mUseGLSharing(sharingBufferID != 0),
+    mImplicitGLSync(false),
+    mDisplayPending(false),
+    mRenderPending(false) {
 
 #if defined(USE_DEBUG)
   cout << "[START] Simulation::Simulation" << endl;
@@ -75,12 +227,30 @@ Simulation::Simulation(const ConfigParameters &parameters,
   mNumberCells.s[0] = parameters.xN;
   mNumberCells.s[1] = parameters.yN;
   mNumberCells.s[2] = parameters.zN;
+  mNumberCells.s[3] = 0;
 
   mCellLength.s[0] = (parameters.xMax - parameters.xMin) / parameters.xN;
   mCellLength.s[1] = (parameters.yMax - parameters.yMin) / parameters.yN;
   mCellLength.s[2] = (parameters.zMax - parameters.zMin) / parameters.zN;
   mCellLength.s[3] = 0.0f;
 
+  mTuner.setTuning(parameters.autotune);
+
+  // The radix kernels work on a multiple of _ITEMS * _GROUPS keys
+  mRadixKeys = (mNumParticles + _ITEMS * _GROUPS - 1) / (_ITEMS * _GROUPS)
+               * (_ITEMS * _GROUPS);
+
+  // Enough digits of _BITS for every cell index, padding keys get the
+  // largest representable key so they sort behind all particles
+  cl_uint keyBits = 0;
+
+  while (keyBits < 32 && (cl_ulong) 1 << keyBits < mCellCount) {
+    ++keyBits;
+  }
+
+  mRadixPasses = (keyBits + _BITS - 1) / _BITS;
+  mRadixMaxKey = (cl_uint) (((cl_ulong) 1 << (mRadixPasses * _BITS)) - 1);
+
 #if defined(USE_DEBUG)
   cout << "[END] Simulation::Simulation" << endl;
 #endif // USE_DEBUG
@@ -88,16 +258,17 @@ Simulation::Simulation(const ConfigParameters &parameters,
 }
 
 Simulation::~Simulation () {
-  glFinish();
+  if (mUseGLSharing) {
+    glFinish();
+  }
+
   mQueue.finish();
 
   // Delete buffers
   delete[] mCells;
   delete[] mPositions;
   delete[] mVelocities;
-#if !defined(USE_LINKEDCELL)
-  delete[] mRadixCells;
-#endif // USE_LINKEDCELL
+  delete[] mParticlesList;
 }
 
 
@@ -109,106 +280,212 @@ Simulation::init(void) {
   cout << "Number of particles: " << mNumParticles << endl;
 #endif // USE_DEBUG
 
-  // setup buffers
-  mPositions = new cl_float4[mNumParticles];
-  mVelocities = new cl_float4[mNumParticles];
-#if !defined(USE_LINKEDCELL)
-  mRadixCells = new cl_uint2[_NKEYS];
-#endif // USE_LINKEDCELL
+  // Profiling events are only recorded if requested before init, the
+  // autotuner times its launches the same way
+  mQueue = cl::CommandQueue(mCLContext, mCLDevice,
+                            mProfiler.isEnabled() || mTuner.isTuning()
+                            ? CL_QUEUE_PROFILING_ENABLE : 0);
 
-  // Initialize particle arrays
-  for (cl_uint i = 0; i < mNumParticles; ++i) {
-    Particle p = mParticles[i];
+  this->resolveKernels();
+
+  // Also while tuning, so sizes of kernels not run now are kept
+  mTuner.load();
+
+  // TODO: buffer could be changed to be CL_MEM_WRITE_ONLY
+  // but for debugging also reading it might be helpful
+#if defined(USE_DEBUG)
+  printf("simulation::init: sharingID: %d\n", mSharingBufferID);
+#endif // USE_DEBUG
+
+  vector<cl::Memory> sharedBuffers;
+
+  if (mUseGLSharing) {
+    const string extensions = mCLDevice.getInfo<CL_DEVICE_EXTENSIONS>();
+    mImplicitGLSync = extensions.find("cl_khr_gl_event") != string::npos;
+
+    mDisplayBuffer = cl::BufferGL(mCLContext, CL_MEM_READ_WRITE,
+                                  mSharingBufferID);
+    mRenderBuffer = cl::BufferGL(mCLContext, CL_MEM_READ_WRITE,
+                                 mRenderBufferID);
 
-    mPositions[i].s[0] = p.x[0];
-    mPositions[i].s[1] = p.x[1];
-    mPositions[i].s[2] = p.x[2];
+    sharedBuffers.push_back(mDisplayBuffer);
+    sharedBuffers.push_back(mRenderBuffer);
+    this->acquireGLObjects(sharedBuffers);
+  } else {
+    mDisplayBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
+                                mBufferSizeParticles);
+  }
+
+  if (this->separatePositions()) {
+    mPositionsBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
+                                  mBufferSizeParticles);
+    mUnpermutedBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
+                                   mBufferSizeParticles);
+  } else {
+    mPositionsBuffer = mDisplayBuffer;
+  }
+
+  mVelocitiesBuffer = cl::Buffer(mCLContext,
+                                 CL_MEM_READ_WRITE, mBufferSizeParticles);
+
+  // Fill the device buffers straight from the particle view, no host copy
+  cl_float4 *positions = (cl_float4 *) mQueue.enqueueMapBuffer(
+                           mDisplayBuffer, CL_TRUE, CL_MAP_WRITE,
+                           0, mBufferSizeParticles);
+  cl_float4 *velocities = (cl_float4 *) mQueue.enqueueMapBuffer(
+                            this->velocitiesUpload(), CL_TRUE, CL_MAP_WRITE,
+                            0, mBufferSizeParticles);
+
+  for (cl_uint i = 0; i < mNumParticles; ++i) {
+    positions[i].s[0] = mParticles.position(i, 0);
+    positions[i].s[1] = mParticles.position(i, 1);
+    positions[i].s[2] = mParticles.position(i, 2);
     // to save space we use the 4th component for the mass and timestep term
-    mPositions[i].s[3] = 0.0f;
+    positions[i].s[3] = 0.0f;
 
-    mVelocities[i].s[0] = p.v[0];
-    mVelocities[i].s[1] = p.v[1];
-    mVelocities[i].s[2] = p.v[2];
+    velocities[i].s[0] = mParticles.velocity(i, 0);
+    velocities[i].s[1] = mParticles.velocity(i, 1);
+    velocities[i].s[2] = mParticles.velocity(i, 2);
     // to save space we use the 4th component for the timestep
-    mVelocities[i].s[3] = p.m;
+    velocities[i].s[3] = mParticles.mass(i);
   }
 
-  mQueue = cl::CommandQueue(mCLContext, mCLDevice);
+  mQueue.enqueueUnmapMemObject(mDisplayBuffer, positions);
+  mQueue.enqueueUnmapMemObject(this->velocitiesUpload(), velocities);
 
-  const cl_uint globalSize = ceil(mNumParticles / 32.0f) * 32;
+  // The first frame shows the initial positions
+  if (mUseGLSharing) {
+    mQueue.enqueueCopyBuffer(mDisplayBuffer, mRenderBuffer,
+                             0, 0, mBufferSizeParticles);
+  }
 
-  mGlobalRange = cl::NDRange(globalSize);
-  mLocalRange = cl::NullRange;
+  if (mReorderParticles) {
+    mParticleIdsBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
+                                    mNumParticles * sizeof(cl_uint));
+    mParticleIdsSortedBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
+                                          mNumParticles * sizeof(cl_uint));
+    mPositionsSortedBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
+                                        mBufferSizeParticles);
+    mPredictedSortedBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
+                                        mBufferSizeParticles);
+    mVelocitiesSortedBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
+                                         mBufferSizeParticles);
+  }
 
-  // TODO: buffer could be changed to be CL_MEM_WRITE_ONLY
-  // but for debugging also reading it might be helpful
-#if defined(USE_DEBUG)
-  printf("simulation::init: sharingID: %d\n", mSharingBufferID);
-#endif // USE_DEBUG
+  if (this->separatePositions()) {
+    this->resetParticleOrder();
+  }
 
-  mPositionsBuffer = cl::BufferGL(mCLContext, CL_MEM_READ_WRITE,
-                                  mSharingBufferID);
+  if (mUseNeighbourLists) {
+    mNeighboursBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
+                                   sizeof(cl_int) * mMaxNeighbours
+                                   * mNumParticles);
+    mNeighbourCountsBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
+                                        sizeof(cl_int) * mNumParticles);
+    mNeighbourOverflowBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
+                                          sizeof(cl_uint));
+  }
 
-  vector<cl::Memory> sharedBuffers;
+  if (mUseNeighbourLists && mNeighbourSkin > 0.0f) {
+    mBuildPositionsBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
+                                       mBufferSizeParticles);
+    mDisplacementBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
+                                     sizeof(cl_float) * _REDUCTION_GROUPS);
+    mDisplacements.resize(_REDUCTION_GROUPS);
+  }
+
+  if (mAdaptiveSolver) {
+    mDensityErrorBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
+                                     sizeof(cl_float2) * _REDUCTION_GROUPS);
+    mDensityErrors.resize(_REDUCTION_GROUPS);
+  }
+
+  // A few hundred bytes, allocated whether or not statistics are written
+  mGroupStatisticsBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
+                                      sizeof(cl_float) * _STAT_VALUES
+                                      * _REDUCTION_GROUPS);
+  mGroupHistogramBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
+                                     sizeof(cl_uint) * _STAT_BINS
+                                     * _REDUCTION_GROUPS);
+  mStatisticsBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
+                                 sizeof(cl_float) * _STAT_VALUES);
+  mStatisticsHistogramBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
+                                          sizeof(cl_uint) * _STAT_BINS);
+
+  this->releaseGLObjects(sharedBuffers);
 
-  sharedBuffers.push_back(mPositionsBuffer);
-  mQueue.enqueueAcquireGLObjects(&sharedBuffers);
-  mQueue.enqueueWriteBuffer(mPositionsBuffer, CL_TRUE,
-                            0, mBufferSizeParticles, mPositions);
-  mQueue.enqueueReleaseGLObjects(&sharedBuffers);
   mQueue.finish();
 
   mPredictedBuffer = cl::Buffer(mCLContext,
                                 CL_MEM_READ_WRITE, mBufferSizeParticles);
 
-  mVelocitiesBuffer = cl::Buffer(mCLContext,
-                                 CL_MEM_READ_WRITE, mBufferSizeParticles);
-  mQueue.enqueueWriteBuffer(mVelocitiesBuffer, CL_TRUE,
-                            0, mBufferSizeParticles, mVelocities);
-
-  mDeltaBuffer = cl::Buffer(mCLContext,
-                            CL_MEM_READ_WRITE, mBufferSizeParticles);
+  if (mFusedUpdate) {
+    mPredictedNextBuffer = cl::Buffer(mCLContext,
+                                      CL_MEM_READ_WRITE, mBufferSizeParticles);
+  } else {
+    mDeltaBuffer = cl::Buffer(mCLContext,
+                              CL_MEM_READ_WRITE, mBufferSizeParticles);
+  }
   mDeltaVelocityBuffer = cl::Buffer(mCLContext,
                                     CL_MEM_READ_WRITE, mBufferSizeParticles);
 
   mScalingFactorsBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
                                      mBufferSizeScalingFactors);
 
-#if !defined(USE_LINKEDCELL)
-  // get closest multiple to of items/groups
-  if (mNumParticles % (_ITEMS * _GROUPS) == 0) {
-    _NKEYS = mNumParticles;
-  } else {
-    _NKEYS = mNumParticles + (_ITEMS * _GROUPS)
-             - mNumParticles % (_ITEMS * _GROUPS);
+  if (mNeighbourSearch != NEIGHBOUR_SEARCH_LINKED_CELL) {
+    mRadixCellsBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
+                                   sizeof(cl_uint2) * mRadixKeys);
+    mRadixCellsOutBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
+                                      sizeof(cl_uint2) * mRadixKeys);
+    mFoundCellsBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
+                                   sizeof(cl_int2) * mCellCount);
+    // Receives the total of the last scan
+    mRadixTotalSumBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
+                                      sizeof(cl_uint));
+  }
+
+  if (mNeighbourSearch == NEIGHBOUR_SEARCH_COUNTING) {
+    // One more entry than cells, its offset is the number of particles
+    cl_uint entries = mCellCount + 1;
+
+    do {
+      const cl_uint groupCounts = 2 * _SCAN_ITEMS;
+      const cl_uint size = (entries + groupCounts - 1) / groupCounts
+                           * groupCounts;
+
+      mCellOffsetsSizes.push_back(size);
+      mCellOffsetsBuffers.push_back( cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
+                                     sizeof(cl_uint) * size) );
+
+      entries = size / groupCounts;
+    } while (mCellOffsetsSizes.back() > 2 * _SCAN_ITEMS);
   }
 
-  mRadixCellsBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
-                                 sizeof(cl_uint2) * _NKEYS);
-  mRadixCellsOutBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
-                                    sizeof(cl_uint2) * _NKEYS);
-  mFoundCellsBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
-                                 sizeof(cl_int2) * mNumberCells.s[0]
-                                 * mNumberCells.s[1] * mNumberCells.s[2]);
+  if (mNeighbourSearch == NEIGHBOUR_SEARCH_RADIX) {
+    mRadixHistogramBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
+                                       sizeof(cl_uint) * _RADIX * _ITEMS * _GROUPS);
+    mRadixGlobSumBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
+                                     sizeof(cl_uint) * _HISTOSPLIT);
+  }
 
-  mRadixHistogramBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
-                                     sizeof(cl_uint) * _RADIX * _ITEMS * _GROUPS);
-  mRadixGlobSumBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE,
-                                   sizeof(cl_uint) * _HISTOSPLIT);
-#endif // USE_LINKEDCELL
+  this->bindParticleArgs();
+  this->bindCellArgs();
 
   mQueue.finish();
 }
 
 void
 Simulation::initCells(void) {
-  const cl_uint cellCount = mNumberCells.s[0]
-                            * mNumberCells.s[1] * mNumberCells.s[2];
-  mCells = new cl_int[cellCount];
+  // The sorted cells are rebuilt from scratch every step
+  if (mNeighbourSearch != NEIGHBOUR_SEARCH_LINKED_CELL) {
+    return;
+  }
+
+  mCells = new cl_int[mCellCount];
   mParticlesList = new cl_int[mNumParticles];
 
   // Init cells
-  for (cl_uint i = 0; i < cellCount; ++i) {
+  for (cl_uint i = 0; i < mCellCount; ++i) {
     mCells[i] = END_OF_CELL_LIST;
   }
 
@@ -227,206 +504,441 @@ Simulation::initCells(void) {
                                     CL_MEM_READ_WRITE, mBufferSizeParticlesList);
   mQueue.enqueueWriteBuffer(mParticlesListBuffer, CL_TRUE,
                             0, mBufferSizeParticlesList, mParticlesList);
+
+  this->bindCellArgs();
 }
 
 void
 Simulation::updatePositions(void) {
-  mKernels["updatePositions"].setArg(0, mPositionsBuffer);
-  mKernels["updatePositions"].setArg(1, mPredictedBuffer);
-  mKernels["updatePositions"].setArg(2, mVelocitiesBuffer);
-  mKernels["updatePositions"].setArg(3, mDeltaVelocityBuffer);
-  mKernels["updatePositions"].setArg(4, mNumParticles);
-
-  mQueue.enqueueNDRangeKernel(mKernels["updatePositions"], 0,
-                              mGlobalRange, mLocalRange);
+  this->launch(mUpdatePositionsKernel, "updatePositions", mNumParticles);
 }
 
 void
 Simulation::updateVelocities(void) {
-  mKernels["updateVelocities"].setArg(0, mPositionsBuffer);
-  mKernels["updateVelocities"].setArg(1, mPredictedBuffer);
-  mKernels["updateVelocities"].setArg(2, mVelocitiesBuffer);
-  mKernels["updateVelocities"].setArg(3, mNumParticles);
-
-  mQueue.enqueueNDRangeKernel(mKernels["updateVelocities"], 0,
-                              mGlobalRange, mLocalRange);
+  this->launch(mUpdateVelocitiesKernel, "updateVelocities", mNumParticles);
 }
 
 void
 Simulation::applyVorticityAndViscosity(void) {
-  mKernels["applyVorticityAndViscosity"].setArg(0, mPredictedBuffer);
-  mKernels["applyVorticityAndViscosity"].setArg(1, mVelocitiesBuffer);
-  mKernels["applyVorticityAndViscosity"].setArg(2, mDeltaVelocityBuffer);
-#if defined(USE_LINKEDCELL)
-  mKernels["applyVorticityAndViscosity"].setArg(3, mCellsBuffer);
-  mKernels["applyVorticityAndViscosity"].setArg(4, mParticlesListBuffer);
-#else
-  mKernels["applyVorticityAndViscosity"].setArg(3, mRadixCellsBuffer);
-  mKernels["applyVorticityAndViscosity"].setArg(4, mFoundCellsBuffer);
-#endif // USE_LINKEDCELL
-  mKernels["applyVorticityAndViscosity"].setArg(5, mNumParticles);
-
-  mQueue.enqueueNDRangeKernel(mKernels["applyVorticityAndViscosity"],
-                              0, mGlobalRange, mLocalRange);
+  this->launch(mApplyVorticityAndViscosityKernel,
+               "applyVorticityAndViscosity", mNumParticles);
 }
 
 void
 Simulation::predictPositions(void) {
-  mKernels["predictPositions"].setArg(0, mPositionsBuffer);
-  mKernels["predictPositions"].setArg(1, mPredictedBuffer);
-  mKernels["predictPositions"].setArg(2, mVelocitiesBuffer);
-  mKernels["predictPositions"].setArg(3, mNumParticles);
-
-  mQueue.enqueueNDRangeKernel(mKernels["predictPositions"], 0,
-                              mGlobalRange, mLocalRange);
+  this->launch(mPredictPositionsKernel, "predictPositions", mNumParticles);
 }
 
 void
 Simulation::updatePredicted(void) {
-  mKernels["updatePredicted"].setArg(0, mPredictedBuffer);
-  mKernels["updatePredicted"].setArg(1, mDeltaBuffer);
-  mKernels["updatePredicted"].setArg(2, mNumParticles);
-
-  mQueue.enqueueNDRangeKernel(mKernels["updatePredicted"], 0,
-                              mGlobalRange, mLocalRange);
+  this->launch(mUpdatePredictedKernel, "updatePredicted", mNumParticles);
 }
 
 void
 Simulation::computeDelta(void) {
-  mKernels["computeDelta"].setArg(0, mDeltaBuffer);
-  mKernels["computeDelta"].setArg(1, mPredictedBuffer);
-  mKernels["computeDelta"].setArg(2, mScalingFactorsBuffer);
-#if defined(USE_LINKEDCELL)
-  mKernels["computeDelta"].setArg(3, mCellsBuffer);
-  mKernels["computeDelta"].setArg(4, mParticlesListBuffer);
-#else
-  mKernels["computeDelta"].setArg(3, mRadixCellsBuffer);
-  mKernels["computeDelta"].setArg(4, mFoundCellsBuffer);
-#endif
-  mKernels["computeDelta"].setArg(5, mWaveGenerator);
-  mKernels["computeDelta"].setArg(6, mNumParticles);
+  if (mTiledSolver) {
+    this->computeDeltaTiled();
+    return;
+  }
 
-  mQueue.enqueueNDRangeKernel(mKernels["computeDelta"], 0,
-                              mGlobalRange, mLocalRange);
+  // The fused update swaps the predicted buffers every iteration
+  if (mFusedUpdate) {
+    mComputeDeltaKernel.setArg(0, mPredictedNextBuffer);
+    mComputeDeltaKernel.setArg(1, mPredictedBuffer);
+  }
+
+  mComputeDeltaKernel.setArg(5, mWaveGenerator);
+
+  this->launch(mComputeDeltaKernel, "computeDelta", mNumParticles);
+
+  if (mFusedUpdate) {
+    std::swap(mPredictedBuffer, mPredictedNextBuffer);
+  }
 }
 
 void
 Simulation::computeScaling(void) {
-  mKernels["computeScaling"].setArg(0, mPredictedBuffer);
-  mKernels["computeScaling"].setArg(1, mScalingFactorsBuffer);
-#if defined(USE_LINKEDCELL)
-  mKernels["computeScaling"].setArg(2, mCellsBuffer);
-  mKernels["computeScaling"].setArg(3, mParticlesListBuffer);
-#else
-  mKernels["computeScaling"].setArg(2, mRadixCellsBuffer);
-  mKernels["computeScaling"].setArg(3, mFoundCellsBuffer);
-#endif
-  mKernels["computeScaling"].setArg(4, mNumParticles);
+  if (mTiledSolver) {
+    this->computeScalingTiled();
+    return;
+  }
 
-  mQueue.enqueueNDRangeKernel(mKernels["computeScaling"], 0,
-                              mGlobalRange, mLocalRange);
+  if (mFusedUpdate) {
+    mComputeScalingKernel.setArg(0, mPredictedBuffer);
+  }
+
+  this->launch(mComputeScalingKernel, "computeScaling", mNumParticles);
 }
 
 void
-Simulation::updateCells(void) {
-  mKernels["initCellsOld"].setArg(0, mCellsBuffer);
-  mKernels["initCellsOld"].setArg(1, mParticlesListBuffer);
-  mKernels["initCellsOld"].setArg(2, mNumberCells.s[0]
-                                  * mNumberCells.s[1] * mNumberCells.s[2]);
-  mKernels["initCellsOld"].setArg(3, mNumParticles);
+Simulation::launch(cl::Kernel &kernel, const char *name,
+                   const cl_uint items) {
+  const size_t localSize = mTuner.localSize(name, kernel);
+
+  // Kernels check their bounds, the range is padded to whole groups
+  if (localSize == 0) {
+    mQueue.enqueueNDRangeKernel(kernel, 0,
+                                cl::NDRange( (items + 31) / 32 * 32 ),
+                                cl::NullRange,
+                                NULL, mProfiler.event(name));
+    return;
+  }
+
+  // Samples of the tuner are not counted by the profiler
+  cl::Event *event = mTuner.event(name);
+
+  if (event == NULL) {
+    event = mProfiler.event(name);
+  }
 
-  mQueue.enqueueNDRangeKernel(mKernels["initCellsOld"], 0,
-                              cl::NDRange( max(mBufferSizeParticlesList,
-                                  mBufferSizeCells) ), mLocalRange);
+  mQueue.enqueueNDRangeKernel(kernel, 0,
+                              cl::NDRange( (items + localSize - 1)
+                                           / localSize * localSize ),
+                              cl::NDRange(localSize),
+                              NULL, event);
+}
+
+cl::Kernel
+Simulation::findKernel(const string &name) const {
+  map<string, cl::Kernel>::const_iterator it = mKernels.find(name);
 
-  mKernels["updateCells"].setArg(0, mPredictedBuffer);
-  mKernels["updateCells"].setArg(1, mCellsBuffer);
-  mKernels["updateCells"].setArg(2, mParticlesListBuffer);
-  mKernels["updateCells"].setArg(3, mNumParticles);
+  if ( it == mKernels.end() ) {
+    throw runtime_error("Kernel not found in the program: " + name);
+  }
 
-  mQueue.enqueueNDRangeKernel(mKernels["updateCells"], 0,
-                              mGlobalRange, mLocalRange);
+  return it->second;
+}
+
+void
+Simulation::resolveKernels(void) {
+  mPredictPositionsKernel = this->findKernel("predictPositions");
+  mUpdatePredictedKernel = this->findKernel("updatePredicted");
+  mComputeScalingKernel = this->findKernel("computeScaling");
+  mComputeDeltaKernel = this->findKernel("computeDelta");
+  mComputeScalingTiledKernel = this->findKernel("computeScalingTiled");
+  mComputeDeltaTiledKernel = this->findKernel("computeDeltaTiled");
+  mUpdateVelocitiesKernel = this->findKernel("updateVelocities");
+  mApplyVorticityAndViscosityKernel =
+    this->findKernel("applyVorticityAndViscosity");
+  mUpdatePositionsKernel = this->findKernel("updatePositions");
+  mInitCellsOldKernel = this->findKernel("initCellsOld");
+  mUpdateCellsKernel = this->findKernel("updateCells");
+  mCalcHashKernel = this->findKernel("calcHash");
+  mHistogramKernel = this->findKernel("histogram");
+  mScanKernel = this->findKernel("scan");
+  mPasteKernel = this->findKernel("paste");
+  mReorderKernel = this->findKernel("reorder");
+  mInitCellsKernel = this->findKernel("initCells");
+  mFindCellsKernel = this->findKernel("findCells");
+  mClearCellCountsKernel = this->findKernel("clearCellCounts");
+  mCountCellsKernel = this->findKernel("countCells");
+  mScatterCellsKernel = this->findKernel("scatterCells");
+  mPermuteParticlesKernel = this->findKernel("permuteParticles");
+  mUnpermuteParticlesKernel = this->findKernel("unpermuteParticles");
+  mInterleaveParticlesKernel = this->findKernel("interleaveParticles");
+  mDeinterleaveParticlesKernel = this->findKernel("deinterleaveParticles");
+  mBuildNeighbourListsKernel = this->findKernel("buildNeighbourLists");
+  mMaxDisplacementKernel = this->findKernel("maxDisplacement");
+  mDensityErrorKernel = this->findKernel("densityError");
+  mParticleStatisticsKernel = this->findKernel("particleStatistics");
+  mCombineStatisticsKernel = this->findKernel("combineStatistics");
+
+  // The second scan of a radix pass gets its own kernel object, so both
+  // keep their arguments
+  mScanSumsKernel = cl::Kernel(mScanKernel.getInfo<CL_KERNEL_PROGRAM>(),
+                               "scan");
+}
+
+void
+Simulation::bindParticleArgs(void) {
+  mPredictPositionsKernel.setArg(0, mPositionsBuffer);
+  mPredictPositionsKernel.setArg(1, mPredictedBuffer);
+  mPredictPositionsKernel.setArg(2, mVelocitiesBuffer);
+  mPredictPositionsKernel.setArg(3, mNumParticles);
+
+  if (!mFusedUpdate) {
+    mUpdatePredictedKernel.setArg(0, mPredictedBuffer);
+    mUpdatePredictedKernel.setArg(1, mDeltaBuffer);
+    mUpdatePredictedKernel.setArg(2, mNumParticles);
+  }
+
+  const cl::Buffer &deltaOut = mFusedUpdate ? mPredictedNextBuffer
+                               : mDeltaBuffer;
+
+  if (mTiledSolver) {
+    mComputeScalingTiledKernel.setArg(0, mPredictedBuffer);
+    mComputeScalingTiledKernel.setArg(1, mScalingFactorsBuffer);
+    mComputeScalingTiledKernel.setArg(3, sizeof(cl_float4) * _TILE_ITEMS,
+                                      NULL);
+    mComputeScalingTiledKernel.setArg(4, mNumParticles);
+
+    mComputeDeltaTiledKernel.setArg(0, deltaOut);
+    mComputeDeltaTiledKernel.setArg(1, mPredictedBuffer);
+    mComputeDeltaTiledKernel.setArg(2, mScalingFactorsBuffer);
+    mComputeDeltaTiledKernel.setArg(4, sizeof(cl_float4) * _TILE_ITEMS,
+                                    NULL);
+    mComputeDeltaTiledKernel.setArg(6, mNumParticles);
+  } else {
+    mComputeScalingKernel.setArg(0, mPredictedBuffer);
+    mComputeScalingKernel.setArg(1, mScalingFactorsBuffer);
+    mComputeScalingKernel.setArg(4, mNumParticles);
+
+    mComputeDeltaKernel.setArg(0, deltaOut);
+    mComputeDeltaKernel.setArg(1, mPredictedBuffer);
+    mComputeDeltaKernel.setArg(2, mScalingFactorsBuffer);
+    mComputeDeltaKernel.setArg(6, mNumParticles);
+  }
+
+  mUpdateVelocitiesKernel.setArg(0, mPositionsBuffer);
+  mUpdateVelocitiesKernel.setArg(1, mPredictedBuffer);
+  mUpdateVelocitiesKernel.setArg(2, mVelocitiesBuffer);
+  mUpdateVelocitiesKernel.setArg(3, mNumParticles);
+
+  mApplyVorticityAndViscosityKernel.setArg(0, mPredictedBuffer);
+  mApplyVorticityAndViscosityKernel.setArg(1, mVelocitiesBuffer);
+  mApplyVorticityAndViscosityKernel.setArg(2, mDeltaVelocityBuffer);
+  mApplyVorticityAndViscosityKernel.setArg(5, mNumParticles);
+
+  mUpdatePositionsKernel.setArg(0, mPositionsBuffer);
+  mUpdatePositionsKernel.setArg(1, mPredictedBuffer);
+  mUpdatePositionsKernel.setArg(2, mVelocitiesBuffer);
+  mUpdatePositionsKernel.setArg(3, mDeltaVelocityBuffer);
+  mUpdatePositionsKernel.setArg(4, mNumParticles);
+
+  if (mNeighbourSearch == NEIGHBOUR_SEARCH_LINKED_CELL) {
+    mUpdateCellsKernel.setArg(0, mPredictedBuffer);
+    mUpdateCellsKernel.setArg(3, mNumParticles);
+  } else if (mNeighbourSearch == NEIGHBOUR_SEARCH_COUNTING) {
+    mCountCellsKernel.setArg(0, mPredictedBuffer);
+    mCountCellsKernel.setArg(3, mNumParticles);
+  } else {
+    mCalcHashKernel.setArg(0, mPredictedBuffer);
+    mCalcHashKernel.setArg(2, mRadixMaxKey);
+    mCalcHashKernel.setArg(3, mNumParticles);
+    mCalcHashKernel.setArg(4, mRadixKeys);
+  }
+
+  if (mReorderParticles) {
+    mPermuteParticlesKernel.setArg(1, mPositionsBuffer);
+    mPermuteParticlesKernel.setArg(2, mPredictedBuffer);
+    mPermuteParticlesKernel.setArg(3, mVelocitiesBuffer);
+    mPermuteParticlesKernel.setArg(4, mParticleIdsBuffer);
+    mPermuteParticlesKernel.setArg(5, mPositionsSortedBuffer);
+    mPermuteParticlesKernel.setArg(6, mPredictedSortedBuffer);
+    mPermuteParticlesKernel.setArg(7, mVelocitiesSortedBuffer);
+    mPermuteParticlesKernel.setArg(8, mParticleIdsSortedBuffer);
+    mPermuteParticlesKernel.setArg(9, mNumParticles);
+  }
+
+  if (mUseNeighbourLists) {
+    mBuildNeighbourListsKernel.setArg(0, mPredictedBuffer);
+    mBuildNeighbourListsKernel.setArg(3, mNeighboursBuffer);
+    mBuildNeighbourListsKernel.setArg(4, mNeighbourCountsBuffer);
+    mBuildNeighbourListsKernel.setArg(5, mNeighbourOverflowBuffer);
+    mBuildNeighbourListsKernel.setArg(6, mMaxNeighbours);
+    mBuildNeighbourListsKernel.setArg(7, mNumParticles);
+  }
+
+  if (mUseNeighbourLists && mNeighbourSkin > 0.0f) {
+    mMaxDisplacementKernel.setArg(0, mPositionsBuffer);
+    mMaxDisplacementKernel.setArg(1, mVelocitiesBuffer);
+    mMaxDisplacementKernel.setArg(2, mBuildPositionsBuffer);
+    mMaxDisplacementKernel.setArg(3, mDisplacementBuffer);
+    mMaxDisplacementKernel.setArg(4, sizeof(cl_float) * _REDUCTION_ITEMS,
+                                  NULL);
+    mMaxDisplacementKernel.setArg(5, mNumParticles);
+  }
+
+  if (mAdaptiveSolver) {
+    mDensityErrorKernel.setArg(0, mPredictedBuffer);
+    mDensityErrorKernel.setArg(1, mDensityErrorBuffer);
+    mDensityErrorKernel.setArg(2, sizeof(cl_float2) * _REDUCTION_ITEMS, NULL);
+    mDensityErrorKernel.setArg(3, mNumParticles);
+  }
+
+  mParticleStatisticsKernel.setArg(0, mPositionsBuffer);
+  mParticleStatisticsKernel.setArg(1, mVelocitiesBuffer);
+  mParticleStatisticsKernel.setArg(2, mPredictedBuffer);
+  mParticleStatisticsKernel.setArg(3, mGroupStatisticsBuffer);
+  mParticleStatisticsKernel.setArg(4, mGroupHistogramBuffer);
+  mParticleStatisticsKernel.setArg(5, sizeof(cl_float) * _REDUCTION_ITEMS,
+                                   NULL);
+  mParticleStatisticsKernel.setArg(6, mNumParticles);
+
+  mCombineStatisticsKernel.setArg(0, mGroupStatisticsBuffer);
+  mCombineStatisticsKernel.setArg(1, mGroupHistogramBuffer);
+  mCombineStatisticsKernel.setArg(2, mStatisticsBuffer);
+  mCombineStatisticsKernel.setArg(3, mStatisticsHistogramBuffer);
+  mCombineStatisticsKernel.setArg(4, sizeof(cl_float) * _REDUCTION_GROUPS,
+                                  NULL);
+  mCombineStatisticsKernel.setArg(5, _REDUCTION_GROUPS);
+}
+
+void
+Simulation::bindCellArgs(void) {
+  if (mTiledSolver) {
+    mComputeScalingTiledKernel.setArg(2, mFoundCellsBuffer);
+    mComputeDeltaTiledKernel.setArg(3, mFoundCellsBuffer);
+  } else {
+    this->setNeighbourArgs(mComputeScalingKernel, 2);
+    this->setNeighbourArgs(mComputeDeltaKernel, 3);
+  }
+
+  this->setNeighbourArgs(mApplyVorticityAndViscosityKernel, 3);
+
+  if (mUseNeighbourLists) {
+    this->setCellArgs(mBuildNeighbourListsKernel, 1);
+  }
+
+  if (mNeighbourSearch == NEIGHBOUR_SEARCH_LINKED_CELL) {
+    mInitCellsOldKernel.setArg(0, mCellsBuffer);
+    mInitCellsOldKernel.setArg(1, mParticlesListBuffer);
+    mInitCellsOldKernel.setArg(2, mCellCount);
+    mInitCellsOldKernel.setArg(3, mNumParticles);
+
+    mUpdateCellsKernel.setArg(1, mCellsBuffer);
+    mUpdateCellsKernel.setArg(2, mParticlesListBuffer);
+
+    return;
+  }
+
+  if (mNeighbourSearch == NEIGHBOUR_SEARCH_COUNTING) {
+    // Ranks go into the spare cell buffer, the sorted cells are never
+    // swapped
+    mClearCellCountsKernel.setArg(0, mCellOffsetsBuffers[0]);
+    mClearCellCountsKernel.setArg(1, mCellOffsetsSizes[0]);
+
+    mCountCellsKernel.setArg(1, mCellOffsetsBuffers[0]);
+    mCountCellsKernel.setArg(2, mRadixCellsOutBuffer);
+
+    mScatterCellsKernel.setArg(0, mRadixCellsOutBuffer);
+    mScatterCellsKernel.setArg(1, mCellOffsetsBuffers[0]);
+    mScatterCellsKernel.setArg(2, mRadixCellsBuffer);
+    mScatterCellsKernel.setArg(3, mFoundCellsBuffer);
+    mScatterCellsKernel.setArg(4, mNumParticles);
+    mScatterCellsKernel.setArg(5, mCellCount);
+
+    // Scan buffers of the levels are set in countingSort
+    mScanKernel.setArg(1, sizeof(cl_uint) * 2 * _SCAN_ITEMS, NULL);
+
+    if (mReorderParticles) {
+      mPermuteParticlesKernel.setArg(0, mRadixCellsBuffer);
+    }
+
+    return;
+  }
+
+  mCalcHashKernel.setArg(1, mRadixCellsBuffer);
+
+  // Cell buffers of the passes are set in radix
+  mHistogramKernel.setArg(1, mRadixHistogramBuffer);
+  mHistogramKernel.setArg(3, sizeof(cl_uint) * _RADIX * _ITEMS, NULL);
+  mHistogramKernel.setArg(4, mRadixKeys);
+  mHistogramKernel.setArg(5, _RADIX);
+  mHistogramKernel.setArg(6, _BITS);
+
+  mScanKernel.setArg(0, mRadixHistogramBuffer);
+  mScanKernel.setArg(1, sizeof(cl_uint) * _MAXMEMCACHE, NULL);
+  mScanKernel.setArg(2, mRadixGlobSumBuffer);
+
+  // Scan of the per block sums, its own total is not needed
+  mScanSumsKernel.setArg(0, mRadixGlobSumBuffer);
+  mScanSumsKernel.setArg(1, sizeof(cl_uint) * _MAXMEMCACHE, NULL);
+  mScanSumsKernel.setArg(2, mRadixTotalSumBuffer);
+
+  mPasteKernel.setArg(0, mRadixHistogramBuffer);
+  mPasteKernel.setArg(1, mRadixGlobSumBuffer);
+
+  mReorderKernel.setArg(2, mRadixHistogramBuffer);
+  mReorderKernel.setArg(4, sizeof(cl_uint) * _RADIX * _ITEMS, NULL);
+  mReorderKernel.setArg(5, mRadixKeys);
+  mReorderKernel.setArg(6, _RADIX);
+  mReorderKernel.setArg(7, _BITS);
+
+  mInitCellsKernel.setArg(0, mFoundCellsBuffer);
+  mInitCellsKernel.setArg(1, mCellCount);
+
+  mFindCellsKernel.setArg(0, mRadixCellsBuffer);
+  mFindCellsKernel.setArg(1, mFoundCellsBuffer);
+  mFindCellsKernel.setArg(2, mNumParticles);
+
+  if (mReorderParticles) {
+    mPermuteParticlesKernel.setArg(0, mRadixCellsBuffer);
+  }
+}
+
+void
+Simulation::setNeighbourArgs(cl::Kernel &kernel, const cl_uint index) {
+  if (mUseNeighbourLists) {
+    kernel.setArg(index, mNeighboursBuffer);
+    kernel.setArg(index + 1, mNeighbourCountsBuffer);
+  } else {
+    this->setCellArgs(kernel, index);
+  }
+}
+
+void
+Simulation::setCellArgs(cl::Kernel &kernel, const cl_uint index) {
+  if (mNeighbourSearch == NEIGHBOUR_SEARCH_LINKED_CELL) {
+    kernel.setArg(index, mCellsBuffer);
+    kernel.setArg(index + 1, mParticlesListBuffer);
+  } else {
+    kernel.setArg(index, mRadixCellsBuffer);
+    kernel.setArg(index + 1, mFoundCellsBuffer);
+  }
+}
+
+void
+Simulation::updateCells(void) {
+  this->launch(mInitCellsOldKernel, "initCellsOld",
+               max(mNumParticles, mCellCount));
+
+  this->launch(mUpdateCellsKernel, "updateCells", mNumParticles);
 }
 
-#if !defined(USE_LINKEDCELL)
 void
 Simulation::radix(void) {
-  const static unsigned int _CELLSTOTAL = mNumberCells.s[0]
-                                          * mNumberCells.s[1]
-                                          * mNumberCells.s[2];
-  // round up to the next power of 2
-  const static unsigned int _TOTALBITS = ceilf(ceilf( log2f(_CELLSTOTAL) )
-                                         / (float) _BITS) * _BITS;
-  const static unsigned int _MAXINT = 1 << (_TOTALBITS - 1);
-  const static unsigned int _PASS = _TOTALBITS / _BITS;
-  static const int _MAXMEMCACHE = std::max(_HISTOSPLIT, _ITEMS * _GROUPS
-                                  * _RADIX / _HISTOSPLIT);
-
-  cl::Kernel calcHashKernel = mKernels["calcHash"];
-
-  mKernels["calcHash"].setArg(0, mPredictedBuffer);
-  mKernels["calcHash"].setArg(1, mRadixCellsBuffer);
-  mKernels["calcHash"].setArg(2, _MAXINT);
-  mKernels["calcHash"].setArg(3, mNumParticles);
-  mKernels["calcHash"].setArg(4, _NKEYS);
-
-  mQueue.enqueueNDRangeKernel(mKernels["calcHash"], cl::NullRange,
-                              cl::NDRange(_NKEYS), cl::NullRange);
-
-  cl::Kernel reorderKernel = mKernels["reorder"];
-
-  for (unsigned int pass = 0; pass < _PASS; pass++ ) {
+  mQueue.enqueueNDRangeKernel(mCalcHashKernel, cl::NullRange,
+                              cl::NDRange(mRadixKeys), cl::NullRange,
+                              NULL, mProfiler.event("calcHash"));
+
+  for (cl_uint pass = 0; pass < mRadixPasses; pass++ ) {
     //histogram
-    mKernels["histogram"].setArg(0, mRadixCellsBuffer);
-    mKernels["histogram"].setArg(1, mRadixHistogramBuffer);
-    mKernels["histogram"].setArg(2, pass);
-    mKernels["histogram"].setArg(3, sizeof(cl_uint) * _RADIX * _ITEMS, NULL);
-    mKernels["histogram"].setArg(4, _NKEYS);
-    mKernels["histogram"].setArg(5, _RADIX);
-    mKernels["histogram"].setArg(6, _BITS);
-
-    mQueue.enqueueNDRangeKernel(mKernels["histogram"], cl::NullRange,
+    mHistogramKernel.setArg(0, mRadixCellsBuffer);
+    mHistogramKernel.setArg(2, pass);
+
+    mQueue.enqueueNDRangeKernel(mHistogramKernel, cl::NullRange,
                                 cl::NDRange(_ITEMS * _GROUPS),
-                                cl::NDRange(_ITEMS));
+                                cl::NDRange(_ITEMS),
+                                NULL, mProfiler.event("radixHistogram"));
 
     //scan
-    mKernels["scan"].setArg(0, mRadixHistogramBuffer);
-    mKernels["scan"].setArg(1, sizeof(cl_uint) * _MAXMEMCACHE, NULL);
-    mKernels["scan"].setArg(2, mRadixGlobSumBuffer);
-
-    mQueue.enqueueNDRangeKernel(mKernels["scan"], cl::NullRange,
+    mQueue.enqueueNDRangeKernel(mScanKernel, cl::NullRange,
                                 cl::NDRange(_RADIX * _GROUPS * _ITEMS / 2),
                                 cl::NDRange((_RADIX * _GROUPS * _ITEMS / 2)
-                                            / _HISTOSPLIT));
-
-    mKernels["scan"].setArg(0, mRadixGlobSumBuffer);
-    mKernels["scan"].setArg(2, mRadixHistogramBuffer);
+                                            / _HISTOSPLIT),
+                                NULL, mProfiler.event("radixScan"));
 
-    mQueue.enqueueNDRangeKernel(mKernels["scan"], cl::NullRange,
+    mQueue.enqueueNDRangeKernel(mScanSumsKernel, cl::NullRange,
                                 cl::NDRange(_HISTOSPLIT / 2),
-                                cl::NDRange(_HISTOSPLIT / 2));
-
-    mKernels["paste"].setArg(0, mRadixHistogramBuffer);
-    mKernels["paste"].setArg(1, mRadixGlobSumBuffer);
+                                cl::NDRange(_HISTOSPLIT / 2),
+                                NULL, mProfiler.event("radixScanSums"));
 
-    mQueue.enqueueNDRangeKernel(mKernels["paste"], cl::NullRange,
+    mQueue.enqueueNDRangeKernel(mPasteKernel, cl::NullRange,
                                 cl::NDRange(_RADIX * _GROUPS * _ITEMS / 2),
                                 cl::NDRange((_RADIX * _GROUPS * _ITEMS / 2)
-                                            / _HISTOSPLIT));
+                                            / _HISTOSPLIT),
+                                NULL, mProfiler.event("radixPaste"));
 
     //reorder
-    mKernels["reorder"].setArg(0, mRadixCellsBuffer);
-    mKernels["reorder"].setArg(1, mRadixCellsOutBuffer);
-    mKernels["reorder"].setArg(2, mRadixHistogramBuffer);
-    mKernels["reorder"].setArg(3, pass);
-    mKernels["reorder"].setArg(4, sizeof(cl_uint) * _RADIX * _ITEMS, NULL);
-    mKernels["reorder"].setArg(5, _NKEYS);
-    mKernels["reorder"].setArg(6, _RADIX);
-    mKernels["reorder"].setArg(7, _BITS);
-
-    mQueue.enqueueNDRangeKernel(mKernels["reorder"], cl::NullRange,
+    mReorderKernel.setArg(0, mRadixCellsBuffer);
+    mReorderKernel.setArg(1, mRadixCellsOutBuffer);
+    mReorderKernel.setArg(3, pass);
+
+    mQueue.enqueueNDRangeKernel(mReorderKernel, cl::NullRange,
                                 cl::NDRange(_ITEMS * _GROUPS),
-                                cl::NDRange(_ITEMS));
+                                cl::NDRange(_ITEMS),
+                                NULL, mProfiler.event("radixReorder"));
 
     cl::Buffer tmp = mRadixCellsBuffer;
 
@@ -434,152 +946,504 @@ Simulation::radix(void) {
     mRadixCellsOutBuffer = tmp;
   }
 
-  mKernels["initCells"].setArg(0, mFoundCellsBuffer);
-  mKernels["initCells"].setArg(1, mNumberCells.s[0]
-                               * mNumberCells.s[1] * mNumberCells.s[2]);
+  // An odd number of passes leaves the sorted cells in the other buffer
+  if (mRadixPasses % 2 == 1) {
+    this->bindCellArgs();
+  }
+
+  this->launch(mInitCellsKernel, "initCells", mCellCount);
+  this->launch(mFindCellsKernel, "findCells", mNumParticles);
+}
+
+void
+Simulation::countingSort(void) {
+  this->launch(mClearCellCountsKernel, "clearCellCounts",
+               mCellOffsetsSizes[0]);
+
+  this->launch(mCountCellsKernel, "countCells", mNumParticles);
+
+  // Exclusive scan of every level, the group sums go one level up
+  const size_t levels = mCellOffsetsBuffers.size();
+
+  for (size_t level = 0; level < levels; ++level) {
+    mScanKernel.setArg(0, mCellOffsetsBuffers[level]);
+    mScanKernel.setArg(2, level + 1 < levels ? mCellOffsetsBuffers[level + 1]
+                       : mRadixTotalSumBuffer);
+
+    mQueue.enqueueNDRangeKernel(mScanKernel, cl::NullRange,
+                                cl::NDRange(mCellOffsetsSizes[level] / 2),
+                                cl::NDRange(_SCAN_ITEMS),
+                                NULL, mProfiler.event("cellsScan"));
+  }
 
-  mQueue.enqueueNDRangeKernel(mKernels["initCells"], cl::NullRange,
-                              cl::NDRange(mNumberCells.s[0]
-                                          * mNumberCells.s[1] * mNumberCells.s[2]),
-                              cl::NullRange);
+  // Adds the scanned sums of the groups from the top down
+  for (size_t level = levels - 1; level > 0; --level) {
+    mPasteKernel.setArg(0, mCellOffsetsBuffers[level - 1]);
+    mPasteKernel.setArg(1, mCellOffsetsBuffers[level]);
 
-  mKernels["findCells"].setArg(0, mRadixCellsBuffer);
-  mKernels["findCells"].setArg(1, mFoundCellsBuffer);
-  mKernels["findCells"].setArg(2, mNumParticles);
+    mQueue.enqueueNDRangeKernel(mPasteKernel, cl::NullRange,
+                                cl::NDRange(mCellOffsetsSizes[level - 1] / 2),
+                                cl::NDRange(_SCAN_ITEMS),
+                                NULL, mProfiler.event("cellsPaste"));
+  }
 
-  mQueue.enqueueNDRangeKernel(mKernels["findCells"], cl::NullRange,
-                              cl::NDRange(mNumParticles), cl::NullRange);
+  this->launch(mScatterCellsKernel, "scatterCells",
+               max(mNumParticles, mCellCount));
 }
-#endif
 
 void
-Simulation::step(void) {
+Simulation::permuteParticles(void) {
+  this->launch(mPermuteParticlesKernel, "permuteParticles", mNumParticles);
 
-#if defined(USE_DEBUG)
-  // double start = 0.0f, end = 0.0f;
-  // double istart = 0.0f, iend = 0.0f;
-#endif // USE_DEBUG
+  std::swap(mPositionsBuffer, mPositionsSortedBuffer);
+  std::swap(mPredictedBuffer, mPredictedSortedBuffer);
+  std::swap(mVelocitiesBuffer, mVelocitiesSortedBuffer);
+  std::swap(mParticleIdsBuffer, mParticleIdsSortedBuffer);
 
-  // start = glfwGetTime();
-  glFinish();
-  vector<cl::Memory> sharedBuffers;
-  sharedBuffers.push_back(mPositionsBuffer);
-  mQueue.enqueueAcquireGLObjects(&sharedBuffers);
-  // mQueue.finish();
-  // end = glfwGetTime();
-  // printf("acquiring gl:       %f msec\n", (end - start) * 1000);
+  this->bindParticleArgs();
+}
+
+void
+Simulation::buildNeighbourLists(void) {
+  static const cl_uint zero = 0;
+
+  mQueue.enqueueWriteBuffer(mNeighbourOverflowBuffer, CL_FALSE,
+                            0, sizeof(cl_uint), &zero);
+
+  this->launch(mBuildNeighbourListsKernel, "buildNeighbourLists", mNumParticles);
+
+  // Lands before the step is completed, one slot per pending step
+  mQueue.enqueueReadBuffer(mNeighbourOverflowBuffer, CL_FALSE,
+                           0, sizeof(cl_uint),
+                           &mNeighbourOverflows[mStepsPending]);
+
+  if (mNeighbourSkin > 0.0f) {
+    mQueue.enqueueCopyBuffer(mPredictedBuffer, mBuildPositionsBuffer,
+                             0, 0, mBufferSizeParticles);
+  }
+
+  ++mNeighbourBuilds;
+}
+
+void
+Simulation::computeDisplacement(void) {
+  mQueue.enqueueNDRangeKernel(mMaxDisplacementKernel, 0,
+                              cl::NDRange(_REDUCTION_GROUPS * _REDUCTION_ITEMS),
+                              cl::NDRange(_REDUCTION_ITEMS),
+                              NULL, mProfiler.event("maxDisplacement"));
+
+  // Evaluated once the step is completed
+  mQueue.enqueueReadBuffer(mDisplacementBuffer, CL_FALSE,
+                           0, sizeof(cl_float) * _REDUCTION_GROUPS,
+                           &mDisplacements[0]);
+}
+
+void
+Simulation::computeDensityError(void) {
+  if (mFusedUpdate) {
+    mDensityErrorKernel.setArg(0, mPredictedBuffer);
+  }
+
+  mQueue.enqueueNDRangeKernel(mDensityErrorKernel, 0,
+                              cl::NDRange(_REDUCTION_GROUPS * _REDUCTION_ITEMS),
+                              cl::NDRange(_REDUCTION_ITEMS),
+                              NULL, mProfiler.event("densityError"));
+
+  // Blocking, the solver loop decides on the result
+  mQueue.enqueueReadBuffer(mDensityErrorBuffer, CL_TRUE,
+                           0, sizeof(cl_float2) * _REDUCTION_GROUPS,
+                           &mDensityErrors[0]);
+
+  cl_float maxError = 0.0f;
+  double sumError = 0.0;
+
+  for (size_t g = 0; g < mDensityErrors.size(); ++g) {
+    maxError = std::max(maxError, mDensityErrors[g].s[0]);
+    sumError += mDensityErrors[g].s[1];
+  }
+
+  mMaxDensityError = maxError;
+  mAverageDensityError = sumError / mNumParticles;
+}
+
+void
+Simulation::computeScalingTiled(void) {
+  if (mFusedUpdate) {
+    mComputeScalingTiledKernel.setArg(0, mPredictedBuffer);
+  }
+
+  // One work-group per cell, in size_t as the product can exceed 32 bits
+  const size_t items = (size_t) mCellCount * _TILE_ITEMS;
+
+  mQueue.enqueueNDRangeKernel(mComputeScalingTiledKernel, 0,
+                              cl::NDRange(items),
+                              cl::NDRange(_TILE_ITEMS),
+                              NULL, mProfiler.event("computeScalingTiled"));
+}
+
+void
+Simulation::computeDeltaTiled(void) {
+  if (mFusedUpdate) {
+    mComputeDeltaTiledKernel.setArg(0, mPredictedNextBuffer);
+    mComputeDeltaTiledKernel.setArg(1, mPredictedBuffer);
+  }
+
+  mComputeDeltaTiledKernel.setArg(5, mWaveGenerator);
+
+  const size_t items = (size_t) mCellCount * _TILE_ITEMS;
+
+  mQueue.enqueueNDRangeKernel(mComputeDeltaTiledKernel, 0,
+                              cl::NDRange(items),
+                              cl::NDRange(_TILE_ITEMS),
+                              NULL, mProfiler.event("computeDeltaTiled"));
+
+  if (mFusedUpdate) {
+    std::swap(mPredictedBuffer, mPredictedNextBuffer);
+  }
+}
+
+void
+Simulation::unpermute(const cl::Buffer &data, const cl::Buffer &out,
+                      const char *name) {
+  if (!mReorderParticles && !mStructOfArrays) {
+    mQueue.enqueueCopyBuffer(data, out, 0, 0, mBufferSizeParticles,
+                             NULL, mProfiler.event(name));
+    return;
+  }
+
+  if (!mReorderParticles) {
+    // Only the layout differs
+    cl::Kernel &kernel = mInterleaveParticlesKernel;
+
+    kernel.setArg(0, data);
+    kernel.setArg(1, out);
+    kernel.setArg(2, mNumParticles);
+
+    this->launch(kernel, name, mNumParticles);
+    return;
+  }
+
+  cl::Kernel &kernel = mUnpermuteParticlesKernel;
+
+  kernel.setArg(0, data);
+  kernel.setArg(1, mParticleIdsBuffer);
+  kernel.setArg(2, out);
+  kernel.setArg(3, mNumParticles);
+
+  this->launch(kernel, name, mNumParticles);
+}
+
+const cl::Buffer &
+Simulation::orderedVelocities(void) {
+  if (!mReorderParticles && !mStructOfArrays) {
+    return mVelocitiesBuffer;
+  }
+
+  this->unpermute(mVelocitiesBuffer, mUnpermutedBuffer,
+                  "unpermuteVelocities");
+
+  return mUnpermutedBuffer;
+}
+
+void
+Simulation::resetParticleOrder(const cl_uint *ids) {
+  if (mStructOfArrays) {
+    cl::Kernel &kernel = mDeinterleaveParticlesKernel;
+
+    kernel.setArg(0, mDisplayBuffer);
+    kernel.setArg(1, mPositionsBuffer);
+    kernel.setArg(2, mNumParticles);
+
+    this->launch(kernel, "deinterleaveParticles", mNumParticles);
+
+    kernel.setArg(0, mUnpermutedBuffer);
+    kernel.setArg(1, mVelocitiesBuffer);
+
+    this->launch(kernel, "deinterleaveParticles", mNumParticles);
+  } else {
+    mQueue.enqueueCopyBuffer(mDisplayBuffer, mPositionsBuffer,
+                             0, 0, mBufferSizeParticles);
+  }
+
+  if (!mReorderParticles) {
+    return;
+  }
+
+  cl_uint *mapped = (cl_uint *) mQueue.enqueueMapBuffer(
+                      mParticleIdsBuffer, CL_TRUE, CL_MAP_WRITE,
+                      0, mNumParticles * sizeof(cl_uint));
+
+  for (cl_uint i = 0; i < mNumParticles; ++i) {
+    mapped[i] = ids != NULL ? ids[i] : i;
+  }
+
+  mQueue.enqueueUnmapMemObject(mParticleIdsBuffer, mapped);
+}
+
+void
+Simulation::step(void) {
+  // The rebuild decision needs the displacement of the previous step,
+  // otherwise steps are queued up without waiting for the device
+  if ( (mUseNeighbourLists && mNeighbourSkin > 0.0f)
+       || mStepsPending == _MAX_PENDING_STEPS ) {
+    this->completeStep();
+  }
 
-  // start = glfwGetTime();
   this->predictPositions();
-  // mQueue.finish();
-  // end = glfwGetTime();
-  // printf("predictPositons:    %f msec\n", (end - start) * 1000);
 
 #if defined(USE_DEBUG)
   cout << "predictPositions \n" << endl;
 #endif // USE_DEBUG
 
-#if defined(USE_LINKEDCELL)
-  // start = glfwGetTime();
-  this->updateCells();
-  // mQueue.finish();
-  // end = glfwGetTime();
-  // printf("updateCells:        %f msec\n", (end - start) * 1000);
-#else
-  // start = glfwGetTime();
-  this->radix();
-  // mQueue.finish();
-  // end = glfwGetTime();
-  // printf("r:%f\n", (end - start) * 1000);
-#endif
-
+  // With a skin the solver only reads the neighbour lists, so cells
+  // and lists are kept until particles moved too far
+  const bool rebuild = mRebuildNeighbours || mNeighbourSkin <= 0.0f;
+
+  if (rebuild) {
+    if (mNeighbourSearch == NEIGHBOUR_SEARCH_LINKED_CELL) {
+      this->updateCells();
+    } else {
+      if (mNeighbourSearch == NEIGHBOUR_SEARCH_COUNTING) {
+        this->countingSort();
+      } else {
+        this->radix();
+      }
+
+      if (mReorderParticles) {
+        this->permuteParticles();
+      }
+    }
+
+    if (mUseNeighbourLists) {
+      this->buildNeighbourLists();
+    }
+
+    mRebuildNeighbours = false;
+  }
 
 #if defined(USE_DEBUG)
   cout << "updateCells \n" << endl;
 #endif // USE_DEBUG
 
-  // istart = glfwGetTime();
-
-  const unsigned int solver_iterations = 4;
+  const cl_uint solver_iterations = mAdaptiveSolver ? mSolverMaxIterations
+                                    : mSolverIterations;
+  cl_uint iterations = 0;
 
-  for (unsigned int i = 0; i < solver_iterations; ++i) {
-    // start = glfwGetTime();
+  for (cl_uint i = 0; i < solver_iterations; ++i) {
     this->computeScaling();
-    // mQueue.finish();
-    // end = glfwGetTime();
-    // printf("computeScaling:     %f msec\n", (end - start) * 1000);
 
 #if defined(USE_DEBUG)
     cout << "computeScaling \n" << endl;
 #endif // USE_DEBUG
 
-    // start = glfwGetTime();
+    // computeScaling just stored the densities of the current prediction
+    if (mAdaptiveSolver && i >= mSolverMinIterations) {
+      this->computeDensityError();
+
+      if (mMaxDensityError < mSolverTolerance) {
+        break;
+      }
+    }
+
+    ++iterations;
+
     this->computeDelta();
-    // mQueue.finish();
-    // end = glfwGetTime();
-    // printf("computeDelta:       %f msec\n", (end - start) * 1000);
 
 #if defined(USE_DEBUG)
     cout << "computeDelta \n" << endl;
 #endif // USE_DEBUG
 
-    // start = glfwGetTime();
-    this->updatePredicted();
-    // mQueue.finish();
-    // end = glfwGetTime();
-    // printf("updatePredicted:    %f msec\n", (end - start) * 1000);
+    if (!mFusedUpdate) {
+      this->updatePredicted();
+    }
 
 #if defined(USE_DEBUG)
     cout << "updatePredicted \n" << endl;
 #endif // USE_DEBUG
 
   }
-  // mQueue.finish();
-  // iend = glfwGetTime();
-  // printf("iterations:         %f msec\n", (iend - istart) * 1000);
 
-  // start = glfwGetTime();
+  // The other kernels still point to the predicted buffer of the start,
+  // rebound before the velocity and position updates read it
+  if (mFusedUpdate && iterations % 2 == 1) {
+    this->bindParticleArgs();
+  }
+
   this->updateVelocities();
-  // mQueue.finish();
-  // end = glfwGetTime();
-  // printf("updateVelocities:   %f msec\n", (end - start) * 1000);
 
 #if defined(USE_DEBUG)
   cout << "updateVelocities \n" << endl;
 #endif // USE_DEBUG
 
-  // start = glfwGetTime();
   this->applyVorticityAndViscosity();
-  // mQueue.finish();
-  // end = glfwGetTime();
-  // printf("applyViscosity:     %f msec\n", (end - start) * 1000);
 
 #if defined(USE_DEBUG)
   cout << "applyVorticityAndViscosity \n" << endl;
 #endif // USE_DEBUG
 
-  // start = glfwGetTime();
   this->updatePositions();
-  // mQueue.finish();
-  // end = glfwGetTime();
-  // printf("updatePositions:    %f msec\n", (end - start) * 1000);
 
 #if defined(USE_DEBUG)
   cout << "updatePositions \n" << endl;
 #endif // USE_DEBUG
 
-  // start = glfwGetTime();
-  mQueue.enqueueReleaseGLObjects(&sharedBuffers);
+  vector<cl::Memory> sharedBuffers;
+
+  if (mUseGLSharing) {
+    // The device runs the solver while OpenGL finishes drawing
+    mQueue.flush();
+
+    sharedBuffers.push_back(mDisplayBuffer);
+    this->acquireGLObjects(sharedBuffers);
+  }
+
+  if ( this->separatePositions() ) {
+    this->unpermute(mPositionsBuffer, mDisplayBuffer, "unpermutePositions");
+  }
+
+  if (mUseNeighbourLists && mNeighbourSkin > 0.0f) {
+    this->computeDisplacement();
+  }
+
+  if (mUseGLSharing) {
+    mQueue.enqueueReleaseGLObjects(&sharedBuffers, NULL, &mDisplayReady);
+    mDisplayPending = true;
+  }
+
+  // Evaluated by a later step or finishStep
+  mQueue.flush();
+
+  ++mStepsPending;
+  mPendingIterations += iterations;
+}
+
+void
+Simulation::finishStep(void) {
+  this->completeStep();
+}
+
+GLuint
+Simulation::presentFrame(void) {
+  mQueue.flush();
+
+  // Written by the steps of the frame before, usually long done
+  if (mRenderPending) {
+    mRenderReady.wait();
+  }
+
+  const GLuint bufferID = mRenderBufferID;
+
+  // The next steps write to the buffer drawn now, this frame's positions
+  // are drawn with the next one
+  std::swap(mDisplayBuffer, mRenderBuffer);
+  std::swap(mSharingBufferID, mRenderBufferID);
+
+  mRenderReady = mDisplayReady;
+  mRenderPending = mDisplayPending;
+  mDisplayPending = false;
+
+  return bufferID;
+}
+
+void
+Simulation::completeStep(void) {
+  if (mStepsPending == 0) {
+    return;
+  }
+
   mQueue.finish(); // clFinish()
-  // end = glfwGetTime();
-  // printf("releasing gl:       %f msec\n", (end - start) * 1000);
+
+  // The overflow counts are only read back when the lists were built
+  cl_ulong overflows = 0;
+
+  for (cl_uint i = 0; i < mStepsPending; ++i) {
+    overflows += mNeighbourOverflows[i];
+    mNeighbourOverflows[i] = 0;
+  }
+
+  if (overflows > 0) {
+    if (mNeighbourOverflowTotal == 0) {
+      cerr << "Neighbour lists overflowed, neighbours are dropped. "
+           << "Increase max_neighbours." << endl;
+    }
+
+    mNeighbourOverflowTotal += overflows;
+  }
+
+  mSteps += mStepsPending;
+  mSolverIterationsTotal += mPendingIterations;
+
+  mStepsPending = 0;
+  mPendingIterations = 0;
+
+  if (mUseNeighbourLists && mNeighbourSkin > 0.0f) {
+    const cl_float maxDisplacement = std::sqrt( *std::max_element(
+                                       mDisplacements.begin(),
+                                       mDisplacements.end() ) );
+
+    mRebuildNeighbours = maxDisplacement > 0.5f * mNeighbourSkin;
+
+    mProfiler.setCounter("neighbourSkin", mNeighbourSkin);
+    mProfiler.setCounter("neighbourMaxDisplacement", maxDisplacement);
+  }
+
+  mProfiler.setCounter("solverIterations",
+                       (double) mSolverIterationsTotal / mSteps);
+
+  if (mAdaptiveSolver) {
+    mProfiler.setCounter("densityErrorMax", mMaxDensityError);
+    mProfiler.setCounter("densityErrorAverage", mAverageDensityError);
+  }
+
+  if (mUseNeighbourLists) {
+    mProfiler.setCounter("neighbourBuilds", mNeighbourBuilds);
+    mProfiler.setCounter("neighbourStepsPerBuild",
+                         (double) mSteps / mNeighbourBuilds);
+    mProfiler.setCounter("neighbourOverflows", mNeighbourOverflowTotal);
+  }
+
+  // Timings are read only after the finish, kernels run back to back
+  if (mProfiler.isEnabled()) {
+    mProfiler.collect();
+  }
+
+  if (mTuner.isTuning()) {
+    mTuner.collect();
+  }
+}
+
+void
+Simulation::acquireGLObjects(const vector<cl::Memory> &buffers) {
+  if (!mUseGLSharing) {
+    return;
+  }
+
+  if (!mImplicitGLSync) {
+    glFinish();
+  }
+
+  mQueue.enqueueAcquireGLObjects(&buffers);
+}
+
+void
+Simulation::releaseGLObjects(const vector<cl::Memory> &buffers) {
+  if (!mUseGLSharing) {
+    return;
+  }
+
+  mQueue.enqueueReleaseGLObjects(&buffers);
 }
 
 void
 Simulation::dumpData( cl_float4 * (&positions), cl_float4 * (&velocities) ) {
-  mQueue.enqueueReadBuffer(mPositionsBuffer, CL_TRUE,
+  if (mPositions == NULL) {
+    mPositions = new cl_float4[mNumParticles];
+    mVelocities = new cl_float4[mNumParticles];
+  }
+
+  mQueue.enqueueReadBuffer(mDisplayBuffer, CL_TRUE,
                            0, mBufferSizeParticles, mPositions);
-  mQueue.enqueueReadBuffer(mVelocitiesBuffer, CL_TRUE,
+  mQueue.enqueueReadBuffer(this->orderedVelocities(), CL_TRUE,
                            0, mBufferSizeParticles, mVelocities);
 
   // just a safety measure to be absolutely sure everything is transferred
@@ -589,3 +1453,321 @@ Simulation::dumpData( cl_float4 * (&positions), cl_float4 * (&velocities) ) {
   positions = mPositions;
   velocities = mVelocities;
 }
+
+void
+Simulation::createSnapshotBuffer(SnapshotBuffer &buffer) {
+  // Host accessible allocations give pinned memory for fast async reads
+  buffer.positionsStaging = cl::Buffer(mCLContext, CL_MEM_ALLOC_HOST_PTR,
+                                       mBufferSizeParticles);
+  buffer.velocitiesStaging = cl::Buffer(mCLContext, CL_MEM_ALLOC_HOST_PTR,
+                                        mBufferSizeParticles);
+
+  buffer.positions = (cl_float4 *) mQueue.enqueueMapBuffer(
+                       buffer.positionsStaging, CL_TRUE,
+                       CL_MAP_READ | CL_MAP_WRITE, 0, mBufferSizeParticles);
+  buffer.velocities = (cl_float4 *) mQueue.enqueueMapBuffer(
+                        buffer.velocitiesStaging, CL_TRUE,
+                        CL_MAP_READ | CL_MAP_WRITE, 0, mBufferSizeParticles);
+  buffer.hasEvent = false;
+}
+
+void
+Simulation::releaseSnapshotBuffer(SnapshotBuffer &buffer) {
+  buffer.wait();
+
+  mQueue.enqueueUnmapMemObject(buffer.positionsStaging, buffer.positions);
+  mQueue.enqueueUnmapMemObject(buffer.velocitiesStaging, buffer.velocities);
+  mQueue.finish();
+
+  buffer.positions = NULL;
+  buffer.velocities = NULL;
+  buffer.hasEvent = false;
+}
+
+void
+Simulation::enqueueSnapshot(SnapshotBuffer &buffer) {
+  vector<cl::Memory> sharedBuffers;
+
+  if (mUseGLSharing) {
+    sharedBuffers.push_back(mDisplayBuffer);
+  }
+
+  this->acquireGLObjects(sharedBuffers);
+
+  mQueue.enqueueReadBuffer(mDisplayBuffer, CL_FALSE,
+                           0, mBufferSizeParticles, buffer.positions);
+  // In-order queue: the second read completes after the first
+  mQueue.enqueueReadBuffer(this->orderedVelocities(), CL_FALSE,
+                           0, mBufferSizeParticles, buffer.velocities,
+                           NULL, &buffer.ready);
+  buffer.hasEvent = true;
+
+  this->releaseGLObjects(sharedBuffers);
+
+  mQueue.flush();
+}
+
+void
+Simulation::enqueueStatistics(StatisticsBlock &block) {
+  // Arguments follow the buffer swaps through bindParticleArgs
+  mQueue.enqueueNDRangeKernel(mParticleStatisticsKernel, 0,
+                              cl::NDRange(_REDUCTION_GROUPS * _REDUCTION_ITEMS),
+                              cl::NDRange(_REDUCTION_ITEMS),
+                              NULL, mProfiler.event("particleStatistics"));
+
+  mQueue.enqueueNDRangeKernel(mCombineStatisticsKernel, 0,
+                              cl::NDRange(_REDUCTION_GROUPS),
+                              cl::NDRange(_REDUCTION_GROUPS),
+                              NULL, mProfiler.event("combineStatistics"));
+
+  mQueue.enqueueReadBuffer(mStatisticsBuffer, CL_FALSE,
+                           0, sizeof(block.values), block.values);
+  // In-order queue: the second read completes after the first
+  mQueue.enqueueReadBuffer(mStatisticsHistogramBuffer, CL_FALSE,
+                           0, sizeof(block.histogram), block.histogram,
+                           NULL, &block.ready);
+  block.hasEvent = true;
+
+  mQueue.flush();
+}
+
+CheckpointHeader
+Simulation::checkpointHeader(void) const {
+  CheckpointHeader header = Checkpoint::emptyHeader();
+
+  header.count = mNumParticles;
+  header.waveGenerator = mWaveGenerator;
+  header.timeStepLength = mTimestepLength;
+  header.restDensity = mRestDensity;
+  header.sizeMin = mSystemSizeMin;
+  header.sizeMax = mSystemSizeMax;
+  header.cellLength = mCellLength;
+  header.numberCells = mNumberCells;
+
+  return header;
+}
+
+cl_uint
+Simulation::solverStateFlags(void) const {
+  cl_uint flags = 0;
+
+  // The order within cells carries over into the next sort and every
+  // neighbour sum
+  if (mReorderParticles) {
+    flags |= CHECKPOINT_PARTICLE_ORDER;
+  }
+
+  // Lists are only rebuilt once particles moved far enough
+  if (mUseNeighbourLists && mNeighbourSkin > 0.0f) {
+    flags |= CHECKPOINT_NEIGHBOUR_LISTS;
+  }
+
+  // Build positions are kept in the solver layout
+  if (flags != 0 && mStructOfArrays) {
+    flags |= CHECKPOINT_SOA_LAYOUT;
+  }
+
+  return flags;
+}
+
+size_t
+Simulation::solverStateSize(void) const {
+  const cl_uint flags = this->solverStateFlags();
+  size_t size = 0;
+
+  if (flags & CHECKPOINT_PARTICLE_ORDER) {
+    size += sizeof(cl_uint) * mNumParticles;
+  }
+
+  if (flags & CHECKPOINT_NEIGHBOUR_LISTS) {
+    size += sizeof(cl_uint) + mBufferSizeParticles
+            + sizeof(cl_int) * mNumParticles
+            + sizeof(cl_int) * mMaxNeighbours * mNumParticles;
+  }
+
+  return size;
+}
+
+void
+Simulation::appendBuffer(vector<char> &state, const cl::Buffer &buffer,
+                         const size_t size) {
+  const size_t offset = state.size();
+
+  state.resize(offset + size);
+  mQueue.enqueueReadBuffer(buffer, CL_TRUE, 0, size, &state[offset]);
+}
+
+void
+Simulation::saveCheckpoint(const string &filename, const RunState &state) {
+  // The rebuild decision of the next step is part of the solver state
+  this->completeStep();
+
+  vector<cl::Memory> sharedBuffers;
+
+  if (mUseGLSharing) {
+    sharedBuffers.push_back(mDisplayBuffer);
+  }
+
+  this->acquireGLObjects(sharedBuffers);
+
+  if (mPositions == NULL) {
+    mPositions = new cl_float4[mNumParticles];
+    mVelocities = new cl_float4[mNumParticles];
+  }
+
+  mQueue.enqueueReadBuffer(mDisplayBuffer, CL_TRUE,
+                           0, mBufferSizeParticles, mPositions);
+  mQueue.enqueueReadBuffer(this->orderedVelocities(), CL_TRUE,
+                           0, mBufferSizeParticles, mVelocities);
+
+  this->releaseGLObjects(sharedBuffers);
+
+  mQueue.finish();
+
+  CheckpointHeader header = this->checkpointHeader();
+  header.time = state.time;
+  header.steps = state.steps;
+  header.wavePhase = state.wavePhase;
+  header.generateWaves = state.generateWaves;
+  header.solverState = this->solverStateFlags();
+
+  vector<char> solverState;
+
+  if (header.solverState & CHECKPOINT_PARTICLE_ORDER) {
+    this->appendBuffer(solverState, mParticleIdsBuffer,
+                       sizeof(cl_uint) * mNumParticles);
+  }
+
+  if (header.solverState & CHECKPOINT_NEIGHBOUR_LISTS) {
+    const cl_uint rebuild = mRebuildNeighbours;
+
+    solverState.insert(solverState.end(), (const char *) &rebuild,
+                       (const char *) &rebuild + sizeof(rebuild));
+    this->appendBuffer(solverState, mBuildPositionsBuffer,
+                       mBufferSizeParticles);
+    this->appendBuffer(solverState, mNeighbourCountsBuffer,
+                       sizeof(cl_int) * mNumParticles);
+    this->appendBuffer(solverState, mNeighboursBuffer,
+                       sizeof(cl_int) * mMaxNeighbours * mNumParticles);
+  }
+
+  Checkpoint::write(filename, header, mPositions, mVelocities, solverState);
+}
+
+void
+Simulation::loadCheckpoint(const string &filename, RunState &state) {
+  // A pending step must not overwrite the restored rebuild flag
+  this->completeStep();
+
+  if (mPositions == NULL) {
+    mPositions = new cl_float4[mNumParticles];
+    mVelocities = new cl_float4[mNumParticles];
+  }
+
+  CheckpointHeader header;
+  vector<char> solverState;
+  Checkpoint::read(filename, this->checkpointHeader(), header,
+                   mPositions, mVelocities, &solverState);
+
+  // Without the state of this configuration the particles restart in
+  // their original order with fresh neighbour lists
+  const cl_uint flags = this->solverStateFlags();
+  const bool restoreState = flags != 0 && header.solverState == flags
+                            && solverState.size() == this->solverStateSize();
+
+  if (flags != 0 && !restoreState) {
+    cerr << "Checkpoint has no particle order or neighbour lists for this "
+         << "configuration, the restart is not bit-identical" << endl;
+  }
+
+  const char *stateData = restoreState ? &solverState[0] : NULL;
+  const cl_uint *ids = NULL;
+
+  if (restoreState && (flags & CHECKPOINT_PARTICLE_ORDER)) {
+    ids = (const cl_uint *) stateData;
+    stateData += sizeof(cl_uint) * mNumParticles;
+  }
+
+  // Particles are uploaded in the solver order of the checkpoint, the
+  // display buffer gets the original order afterwards
+  vector<cl_float4> sortedPositions;
+  vector<cl_float4> sortedVelocities;
+
+  if (ids != NULL) {
+    sortedPositions.resize(mNumParticles);
+    sortedVelocities.resize(mNumParticles);
+
+    for (cl_uint i = 0; i < mNumParticles; ++i) {
+      if (ids[i] >= mNumParticles) {
+        throw runtime_error("Checkpoint has an invalid particle order!");
+      }
+
+      sortedPositions[i] = mPositions[ids[i]];
+      sortedVelocities[i] = mVelocities[ids[i]];
+    }
+  }
+
+  vector<cl::Memory> sharedBuffers;
+
+  if (mUseGLSharing) {
+    sharedBuffers.push_back(mDisplayBuffer);
+    sharedBuffers.push_back(mRenderBuffer);
+  }
+
+  this->acquireGLObjects(sharedBuffers);
+
+  mQueue.enqueueWriteBuffer(mDisplayBuffer, CL_TRUE,
+                            0, mBufferSizeParticles,
+                            ids != NULL ? &sortedPositions[0] : mPositions);
+  mQueue.enqueueWriteBuffer(this->velocitiesUpload(), CL_TRUE,
+                            0, mBufferSizeParticles,
+                            ids != NULL ? &sortedVelocities[0] : mVelocities);
+
+  // The checkpoint is interleaved
+  if ( this->separatePositions() ) {
+    this->resetParticleOrder(ids);
+  }
+
+  if (ids != NULL) {
+    mQueue.enqueueWriteBuffer(mDisplayBuffer, CL_TRUE,
+                              0, mBufferSizeParticles, mPositions);
+  }
+
+  if (mUseGLSharing) {
+    mQueue.enqueueCopyBuffer(mDisplayBuffer, mRenderBuffer,
+                             0, 0, mBufferSizeParticles);
+  }
+
+  mRebuildNeighbours = true;
+
+  if (restoreState && (flags & CHECKPOINT_NEIGHBOUR_LISTS)) {
+    cl_uint rebuild = 0;
+    memcpy(&rebuild, stateData, sizeof(rebuild));
+    stateData += sizeof(rebuild);
+
+    mQueue.enqueueWriteBuffer(mBuildPositionsBuffer, CL_TRUE,
+                              0, mBufferSizeParticles, stateData);
+    stateData += mBufferSizeParticles;
+
+    mQueue.enqueueWriteBuffer(mNeighbourCountsBuffer, CL_TRUE,
+                              0, sizeof(cl_int) * mNumParticles, stateData);
+    stateData += sizeof(cl_int) * mNumParticles;
+
+    mQueue.enqueueWriteBuffer(mNeighboursBuffer, CL_TRUE,
+                              0, sizeof(cl_int) * mMaxNeighbours
+                              * mNumParticles, stateData);
+
+    mRebuildNeighbours = rebuild != 0;
+  }
+
+  this->releaseGLObjects(sharedBuffers);
+
+  mQueue.finish();
+
+  mWaveGenerator = header.waveGenerator;
+
+  state.time = header.time;
+  state.steps = header.steps;
+  state.wavePhase = header.wavePhase;
+  state.generateWaves = header.generateWaves != 0;
+}
@@ -13,6 +13,10 @@
 #include "hesp.hpp"
 #include "Parameters.hpp"
 #include "Particle.hpp"
+#include "Solver.hpp"
+#include "KernelProfiler.hpp"
+#include "WorkGroupTuner.hpp"
+#include "io/Checkpoint.hpp"
 
 #include <GLFW/glfw3.h>
 
@@ -25,9 +29,9 @@ using std::string;
 
 
 /**
-*  \brief CParser
+*  \brief  OpenCL simulation backend.
 */
-class Simulation {
+class Simulation : public Solver {
 private:
   // Avoid copy
   Simulation &operator=(const Simulation &other);
@@ -37,13 +41,33 @@ public:
 
   /**
   *  \brief  Default constructor.
+  *
+  *  A sharingBufferID of 0 runs the simulation headless: positions are
+  *  kept in a plain OpenCL buffer and no OpenGL calls are made.
+  *  Otherwise renderBufferID is a second OpenGL buffer of the same size,
+  *  steps write to both in turn so that the last completed step can be
+  *  drawn while the next one is computed.
   */
   explicit Simulation(const ConfigParameters &parameters,
-                      const vector<Particle> &particles,
+                      const ParticleView &particles,
                       const map<string, cl::Kernel> kernels,
                       const cl::Context &clContext,
                       const cl::Device &clDevice,
-                      const GLuint sharingBufferID);
+                      const GLuint sharingBufferID = 0,
+                      const GLuint renderBufferID = 0);
+
+  /**
+  *  \brief  Kernel files of the program, each is built with hesp.hpp
+  *          prepended.
+  */
+  static vector<string> kernelFiles(void);
+
+  /**
+  *  \brief  Compile options with the scenario constants and the
+  *          variants selected by the parameters.
+  */
+  static string buildOptions(const ConfigParameters &parameters,
+                             const size_t numParticles);
 
   /**
   *  \brief  Destructor.
@@ -53,11 +77,30 @@ public:
   void init(void);
   void initCells(void);
   void step(void);
+  void finishStep(void);
+
+  /**
+  *  \brief  Hands the positions of the steps so far to the renderer.
+  *
+  *  Returns the OpenGL buffer to draw, which holds the positions of the
+  *  frame before so that it is drawn while the device works on the
+  *  current one. Only with OpenGL sharing.
+  */
+  GLuint presentFrame(void);
 
   // Copy current positions and velocities
   void dumpData( cl_float4 * (&positions),
                  cl_float4 * (&velocities) );
 
+  void createSnapshotBuffer(SnapshotBuffer &buffer);
+  void releaseSnapshotBuffer(SnapshotBuffer &buffer);
+  void enqueueSnapshot(SnapshotBuffer &buffer);
+
+  void enqueueStatistics(StatisticsBlock &block);
+
+  void saveCheckpoint(const string &filename, const RunState &state);
+  void loadCheckpoint(const string &filename, RunState &state);
+
   cl_uint getNumberParticles() const {
     return mNumParticles;
   }
@@ -100,6 +143,40 @@ public:
     return mSystemSizeMax;
   }
 
+  // Has to be called before init to take effect
+  void
+  setProfiling(const bool enabled) {
+    mProfiler.setEnabled(enabled);
+  }
+
+  const KernelProfiler &
+  getProfiler(void) const {
+    return mProfiler;
+  }
+
+  void
+  clearProfile(void) {
+    // Events of pending steps would otherwise be collected later
+    this->finishStep();
+    mProfiler.clearSamples();
+  }
+
+  // Number of times a particle had more neighbours than fit in its list
+  cl_ulong
+  getNeighbourOverflows(void) const {
+    return mNeighbourOverflowTotal;
+  }
+
+  NeighbourSearch
+  getNeighbourSearch(void) const {
+    return mNeighbourSearch;
+  }
+
+  bool
+  isHeadless(void) const {
+    return !mUseGLSharing;
+  }
+
   // Setter
 
   void
@@ -120,51 +197,188 @@ private:
   // holds all OpenCL kernels required for the simulation
   map<string, cl::Kernel> mKernels;
 
+  // Kernels resolved once at init. Arguments are bound by
+  // bindParticleArgs and bindCellArgs, launches only set what changes.
+  cl::Kernel mPredictPositionsKernel;
+  cl::Kernel mUpdatePredictedKernel;
+  cl::Kernel mComputeScalingKernel;
+  cl::Kernel mComputeDeltaKernel;
+  cl::Kernel mComputeScalingTiledKernel;
+  cl::Kernel mComputeDeltaTiledKernel;
+  cl::Kernel mUpdateVelocitiesKernel;
+  cl::Kernel mApplyVorticityAndViscosityKernel;
+  cl::Kernel mUpdatePositionsKernel;
+  cl::Kernel mInitCellsOldKernel;
+  cl::Kernel mUpdateCellsKernel;
+  cl::Kernel mCalcHashKernel;
+  cl::Kernel mHistogramKernel;
+  cl::Kernel mScanKernel;
+  cl::Kernel mScanSumsKernel;
+  cl::Kernel mPasteKernel;
+  cl::Kernel mReorderKernel;
+  cl::Kernel mInitCellsKernel;
+  cl::Kernel mFindCellsKernel;
+  cl::Kernel mClearCellCountsKernel;
+  cl::Kernel mCountCellsKernel;
+  cl::Kernel mScatterCellsKernel;
+  cl::Kernel mPermuteParticlesKernel;
+  cl::Kernel mUnpermuteParticlesKernel;
+  cl::Kernel mInterleaveParticlesKernel;
+  cl::Kernel mDeinterleaveParticlesKernel;
+  cl::Kernel mBuildNeighbourListsKernel;
+  cl::Kernel mMaxDisplacementKernel;
+  cl::Kernel mDensityErrorKernel;
+  cl::Kernel mParticleStatisticsKernel;
+  cl::Kernel mCombineStatisticsKernel;
+
   // command queue all OpenCL calls are run on
   cl::CommandQueue mQueue;
 
-  // ranges used for executing the kernels
-  cl::NDRange mGlobalRange;
-  cl::NDRange mLocalRange;
+  // per-kernel timings from profiling events
+  KernelProfiler mProfiler;
+
+  // work-group sizes of the launches over particles or cells
+  WorkGroupTuner mTuner;
 
   // configuration parameters for the simulation
   cl_float mTimestepLength;
   cl_float mTimeEnd;
+  cl_float mRestDensity;
 
   const cl_uint mNumParticles;
 
+  // Entries of the cell arrays, see cellSlots and hashTableSlots
+  const cl_uint mCellCount;
+
   const size_t mBufferSizeParticles;
   const size_t mBufferSizeCells;
   const size_t mBufferSizeParticlesList;
   const size_t mBufferSizeScalingFactors;
 
-  // Reference to a vector of particles to setup data arrays in OpenCL
-  const vector<Particle> &mParticles;
+  // View of the initial particles to setup data arrays in OpenCL
+  const ParticleView mParticles;
 
   // The host memory holding the simulation data
   cl_float4 *mPositions;
   cl_float4 *mVelocities;
-#if !defined(USE_LINKEDCELL)
-  cl_uint2 *mRadixCells;
-#endif // USE_LINKEDCELL
 
   // The device memory buffers holding the simulation data
   cl::Buffer mCellsBuffer;
   cl::Buffer mParticlesListBuffer;
+  // Positions in the original particle order, shared with OpenGL if
+  // not headless. Same buffer as mPositionsBuffer unless reordering,
+  // in planes or shared.
+  cl::Buffer mDisplayBuffer;
+  // Positions of the frame before, drawn while the next steps run
+  cl::Buffer mRenderBuffer;
   cl::Buffer mPositionsBuffer;
   cl::Buffer mPredictedBuffer;
+  // Second predicted buffer computeDelta writes to with the fused update
+  cl::Buffer mPredictedNextBuffer;
   cl::Buffer mVelocitiesBuffer;
   cl::Buffer mScalingFactorsBuffer;
   cl::Buffer mDeltaBuffer;
   cl::Buffer mDeltaVelocityBuffer;
 
-#if !defined(USE_LINKEDCELL)
+  // Only used with NEIGHBOUR_SEARCH_RADIX and NEIGHBOUR_SEARCH_COUNTING,
+  // the histogram only by the radix sort
   cl::Buffer mRadixCellsBuffer;
   cl::Buffer mRadixHistogramBuffer;
   cl::Buffer mRadixGlobSumBuffer;
+  cl::Buffer mRadixTotalSumBuffer;
   cl::Buffer mRadixCellsOutBuffer;
   cl::Buffer mFoundCellsBuffer;
-#endif // USE_LINKEDCELL
+
+  // Only used with NEIGHBOUR_SEARCH_COUNTING. Level 0 holds the count and
+  // then the first index of every cell, each further level the sums of
+  // the scan groups of the level below, padded to whole groups.
+  vector<cl::Buffer> mCellOffsetsBuffers;
+  vector<cl_uint> mCellOffsetsSizes;
+
+  // Only used when reordering, mParticleIdsBuffer holds the original
+  // index of each particle
+  cl::Buffer mParticleIdsBuffer;
+  cl::Buffer mPositionsSortedBuffer;
+  cl::Buffer mPredictedSortedBuffer;
+  cl::Buffer mVelocitiesSortedBuffer;
+  cl::Buffer mParticleIdsSortedBuffer;
+  cl::Buffer mUnpermutedBuffer;
+
+  // Only used with neighbour lists, neighbour k of particle i is at
+  // k * mNumParticles + i
+  cl::Buffer mNeighboursBuffer;
+  cl::Buffer mNeighbourCountsBuffer;
+  cl::Buffer mNeighbourOverflowBuffer;
+
+  // Predicted positions at the last build and per group maxima of the
+  // squared displacement since, only used with a skin
+  cl::Buffer mBuildPositionsBuffer;
+  cl::Buffer mDisplacementBuffer;
+
+  // Per group maximum and sum of the density error, adaptive solver only
+  cl::Buffer mDensityErrorBuffer;
+
+  // Per group statistics blocks and density histograms, and the combined
+  // block that is read back
+  cl::Buffer mGroupStatisticsBuffer;
+  cl::Buffer mGroupHistogramBuffer;
+  cl::Buffer mStatisticsBuffer;
+  cl::Buffer mStatisticsHistogramBuffer;
+
+  // Linked cell lists or sorted cells
+  const NeighbourSearch mNeighbourSearch;
+
+  // Particle data is physically sorted by cell after the radix sort
+  const bool mReorderParticles;
+
+  // Solver buffers hold x, y, z and w planes instead of a float4 per
+  // particle, the display buffer stays interleaved
+  const bool mStructOfArrays;
+
+  // computeDelta applies its correction itself instead of updatePredicted
+  const bool mFusedUpdate;
+
+  // computeScaling and computeDelta stage the neighbour cells in local
+  // memory, needs reordered particles
+  const bool mTiledSolver;
+
+  // Neighbours are collected once per step for the solver kernels
+  const bool mUseNeighbourLists;
+  const cl_uint mMaxNeighbours;
+
+  // Particles that had more than mMaxNeighbours neighbours, per pending
+  // step and in total
+  vector<cl_uint> mNeighbourOverflows;
+  cl_ulong mNeighbourOverflowTotal;
+
+  // Lists and cells are only rebuilt once a particle moved more than
+  // half the skin since the last build
+  const cl_float mNeighbourSkin;
+  bool mRebuildNeighbours;
+  cl_ulong mNeighbourBuilds;
+  cl_ulong mSteps;
+
+  // Steps enqueued but not evaluated yet and their solver iterations
+  cl_uint mStepsPending;
+  cl_ulong mPendingIterations;
+  vector<cl_float> mDisplacements;
+
+  // Fixed number of solver iterations, or between the bounds until the
+  // maximum density error drops below the tolerance
+  const cl_uint mSolverIterations;
+  const bool mAdaptiveSolver;
+  const cl_uint mSolverMinIterations;
+  const cl_uint mSolverMaxIterations;
+  const cl_float mSolverTolerance;
+  cl_ulong mSolverIterationsTotal;
+  vector<cl_float2> mDensityErrors;
+  cl_float mMaxDensityError;
+  cl_float mAverageDensityError;
+
+  // Sort keys padded to the radix work size, bits per key and their limit
+  cl_uint mRadixKeys;
+  cl_uint mRadixPasses;
+  cl_uint mRadixMaxKey;
 
   // Number of cells in each direction
   cl_int4 mNumberCells;
@@ -180,6 +394,23 @@ private:
   cl_float mWaveGenerator;
 
   GLuint mSharingBufferID;
+  GLuint mRenderBufferID;
+
+  // Positions live in the OpenGL sharing buffer (false when headless)
+  const bool mUseGLSharing;
+
+  // The device orders acquires after pending OpenGL commands itself
+  // (cl_khr_gl_event), otherwise OpenGL is finished before
+  bool mImplicitGLSync;
+
+  // Completion of the last write to the display and the render buffer
+  cl::Event mDisplayReady;
+  cl::Event mRenderReady;
+  bool mDisplayPending;
+  bool mRenderPending;
+
+  // Launches kernel over items work-items with the tuned work-group size
+  void launch(cl::Kernel &kernel, const char *name, const cl_uint items);
 
   // Private member functions
   void updateCells(void);
@@ -190,9 +421,69 @@ private:
   void updatePredicted(void);
   void computeScaling(void);
   void computeDelta(void);
-#if !defined(USE_LINKEDCELL)
+  CheckpointHeader checkpointHeader(void) const;
   void radix(void);
-#endif // USE_LINKEDCELL
+  void countingSort(void);
+  void permuteParticles(void);
+  void buildNeighbourLists(void);
+  void computeDisplacement(void);
+  void computeDensityError(void);
+  void computeScalingTiled(void);
+  void computeDeltaTiled(void);
+
+  // Waits for the pending step and evaluates its counters
+  void completeStep(void);
+
+  // Hand shared buffers from OpenGL to OpenCL and back
+  void acquireGLObjects(const vector<cl::Memory> &buffers);
+  void releaseGLObjects(const vector<cl::Memory> &buffers);
+
+  // Solver positions are kept apart from the display buffer, which
+  // alternates with the render buffer if shared
+  bool
+  separatePositions(void) const {
+    return mReorderParticles || mStructOfArrays || mUseGLSharing;
+  }
+
+  // Writes data as a float4 per particle in the original order
+  void unpermute(const cl::Buffer &data, const cl::Buffer &out,
+                 const char *name);
+
+  // Velocities in the original order, unpermuted into a scratch buffer
+  // if reordering or in planes
+  const cl::Buffer &orderedVelocities(void);
+
+  // Buffer the initial or restored velocities are written to
+  const cl::Buffer &velocitiesUpload(void) const {
+    return mStructOfArrays ? mUnpermutedBuffer : mVelocitiesBuffer;
+  }
+
+  // Positions from the display buffer and uploaded velocities into the
+  // solver layout, with the given ids or else the original ones
+  void resetParticleOrder(const cl_uint *ids = NULL);
+
+  // What a checkpoint of this configuration keeps besides the particles
+  // for a bit-identical restart, CHECKPOINT_* bits and size in bytes
+  cl_uint solverStateFlags(void) const;
+  size_t solverStateSize(void) const;
+
+  // Appends size bytes of buffer to state
+  void appendBuffer(vector<char> &state, const cl::Buffer &buffer,
+                    const size_t size);
+
+  cl::Kernel findKernel(const string &name) const;
+  void resolveKernels(void);
+
+  // Bind the arguments that only change if buffers are swapped: particle
+  // data after reordering or the fused update, sorted cells after an odd
+  // number of radix passes
+  void bindParticleArgs(void);
+  void bindCellArgs(void);
+
+  // Sets the neighbour arguments of the solver kernels, either the
+  // neighbour lists or the cells
+  void setNeighbourArgs(cl::Kernel &kernel, const cl_uint index);
+  void setCellArgs(cl::Kernel &kernel, const cl_uint index);
 
 };
 
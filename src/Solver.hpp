@@ -0,0 +1,149 @@
+#ifndef __SOLVER_HPP
+#define __SOLVER_HPP
+
+#include <string>
+
+#include "hesp.hpp"
+#include "KernelProfiler.hpp"
+
+
+using std::string;
+
+
+/**
+ *  \brief  Host memory a solver copies a snapshot of its state into.
+ *
+ *  The OpenCL backend maps pinned staging buffers and reads into them
+ *  asynchronously, ready completes once the copy has landed.
+ */
+struct SnapshotBuffer {
+  cl_float4 *positions;
+  cl_float4 *velocities;
+
+  // Pinned device side memory the host pointers are mapped from
+  cl::Buffer positionsStaging;
+  cl::Buffer velocitiesStaging;
+
+  cl::Event ready;
+  bool hasEvent;
+
+  SnapshotBuffer ()
+    : positions(NULL),
+      velocities(NULL),
+      hasEvent(false) {}
+
+  // Blocks until the copy into positions and velocities is complete
+  void
+  wait(void) const {
+    if (hasEvent) {
+      ready.wait();
+    }
+  }
+};
+
+
+/**
+ *  \brief  Scalar statistics of the particles, laid out as in hesp.hpp.
+ *
+ *  The OpenCL backend reduces them on the device and reads the block
+ *  back asynchronously, ready completes once it has landed.
+ */
+struct StatisticsBlock {
+  cl_float values[_STAT_VALUES];
+  cl_uint histogram[_STAT_BINS];
+
+  cl::Event ready;
+  bool hasEvent;
+
+  StatisticsBlock ()
+    : hasEvent(false) {}
+
+  // Whether the values can be read without blocking
+  bool
+  isReady(void) const {
+    return !hasEvent || ready.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>()
+           == CL_COMPLETE;
+  }
+
+  void
+  wait(void) const {
+    if (hasEvent) {
+      ready.wait();
+    }
+  }
+};
+
+
+/**
+ *  \brief  State of the runner driving a solver, kept in checkpoints.
+ */
+struct RunState {
+  cl_float time;
+  cl_uint steps;
+
+  // Phase of the wave generator and whether it is running
+  cl_float wavePhase;
+  bool generateWaves;
+
+  RunState ()
+    : time(0.0f),
+      steps(0),
+      wavePhase(0.0f),
+      generateWaves(false) {}
+};
+
+
+/**
+ *  \brief  Common interface of the simulation backends.
+ *
+ *  Implemented by the OpenCL Simulation and the native CpuSimulation so
+ *  that runners can drive either one.
+ */
+class Solver {
+public:
+  virtual ~Solver() {}
+
+  virtual void init(void) = 0;
+  virtual void initCells(void) = 0;
+  virtual void step(void) = 0;
+
+  // Blocks until the last step is done, step may return while the
+  // device is still working on it
+  virtual void finishStep(void) = 0;
+
+  // Copy current positions and velocities
+  virtual void dumpData( cl_float4 * (&positions),
+                         cl_float4 * (&velocities) ) = 0;
+
+  virtual cl_uint getNumberParticles() const = 0;
+
+  virtual const cl_float4 getSizesMin(void) const = 0;
+  virtual const cl_float4 getSizesMax(void) const = 0;
+
+  virtual void setWaveGenerator(const double value) = 0;
+
+  // Staging memory for snapshots, created after init
+  virtual void createSnapshotBuffer(SnapshotBuffer &buffer) = 0;
+  virtual void releaseSnapshotBuffer(SnapshotBuffer &buffer) = 0;
+
+  // Starts copying positions and velocities without waiting for it
+  virtual void enqueueSnapshot(SnapshotBuffer &buffer) = 0;
+
+  // Starts reducing the current state into block without waiting for it
+  virtual void enqueueStatistics(StatisticsBlock &block) = 0;
+
+  // Full solver state and the runner state, load has to follow init
+  virtual void saveCheckpoint(const string &filename,
+                              const RunState &state) = 0;
+  virtual void loadCheckpoint(const string &filename,
+                              RunState &state) = 0;
+
+  // Per-kernel timing, has to be enabled before init
+  virtual void setProfiling(const bool enabled) = 0;
+  virtual const KernelProfiler &getProfiler(void) const = 0;
+
+  // Drops the timings so far, counters are kept
+  virtual void clearProfile(void) = 0;
+};
+
+#endif // __SOLVER_HPP
@@ -0,0 +1,234 @@
+#include "WorkGroupTuner.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <cstdio>
+#include <cctype>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::min;
+using std::ifstream;
+using std::ofstream;
+using std::istringstream;
+using std::ostringstream;
+using std::cout;
+using std::cerr;
+using std::endl;
+
+
+// Candidates are powers of two in this range
+static const size_t _MIN_CANDIDATE = 32;
+static const size_t _MAX_CANDIDATE = 1024;
+
+// Launches timed per candidate before deciding
+static const size_t _SAMPLES_PER_CANDIDATE = 5;
+
+
+static double
+median(vector<double> samples) {
+  std::sort(samples.begin(), samples.end());
+
+  return samples[samples.size() / 2];
+}
+
+WorkGroupTuner::WorkGroupTuner(const cl::Device &device,
+                               const size_t defaultSize,
+                               const string &directory)
+  : mDevice(device),
+    mDefaultSize(defaultSize),
+    mDirectory(directory),
+    mTuning(false) {
+  if ( mDirectory.empty() ) {
+    return;
+  }
+
+  // One file per device and driver, readable names
+  string name = device.getInfo<CL_DEVICE_NAME>() + "_"
+                + device.getInfo<CL_DRIVER_VERSION>();
+
+  for (size_t i = 0; i < name.size(); ++i) {
+    const char c = name[i];
+
+    if ( !isalnum( (unsigned char) c ) && c != '.' && c != '-' ) {
+      name[i] = '_';
+    }
+  }
+
+  mFilename = mDirectory + "/" + name + ".txt";
+}
+
+void
+WorkGroupTuner::load(void) {
+  if ( mFilename.empty() ) {
+    return;
+  }
+
+  ifstream ifs( mFilename.c_str() );
+  string line;
+
+  while ( std::getline(ifs, line) ) {
+    if ( line.empty() || line[0] == '#' ) {
+      continue;
+    }
+
+    istringstream iss(line);
+    string name;
+    size_t size = 0;
+
+    if (iss >> name >> size && size > 0) {
+      mTuned[name] = size;
+    }
+  }
+
+  if ( !mTuned.empty() ) {
+    cout << "Work-group sizes loaded: " << mFilename << endl;
+  }
+}
+
+size_t
+WorkGroupTuner::localSize(const string &name, const cl::Kernel &kernel) {
+  map<string, Entry>::iterator it = mEntries.find(name);
+
+  if ( it == mEntries.end() ) {
+    const size_t maximum =
+      kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(mDevice);
+    const map<string, size_t>::const_iterator tuned = mTuned.find(name);
+
+    Entry entry;
+    entry.size = min(mDefaultSize, maximum);
+    entry.launches = 0;
+    entry.current = 0;
+
+    if ( tuned != mTuned.end() && tuned->second <= maximum ) {
+      entry.size = tuned->second;
+    }
+
+    if (mTuning) {
+      for (size_t size = _MIN_CANDIDATE;
+           size <= std::min(maximum, _MAX_CANDIDATE); size *= 2) {
+        entry.candidates.push_back(size);
+      }
+
+      entry.samples.resize( entry.candidates.size() );
+    }
+
+    it = mEntries.insert( std::make_pair(name, entry) ).first;
+  }
+
+  Entry &entry = it->second;
+
+  if ( entry.candidates.empty() ) {
+    return entry.size;
+  }
+
+  // Round robin, so warming up does not favour the first candidates
+  entry.current = entry.launches++ % entry.candidates.size();
+
+  return entry.candidates[entry.current];
+}
+
+cl::Event *
+WorkGroupTuner::event(const string &name) {
+  const map<string, Entry>::const_iterator cit = mEntries.find(name);
+
+  if ( cit == mEntries.end() || cit->second.candidates.empty() ) {
+    return NULL;
+  }
+
+  Sample sample;
+  sample.name = name;
+  sample.candidate = cit->second.current;
+
+  mPending.push_back(sample);
+
+  return &mPending.back().event;
+}
+
+void
+WorkGroupTuner::collect(void) {
+  bool decided = false;
+
+  for (deque<Sample>::const_iterator cit = mPending.begin();
+       cit != mPending.end(); ++cit) {
+    Entry &entry = mEntries[cit->name];
+
+    // Samples still in flight when the kernel was decided
+    if ( entry.candidates.empty() ) {
+      continue;
+    }
+
+    const cl_ulong start = cit->event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+    const cl_ulong end = cit->event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+
+    entry.samples[cit->candidate].push_back( (end - start) * 1e-6 );
+
+    size_t best = 0;
+
+    for (size_t k = 0; k < entry.candidates.size(); ++k) {
+      if (entry.samples[k].size() < _SAMPLES_PER_CANDIDATE) {
+        best = entry.candidates.size();
+        break;
+      }
+
+      if ( median(entry.samples[k]) < median(entry.samples[best]) ) {
+        best = k;
+      }
+    }
+
+    if ( best < entry.candidates.size() ) {
+#if defined(USE_DEBUG)
+      cout << "Work-group size of " << cit->name << ": "
+           << entry.candidates[best] << endl;
+#endif // USE_DEBUG
+
+      entry.size = entry.candidates[best];
+      entry.candidates.clear();
+      entry.samples.clear();
+
+      mTuned[cit->name] = entry.size;
+      decided = true;
+    }
+  }
+
+  mPending.clear();
+
+  if (decided) {
+    this->store();
+  }
+}
+
+void
+WorkGroupTuner::store(void) const {
+  if ( mFilename.empty() ) {
+    return;
+  }
+
+  // Already existing is fine, anything else shows when writing
+  mkdir(mDirectory.c_str(), 0755);
+
+  // Concurrent runs never read a partially written file
+  ostringstream tmp;
+  tmp << mFilename << "." << getpid() << ".tmp";
+
+  ofstream ofs( tmp.str().c_str() );
+  ofs << "# Work-group sizes for " << mDevice.getInfo<CL_DEVICE_NAME>()
+      << endl;
+
+  for (map<string, size_t>::const_iterator cit = mTuned.begin();
+       cit != mTuned.end(); ++cit) {
+    ofs << cit->first << " " << cit->second << endl;
+  }
+
+  ofs.close();
+
+  if ( !ofs || std::rename( tmp.str().c_str(), mFilename.c_str() ) != 0 ) {
+    cerr << "Could not store work-group sizes: " << mFilename << endl;
+    std::remove( tmp.str().c_str() );
+    return;
+  }
+
+  cout << "Work-group sizes stored: " << mFilename << endl;
+}
@@ -0,0 +1,122 @@
+#ifndef __WORK_GROUP_TUNER_HPP
+#define __WORK_GROUP_TUNER_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+
+#include "hesp.hpp"
+
+using std::string;
+using std::vector;
+using std::deque;
+using std::map;
+
+
+/**
+ *  \brief  Chooses the work-group size of each one-dimensional launch.
+ *
+ *  Sizes come from a tuning file of the device, or else the configured
+ *  default. While tuning, launches cycle through the candidate sizes a
+ *  kernel supports, hand in an event from event() and are read out with
+ *  collect() once the queue has finished. The fastest median wins and is
+ *  written to the tuning file.
+ */
+class WorkGroupTuner {
+private:
+  // Avoid copy
+  WorkGroupTuner &operator=(const WorkGroupTuner &other);
+  WorkGroupTuner (const WorkGroupTuner &other);
+
+public:
+  /**
+   *  \brief  defaultSize 0 lets the runtime choose. An empty directory
+   *          neither loads nor stores tuned sizes.
+   */
+  WorkGroupTuner (const cl::Device &device,
+                  const size_t defaultSize,
+                  const string &directory);
+
+  /**
+   *  \brief  Tunes all kernels again instead of using the tuning file,
+   *          needs a queue with profiling enabled.
+   */
+  void
+  setTuning(const bool tuning) {
+    mTuning = tuning;
+  }
+
+  bool
+  isTuning(void) const {
+    return mTuning;
+  }
+
+  /**
+   *  \brief  Reads the tuning file of the device if there is one.
+   */
+  void
+  load(void);
+
+  /**
+   *  \brief  Work-group size of the next launch of name, 0 lets the
+   *          runtime choose.
+   */
+  size_t
+  localSize(const string &name, const cl::Kernel &kernel);
+
+  /**
+   *  \brief  Event for the launch just sized if it is a tuning sample,
+   *          NULL otherwise.
+   */
+  cl::Event *
+  event(const string &name);
+
+  /**
+   *  \brief  Reads the pending samples and stores kernels that are done;
+   *          the queue must have finished.
+   */
+  void
+  collect(void);
+
+  const string &
+  getFilename(void) const {
+    return mFilename;
+  }
+
+private:
+  struct Entry {
+    size_t size;
+    // Left to try, empty once tuned
+    vector<size_t> candidates;
+    vector< vector<double> > samples;
+    size_t launches;
+    // Candidate of the last launch
+    size_t current;
+  };
+
+  struct Sample {
+    string name;
+    size_t candidate;
+    cl::Event event;
+  };
+
+  cl::Device mDevice;
+  size_t mDefaultSize;
+  string mDirectory;
+  string mFilename;
+  bool mTuning;
+
+  map<string, Entry> mEntries;
+
+  // Tuned or loaded sizes, as written to the file
+  map<string, size_t> mTuned;
+
+  // deque keeps the handed out event pointers valid while growing
+  deque<Sample> mPending;
+
+  void
+  store(void) const;
+};
+
+#endif // __WORK_GROUP_TUNER_HPP
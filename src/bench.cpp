@@ -0,0 +1,598 @@
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "hesp.hpp"
+#include "ocl/clsetup.hpp"
+#include "ocl/programcache.hpp"
+#include "io/ConfigReader.hpp"
+#include "io/PartReader.hpp"
+#include "io/PbfFile.hpp"
+#include "Simulation.hpp"
+#include "DataLoader.hpp"
+#include "cpu/CpuSimulation.hpp"
+
+using std::vector;
+using std::string;
+using std::ostream;
+using std::ostringstream;
+using std::istringstream;
+using std::ofstream;
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::exception;
+using std::runtime_error;
+
+
+// One entry of the benchmark matrix
+struct BenchCase {
+  string scenario; /**< .par file, or empty for a generated grid */
+  size_t gridParticles;
+  string backend; /**< "opencl" or "cpu" */
+  string neighbourSearch;
+};
+
+struct BenchOptions {
+  vector<string> scenarios;
+  vector<size_t> grids;
+  vector<string> backends;
+  vector<string> searches;
+  unsigned int warmupSteps;
+  unsigned int steps;
+  string output;
+  bool kernelTimes;
+
+  string platform;
+  string device;
+  cl_device_type deviceType;
+  string kernelCache;
+  unsigned int numThreads;
+
+  BenchOptions ()
+    : warmupSteps(10),
+      steps(50),
+      output("bench.json"),
+      kernelTimes(true),
+      deviceType(CL_DEVICE_TYPE_ALL),
+      kernelCache("kernel_cache"),
+      numThreads(0) {
+    scenarios.push_back("dam_coarse.par");
+    scenarios.push_back("box_big.par");
+    grids.push_back(10000);
+    grids.push_back(100000);
+    grids.push_back(1000000);
+    grids.push_back(10000000);
+    backends.push_back("opencl");
+    backends.push_back("cpu");
+    searches.push_back("linkedcell");
+    searches.push_back("radix");
+    searches.push_back("counting");
+  }
+};
+
+
+static double wallTime(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static vector<string>
+splitList(const string &value) {
+  vector<string> items;
+  istringstream iss(value);
+  string item;
+
+  while ( std::getline(iss, item, ',') ) {
+    if ( !item.empty() ) {
+      items.push_back(item);
+    }
+  }
+
+  return items;
+}
+
+static unsigned long
+parseCount(const string &name, const string &value) {
+  char *end = NULL;
+  const unsigned long count = strtoul(value.c_str(), &end, 10);
+
+  // strtoul wraps negative values instead of failing
+  if (value.empty() || value.find('-') != string::npos || *end != '\0') {
+    throw runtime_error("Invalid value for " + name + ": " + value);
+  }
+
+  return count;
+}
+
+static void
+printUsage(ostream &os, const string &program) {
+  os << "Usage: " << program << " [options]" << endl
+     << endl
+     << "Runs every scenario and grid with every backend and neighbour "
+     << "search headless," << endl
+     << "each in its own process, and writes the results as JSON." << endl
+     << endl
+     << "  --scenarios=A.par,B.par    default dam_coarse.par,box_big.par"
+     << endl
+     << "  --grids=N,M                generated dam grids of about N "
+     << "particles," << endl
+     << "                             default 10000,100000,1000000,10000000"
+     << endl
+     << "  --backends=opencl,cpu      default both" << endl
+     << "  --searches=linkedcell,radix,counting  OpenCL neighbour "
+     << "searches, default all" << endl
+     << "  --warmup=N                 untimed steps first, default 10" << endl
+     << "  --steps=N                  timed steps, default 50" << endl
+     << "  --output=FILE              default bench.json, - for stdout" << endl
+     << "  --no-kernel-times          no profiling queue, no breakdown" << endl
+     << "  --platform=INDEX|NAME      OpenCL platform" << endl
+     << "  --device=INDEX|NAME        OpenCL device" << endl
+     << "  --device-type=TYPE         gpu, cpu, accelerator or all" << endl
+     << "  --kernel-cache=DIR         program binary cache, empty disables"
+     << endl
+     << "  --threads=N                threads of the native backend" << endl;
+}
+
+static BenchOptions
+parseOptions(const int argc, char **argv) {
+  BenchOptions options;
+
+  for (int i = 1; i < argc; ++i) {
+    const string arg(argv[i]);
+    const size_t equals = arg.find('=');
+    const string name = arg.substr(0, equals);
+    const string value = equals == string::npos ? "" : arg.substr(equals + 1);
+
+    if ( name == "--help" ) {
+      printUsage(cout, argv[0]);
+      exit(EXIT_SUCCESS);
+    } else if ( name == "--scenarios" ) {
+      options.scenarios = splitList(value);
+    } else if ( name == "--grids" ) {
+      const vector<string> grids = splitList(value);
+
+      options.grids.clear();
+
+      for (size_t k = 0; k < grids.size(); ++k) {
+        options.grids.push_back( parseCount(name, grids[k]) );
+      }
+    } else if ( name == "--backends" ) {
+      options.backends = splitList(value);
+    } else if ( name == "--searches" ) {
+      options.searches = splitList(value);
+
+      // Cases are labelled with the given names, typos must not pass
+      for (size_t k = 0; k < options.searches.size(); ++k) {
+        NeighbourSearch search;
+
+        if ( !ConfigReader::parseNeighbourSearch(options.searches[k],
+             search) ) {
+          throw runtime_error("Unknown neighbour search: "
+                              + options.searches[k]);
+        }
+      }
+    } else if ( name == "--warmup" ) {
+      options.warmupSteps = parseCount(name, value);
+    } else if ( name == "--steps" ) {
+      options.steps = parseCount(name, value);
+    } else if ( name == "--output" ) {
+      options.output = value;
+    } else if ( name == "--no-kernel-times" ) {
+      options.kernelTimes = false;
+    } else if ( name == "--platform" ) {
+      options.platform = value;
+    } else if ( name == "--device" ) {
+      options.device = value;
+    } else if ( name == "--device-type" ) {
+      if (value == "gpu") {
+        options.deviceType = CL_DEVICE_TYPE_GPU;
+      } else if (value == "cpu") {
+        options.deviceType = CL_DEVICE_TYPE_CPU;
+      } else if (value == "accelerator") {
+        options.deviceType = CL_DEVICE_TYPE_ACCELERATOR;
+      } else if (value == "all") {
+        options.deviceType = CL_DEVICE_TYPE_ALL;
+      } else {
+        throw runtime_error("Unknown device type: " + value);
+      }
+    } else if ( name == "--kernel-cache" ) {
+      options.kernelCache = value;
+    } else if ( name == "--threads" ) {
+      options.numThreads = parseCount(name, value);
+    } else {
+      throw runtime_error("Unknown argument: " + arg + " (see --help)");
+    }
+  }
+
+  if (options.steps == 0) {
+    throw runtime_error("--steps has to be at least 1");
+  }
+
+  return options;
+}
+
+/**
+ *  \brief  Cube of particles in the corner of a box twice as wide, the
+ *          dam_coarse setup scaled to about count particles.
+ */
+static ConfigParameters
+generateGrid(const size_t count, vector<Particle> &particles) {
+  // Kernel radius and particle spacing of tools/gen_grid.py
+  const cl_float h = 1.0f;
+  const cl_float s = h / 2.0f;
+  const cl_float margin = 1.0f;
+
+  const size_t side = std::max( 2.0, floor( cbrt( (double) count ) + 0.5 ) );
+  const cl_float width = (side - 1) * s;
+
+  particles.resize(side * side * side);
+
+  size_t i = 0;
+
+  for (size_t x = 0; x < side; ++x) {
+    for (size_t y = 0; y < side; ++y) {
+      for (size_t z = 0; z < side; ++z, ++i) {
+        Particle &p = particles[i];
+
+        p.m = 1.0f;
+        p.x[0] = margin + x * s;
+        p.x[1] = margin + y * s;
+        p.x[2] = margin + z * s;
+
+        for (int d = 0; d < DIMENSIONS; ++d) {
+          p.v[d] = 0.0f;
+          p.a[d] = 0.0f;
+        }
+      }
+    }
+  }
+
+  ConfigParameters parameters;
+
+  parameters.timeStepLength = 0.01f;
+  parameters.timeEnd = 1.0e6f;
+  // Whole cells, the fluid spreads over twice its width in x and z
+  parameters.xN = ceil( (2.0f * width + 2.0f * margin) / h );
+  parameters.yN = ceil( (width + 2.0f * margin) / h );
+  parameters.zN = ceil( (2.0f * width + 2.0f * margin) / h );
+  parameters.xMax = parameters.xN * h;
+  parameters.yMax = parameters.yN * h;
+  parameters.zMax = parameters.zN * h;
+  parameters.restDensity = particles.size() / (width * width * width);
+  parameters.clWorkGroupSize1D = 256;
+
+  return parameters;
+}
+
+static string
+caseName(const BenchCase &bench) {
+  ostringstream oss;
+
+  if ( bench.scenario.empty() ) {
+    oss << "grid_" << bench.gridParticles;
+  } else {
+    oss << bench.scenario;
+  }
+
+  return oss.str();
+}
+
+// Peak resident memory of this process
+static long
+peakResidentBytes(void) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+#if defined(__APPLE__)
+  return usage.ru_maxrss;
+#else
+  return usage.ru_maxrss * 1024L;
+#endif // __APPLE__
+}
+
+/**
+ *  \brief  Runs one case and writes its JSON object.
+ */
+static void
+runCase(const BenchOptions &options, const BenchCase &bench, ostream &os) {
+  DataLoader dataLoader;
+  ConfigReader configReader;
+  ConfigParameters parameters;
+  vector<Particle> particleVector;
+  PbfFile pbfFile;
+  ParticleView particles;
+
+  if ( bench.scenario.empty() ) {
+    parameters = generateGrid(bench.gridParticles, particleVector);
+    particles = ParticleView(particleVector);
+  } else {
+    parameters = configReader.read( dataLoader.getPathForScenario(
+                                      bench.scenario) );
+
+    const string partFilename = dataLoader.getPathForScenario(
+                                  parameters.partInputFile);
+
+    if ( PbfFile::isPbf(partFilename) ) {
+      pbfFile.open(partFilename);
+      particles = pbfFile.view();
+    } else {
+      PartReader partReader;
+      particleVector = partReader.read(partFilename);
+      particles = ParticleView(particleVector);
+    }
+  }
+
+  // Native cases are labelled "native", their backend has one search
+  if ( bench.backend == "opencl"
+       && !ConfigReader::parseNeighbourSearch(bench.neighbourSearch,
+           parameters.neighbourSearch) ) {
+    throw runtime_error("Unknown neighbour search: " + bench.neighbourSearch);
+  }
+
+  ConfigReader::check(parameters);
+
+  // Everything OpenCL lives only in this scope of the child process
+  CSetupCL clSetup;
+  cl::Platform platform;
+  cl::Device device;
+  cl::Context context;
+  map<string, cl::Kernel> kernels;
+  Solver *solver = NULL;
+  string deviceName = "native";
+
+  if (bench.backend == "opencl") {
+    platform = clSetup.selectPlatform(options.platform);
+    device = clSetup.selectDevice(platform, options.deviceType,
+                                  options.device);
+    context = cl::Context( vector<cl::Device>(1, device) );
+    deviceName = device.getInfo<CL_DEVICE_NAME>();
+
+    const string header = clSetup.readSource(
+                            dataLoader.getPathForKernel("hesp.hpp") );
+    const vector<string> kernelFiles = Simulation::kernelFiles();
+    vector<string> kernelSources;
+
+    for (vector<string>::const_iterator cit = kernelFiles.begin();
+         cit != kernelFiles.end(); ++cit) {
+      kernelSources.push_back( header + clSetup.readSource(
+                                 dataLoader.getPathForKernel(*cit) ) );
+    }
+
+    ProgramCache programCache(options.kernelCache);
+    cl::Program program = programCache.build(clSetup, kernelSources,
+                          context, platform, device,
+                          Simulation::buildOptions( parameters,
+                              particles.size() ));
+
+    kernels = clSetup.createKernelsMap(program);
+    solver = new Simulation(parameters, particles, kernels, context, device);
+  } else if (bench.backend == "cpu") {
+    solver = new CpuSimulation(parameters, particles, options.numThreads);
+  } else {
+    throw runtime_error("Unknown backend: " + bench.backend);
+  }
+
+  solver->setProfiling(options.kernelTimes);
+  solver->init();
+  solver->initCells();
+
+  for (unsigned int i = 0; i < options.warmupSteps; ++i) {
+    solver->step();
+  }
+
+  solver->clearProfile();
+
+  const double start = wallTime();
+
+  for (unsigned int i = 0; i < options.steps; ++i) {
+    solver->step();
+  }
+
+  solver->finishStep();
+
+  const double elapsed = wallTime() - start;
+  const double stepsPerSecond = options.steps / elapsed;
+
+  os << "{" << endl
+     << "\"scenario\": \"" << caseName(bench) << "\"," << endl
+     << "\"backend\": \"" << bench.backend << "\"," << endl
+     << "\"neighbourSearch\": \"" << bench.neighbourSearch << "\"," << endl
+     << "\"device\": \"" << deviceName << "\"," << endl
+     << "\"particles\": " << solver->getNumberParticles() << "," << endl
+     << "\"warmupSteps\": " << options.warmupSteps << "," << endl
+     << "\"steps\": " << options.steps << "," << endl
+     << "\"elapsed\": " << elapsed << "," << endl
+     << "\"stepsPerSecond\": " << stepsPerSecond << "," << endl
+     << "\"particleUpdatesPerSecond\": "
+     << stepsPerSecond * solver->getNumberParticles() << "," << endl
+     << "\"peakResidentBytes\": " << peakResidentBytes() << "," << endl
+     << "\"profile\": ";
+
+  solver->getProfiler().writeJSON(os);
+
+  os << "}";
+
+  delete solver;
+}
+
+/**
+ *  \brief  Runs a case in a child process and returns its JSON object.
+ *
+ *  Every case gets a fresh OpenCL runtime and its own peak memory, and a
+ *  crashing case does not end the sweep.
+ */
+static string
+forkCase(const BenchOptions &options, const BenchCase &bench) {
+  int fds[2];
+
+  if (pipe(fds) != 0) {
+    throw runtime_error("Could not create a pipe");
+  }
+
+  cout.flush();
+
+  const pid_t pid = fork();
+
+  if (pid < 0) {
+    throw runtime_error("Could not fork");
+  }
+
+  if (pid == 0) {
+    close(fds[0]);
+
+    int status = EXIT_SUCCESS;
+
+    try {
+      ostringstream oss;
+      runCase(options, bench, oss);
+
+      const string result = oss.str();
+      size_t written = 0;
+
+      while (written < result.size()) {
+        const ssize_t n = write(fds[1], result.data() + written,
+                                result.size() - written);
+
+        if (n <= 0) {
+          break;
+        }
+
+        written += n;
+      }
+    } catch (const cl::Error &ecl) {
+      cerr << "OpenCL Error caught: " << ecl.what() << "(" << ecl.err()
+           << ")" << endl;
+      status = EXIT_FAILURE;
+    } catch (const exception &e) {
+      cerr << "STD Error caught: " << e.what() << endl;
+      status = EXIT_FAILURE;
+    }
+
+    close(fds[1]);
+    cout.flush();
+    _exit(status);
+  }
+
+  close(fds[1]);
+
+  string result;
+  char buffer[4096];
+  ssize_t n;
+
+  while ( (n = read(fds[0], buffer, sizeof(buffer))) > 0 ) {
+    result.append(buffer, n);
+  }
+
+  close(fds[0]);
+
+  int status = 0;
+  waitpid(pid, &status, 0);
+
+  if ( !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS
+       || result.empty() ) {
+    ostringstream oss;
+    oss << "{" << endl
+        << "\"scenario\": \"" << caseName(bench) << "\"," << endl
+        << "\"backend\": \"" << bench.backend << "\"," << endl
+        << "\"neighbourSearch\": \"" << bench.neighbourSearch << "\","
+        << endl
+        << "\"failed\": true" << endl
+        << "}";
+
+    return oss.str();
+  }
+
+  return result;
+}
+
+// Benchmark driver: sweeps scenarios, generated grids, backends and
+// neighbour searches headless and reports throughput as JSON
+int main(int argc, char **argv) {
+  try {
+    const BenchOptions options = parseOptions(argc, argv);
+    vector<BenchCase> cases;
+
+    for (size_t b = 0; b < options.backends.size(); ++b) {
+      // The native backend has a single neighbour search
+      vector<string> searches = options.searches;
+
+      if (options.backends[b] == "cpu") {
+        searches.assign(1, "native");
+      }
+
+      for (size_t s = 0; s < searches.size(); ++s) {
+        BenchCase bench;
+        bench.backend = options.backends[b];
+        bench.neighbourSearch = searches[s];
+        bench.gridParticles = 0;
+
+        for (size_t k = 0; k < options.scenarios.size(); ++k) {
+          bench.scenario = options.scenarios[k];
+          cases.push_back(bench);
+        }
+
+        bench.scenario.clear();
+
+        for (size_t k = 0; k < options.grids.size(); ++k) {
+          bench.gridParticles = options.grids[k];
+          cases.push_back(bench);
+        }
+      }
+    }
+
+    ostringstream json;
+    unsigned int failed = 0;
+
+    json << "{" << endl
+         << "\"warmupSteps\": " << options.warmupSteps << "," << endl
+         << "\"steps\": " << options.steps << "," << endl
+         << "\"results\": [" << endl;
+
+    for (size_t k = 0; k < cases.size(); ++k) {
+      cerr << "[" << k + 1 << "/" << cases.size() << "] "
+           << caseName(cases[k]) << " " << cases[k].backend << " "
+           << cases[k].neighbourSearch << endl;
+
+      const string result = forkCase(options, cases[k]);
+
+      if (result.find("\"failed\": true") != string::npos) {
+        ++failed;
+      }
+
+      json << (k == 0 ? "" : ",\n") << result;
+    }
+
+    json << endl << "]" << endl << "}" << endl;
+
+    if (options.output == "-") {
+      cout << json.str();
+    } else {
+      ofstream ofs( options.output.c_str() );
+      ofs << json.str();
+      cerr << "results: " << options.output << endl;
+    }
+
+    if (failed > 0) {
+      cerr << failed << " of " << cases.size() << " cases failed" << endl;
+      return EXIT_FAILURE;
+    }
+  } catch (const exception &e) {
+    cerr << "STD Error caught: " << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,660 @@
+#include "CpuSimulation.hpp"
+
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+using std::sqrt;
+using std::max;
+using std::min;
+using std::memory_order_relaxed;
+
+// Macro used for the end of cell list
+static const cl_int END_OF_CELL_LIST = -1;
+
+
+CpuSimulation::CpuSimulation(const ConfigParameters &parameters,
+                             const ParticleView &particles,
+                             const unsigned int numThreads,
+                             const ThreadPool::Schedule schedule)
+  : mTimestepLength(parameters.timeStepLength),
+    mRestDensity(parameters.restDensity),
+    mNumParticles( particles.size() ),
+    mParticles(particles),
+    mPool(numThreads, schedule),
+    mCells(NULL),
+    mWaveGenerator(0.0f),
+    mSolverIterations(parameters.solverIterations),
+    mAdaptiveSolver(parameters.adaptiveSolver),
+    mSolverMinIterations(parameters.solverMinIterations),
+    mSolverMaxIterations(parameters.solverMaxIterations),
+    mSolverTolerance(parameters.solverTolerance),
+    mSolverIterationsTotal(0),
+    mSteps(0),
+    mMaxDensityError(0.0f),
+    mAverageDensityError(0.0f) {
+
+  mSystemSizeMin.s[0] = parameters.xMin;
+  mSystemSizeMin.s[1] = parameters.yMin;
+  mSystemSizeMin.s[2] = parameters.zMin;
+  mSystemSizeMin.s[3] = 0.0f;
+
+  mSystemSizeMax.s[0] = parameters.xMax;
+  mSystemSizeMax.s[1] = parameters.yMax;
+  mSystemSizeMax.s[2] = parameters.zMax;
+  mSystemSizeMax.s[3] = 0.0f;
+
+  mNumberCells.s[0] = parameters.xN;
+  mNumberCells.s[1] = parameters.yN;
+  mNumberCells.s[2] = parameters.zN;
+  mNumberCells.s[3] = 0;
+  mCellCount = cellSlots(parameters);
+  mMortonCells = parameters.mortonCells;
+
+  if (parameters.hashedCells) {
+    std::cerr << "The native backend has no hashed cells, using the grid."
+              << std::endl;
+  }
+
+  mCellLength.s[0] = (parameters.xMax - parameters.xMin) / parameters.xN;
+  mCellLength.s[1] = (parameters.yMax - parameters.yMin) / parameters.yN;
+  mCellLength.s[2] = (parameters.zMax - parameters.zMin) / parameters.zN;
+  mCellLength.s[3] = 0.0f;
+
+  // Same derivation as the -D build options in main.cpp
+  mH = mCellLength.s[0];
+  mH2 = mH * mH;
+  mPoly6Factor = 315.0f / (64.0f * M_PI * pow(mH, 9));
+  mGradSpikyFactor = 45.0f / (M_PI * pow(mH, 6));
+}
+
+CpuSimulation::~CpuSimulation () {
+  delete[] mCells;
+}
+
+void
+CpuSimulation::init(void) {
+
+#if defined(USE_DEBUG)
+  std::cout << "[START] CpuSimulation::init" << std::endl;
+  std::cout << "Number of particles: " << mNumParticles << std::endl;
+  std::cout << "Threads: " << mPool.getNumberThreads() << std::endl;
+#endif // USE_DEBUG
+
+  mPositions.resize(mNumParticles);
+  mPredicted.resize(mNumParticles);
+  mVelocities.resize(mNumParticles);
+  mDelta.resize(mNumParticles);
+  mDeltaVelocities.resize(mNumParticles);
+  mScalingFactors.resize(mNumParticles);
+
+  for (cl_uint i = 0; i < mNumParticles; ++i) {
+    for (int d = 0; d < DIMENSIONS; ++d) {
+      mPositions[i].s[d] = mParticles.position(i, d);
+      mVelocities[i].s[d] = mParticles.velocity(i, d);
+    }
+
+    mPositions[i].s[3] = 0.0f;
+    mVelocities[i].s[3] = mParticles.mass(i);
+  }
+
+  this->initCells();
+}
+
+void
+CpuSimulation::initCells(void) {
+  if (mCells == NULL) {
+    mCells = new std::atomic<cl_int>[mCellCount];
+  }
+
+  for (cl_uint c = 0; c < mCellCount; ++c) {
+    mCells[c].store(END_OF_CELL_LIST, memory_order_relaxed);
+  }
+
+  mParticlesList.assign(mNumParticles, END_OF_CELL_LIST);
+}
+
+void
+CpuSimulation::cellOf(const cl_float4 &position, int cell[3]) const {
+  for (int d = 0; d < 3; ++d) {
+    cell[d] = (int) ( (position.s[d] - mSystemSizeMin.s[d])
+                      / mCellLength.s[d] );
+  }
+}
+
+cl_uint
+CpuSimulation::cellIndex(const int cell[3]) const {
+  if (mMortonCells) {
+    return mortonKey(cell[0], cell[1], cell[2]);
+  }
+
+  return cell[0] + cell[1] * mNumberCells.s[0]
+         + cell[2] * mNumberCells.s[0] * mNumberCells.s[1];
+}
+
+/**
+ *  \brief  Calls visit(next) for every particle in the 27 cells around i,
+ *          walking the linked cell lists like the OpenCL kernels do.
+ */
+template <class Visitor>
+static inline void
+forEachNeighbour(const int current_cell[3],
+                 const cl_int4 &numberCells,
+                 const bool mortonCells,
+                 const std::atomic<cl_int> *cells,
+                 const cl_int *particles_list,
+                 Visitor &visit) {
+  for (int x = -1; x <= 1; ++x) {
+    for (int y = -1; y <= 1; ++y) {
+      for (int z = -1; z <= 1; ++z) {
+        const int nx = current_cell[0] + x;
+        const int ny = current_cell[1] + y;
+        const int nz = current_cell[2] + z;
+
+        if (nx < 0 || nx >= numberCells.s[0] ||
+            ny < 0 || ny >= numberCells.s[1] ||
+            nz < 0 || nz >= numberCells.s[2]) {
+          continue;
+        }
+
+        const cl_uint cell_index = mortonCells ? mortonKey(nx, ny, nz)
+                                   : nx + ny * numberCells.s[0]
+                                   + nz * numberCells.s[0] * numberCells.s[1];
+
+        cl_int next = cells[cell_index].load(memory_order_relaxed);
+
+        while (next != END_OF_CELL_LIST) {
+          visit(next);
+          next = particles_list[next];
+        }
+      }
+    }
+  }
+}
+
+void
+CpuSimulation::predictPositions(void) {
+  const cl_float dt = mTimestepLength;
+
+  mPool.parallelFor(mNumParticles, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      cl_float4 &v = mVelocities[i];
+      v.s[1] += dt * -9.81f;
+
+      for (int d = 0; d < 3; ++d) {
+        mPredicted[i].s[d] = mPositions[i].s[d] + dt * v.s[d];
+      }
+    }
+  });
+}
+
+void
+CpuSimulation::updateCells(void) {
+  mPool.parallelFor(max<size_t>(mCellCount, mNumParticles),
+  [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      if (i < mCellCount) {
+        mCells[i].store(END_OF_CELL_LIST, memory_order_relaxed);
+      }
+
+      if (i < mNumParticles) {
+        mParticlesList[i] = END_OF_CELL_LIST;
+      }
+    }
+  });
+
+  mPool.parallelFor(mNumParticles, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      int cell[3];
+      cellOf(mPredicted[i], cell);
+
+      // Unlike the kernel, never write outside of the cell array
+      for (int d = 0; d < 3; ++d) {
+        cell[d] = min(max(cell[d], 0), mNumberCells.s[d] - 1);
+      }
+
+      mParticlesList[i] = mCells[cellIndex(cell)].exchange(i);
+    }
+  });
+}
+
+void
+CpuSimulation::computeScaling(void) {
+  const cl_float h = mH;
+  const cl_float h2 = mH2;
+  const cl_float e = 10000.0f;
+
+  mPool.parallelFor(mNumParticles, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      const cl_float4 pi = mPredicted[i];
+
+      int current_cell[3];
+      cellOf(pi, current_cell);
+
+      // Sum of rho_i, |nabla p_k C_i|^2 and nabla p_k C_i for k = i
+      cl_float density_sum = 0.0f;
+      cl_float gradient_sum_k = 0.0f;
+      cl_float gradient_sum_k_i[3] = { 0.0f, 0.0f, 0.0f };
+
+      auto visit = [&](cl_int next) {
+        if ( (cl_int) i == next ) {
+          return;
+        }
+
+        const cl_float4 &pj = mPredicted[next];
+        const cl_float r[3] = { pi.s[0] - pj.s[0],
+                                pi.s[1] - pj.s[1],
+                                pi.s[2] - pj.s[2]
+                              };
+        const cl_float r_length_2 = r[0] * r[0] + r[1] * r[1] + r[2] * r[2];
+
+        // If h == r every term gets zero, so < h not <= h
+        if (r_length_2 > 0.0f && r_length_2 < h2) {
+          const cl_float r_length = sqrt(r_length_2);
+          const cl_float spiky = mGradSpikyFactor * (h - r_length)
+                                 * (h - r_length) / r_length;
+
+          // equation (8), if k = j
+          const cl_float gradient_spiky[3] = { r[0] * spiky,
+                                               r[1] * spiky,
+                                               r[2] * spiky
+                                             };
+
+          // equation (2)
+          density_sum += mPoly6Factor * (h2 - r_length_2)
+                         * (h2 - r_length_2) * (h2 - r_length_2);
+
+          // equation (9), denominator, if k = j
+          gradient_sum_k += sqrt(gradient_spiky[0] * gradient_spiky[0]
+                                 + gradient_spiky[1] * gradient_spiky[1]
+                                 + gradient_spiky[2] * gradient_spiky[2]);
+
+          // equation (8), if k = i
+          for (int d = 0; d < 3; ++d) {
+            gradient_sum_k_i[d] += gradient_spiky[d];
+          }
+        }
+      };
+
+      forEachNeighbour(current_cell, mNumberCells, mMortonCells, mCells,
+                       &mParticlesList[0], visit);
+
+      // equation (9), denominator, if k = i
+      gradient_sum_k += sqrt(gradient_sum_k_i[0] * gradient_sum_k_i[0]
+                             + gradient_sum_k_i[1] * gradient_sum_k_i[1]
+                             + gradient_sum_k_i[2] * gradient_sum_k_i[2]);
+
+      mPredicted[i].s[3] = density_sum;
+
+      // equation (1)
+      const cl_float density_constraint = (density_sum / mRestDensity) - 1.0f;
+
+      // equation (11)
+      mScalingFactors[i] = -1.0f * density_constraint
+                           / (gradient_sum_k * gradient_sum_k
+                              / (mRestDensity * mRestDensity) + e);
+    }
+  });
+}
+
+void
+CpuSimulation::computeDelta(void) {
+  const cl_float h = mH;
+  const cl_float h2 = mH2;
+
+  mPool.parallelFor(mNumParticles, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      const cl_float4 pi = mPredicted[i];
+
+      int current_cell[3];
+      cellOf(pi, current_cell);
+
+      // Sum of lambdas
+      cl_float sum[3] = { 0.0f, 0.0f, 0.0f };
+
+      auto visit = [&](cl_int next) {
+        if ( (cl_int) i == next ) {
+          return;
+        }
+
+        const cl_float4 &pj = mPredicted[next];
+        const cl_float r[3] = { pi.s[0] - pj.s[0],
+                                pi.s[1] - pj.s[1],
+                                pi.s[2] - pj.s[2]
+                              };
+        const cl_float r_length_2 = r[0] * r[0] + r[1] * r[1] + r[2] * r[2];
+
+        if (r_length_2 > 0.0f && r_length_2 < h2) {
+          const cl_float r_length = sqrt(r_length_2);
+          const cl_float spiky = -1.0f * mGradSpikyFactor * (h - r_length)
+                                 * (h - r_length) / r_length;
+
+          // Sum for delta p of scaling factors and grad spiky
+          // in equation (12)
+          const cl_float lambda = mScalingFactors[i] + mScalingFactors[next];
+
+          for (int d = 0; d < 3; ++d) {
+            sum[d] += lambda * r[d] * spiky;
+          }
+        }
+      };
+
+      forEachNeighbour(current_cell, mNumberCells, mMortonCells, mCells,
+                       &mParticlesList[0], visit);
+
+      // equation (12)
+      cl_float future[3];
+
+      for (int d = 0; d < 3; ++d) {
+        future[d] = pi.s[d] + sum[d] / mRestDensity;
+      }
+
+      // Keep the particles inside the system, the left wall moves with
+      // the wave generator
+      const cl_float wallMinX = mSystemSizeMin.s[0] + mWaveGenerator;
+
+      if ( (future[0] - h) < wallMinX ) {
+        future[0] = wallMinX + h;
+      } else if ( (future[0] + h) > mSystemSizeMax.s[0] ) {
+        future[0] = mSystemSizeMax.s[0] - h;
+      }
+
+      for (int d = 1; d < 3; ++d) {
+        if ( (future[d] - h) < mSystemSizeMin.s[d] ) {
+          future[d] = mSystemSizeMin.s[d] + h;
+        } else if ( (future[d] + h) > mSystemSizeMax.s[d] ) {
+          future[d] = mSystemSizeMax.s[d] - h;
+        }
+      }
+
+      for (int d = 0; d < 3; ++d) {
+        mDelta[i].s[d] = future[d] - pi.s[d];
+      }
+    }
+  });
+}
+
+void
+CpuSimulation::updatePredicted(void) {
+  mPool.parallelFor(mNumParticles, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      for (int d = 0; d < 3; ++d) {
+        mPredicted[i].s[d] += mDelta[i].s[d];
+      }
+    }
+  });
+}
+
+void
+CpuSimulation::updateVelocities(void) {
+  const cl_float dt = mTimestepLength;
+
+  mPool.parallelFor(mNumParticles, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      for (int d = 0; d < 3; ++d) {
+        mVelocities[i].s[d] = (mPredicted[i].s[d] - mPositions[i].s[d]) / dt;
+      }
+    }
+  });
+}
+
+void
+CpuSimulation::applyVorticityAndViscosity(void) {
+  const cl_float h2 = mH2;
+
+  mPool.parallelFor(mNumParticles, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      const cl_float4 pi = mPredicted[i];
+      const cl_float4 vi = mVelocities[i];
+
+      int current_cell[3];
+      cellOf(pi, current_cell);
+
+      cl_float viscosity_sum[3] = { 0.0f, 0.0f, 0.0f };
+
+      auto visit = [&](cl_int next) {
+        if ( (cl_int) i == next ) {
+          return;
+        }
+
+        const cl_float4 &pj = mPredicted[next];
+        const cl_float r[3] = { pi.s[0] - pj.s[0],
+                                pi.s[1] - pj.s[1],
+                                pi.s[2] - pj.s[2]
+                              };
+        const cl_float r_length_2 = r[0] * r[0] + r[1] * r[1] + r[2] * r[2];
+
+        if (r_length_2 > 0.0f && r_length_2 < h2) {
+          const cl_float poly6 = mPoly6Factor * (h2 - r_length_2)
+                                 * (h2 - r_length_2) * (h2 - r_length_2);
+          const cl_float weight = (1.0f / pj.s[3]) * poly6;
+
+          for (int d = 0; d < 3; ++d) {
+            viscosity_sum[d] += (mVelocities[next].s[d] - vi.s[d]) * weight;
+          }
+        }
+      };
+
+      forEachNeighbour(current_cell, mNumberCells, mMortonCells, mCells,
+                       &mParticlesList[0], visit);
+
+      const cl_float c = 0.01f;
+
+      for (int d = 0; d < 3; ++d) {
+        mDeltaVelocities[i].s[d] = c * viscosity_sum[d];
+      }
+    }
+  });
+}
+
+void
+CpuSimulation::updatePositions(void) {
+  mPool.parallelFor(mNumParticles, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      cl_float4 &v = mVelocities[i];
+
+      for (int d = 0; d < 3; ++d) {
+        mPositions[i].s[d] = mPredicted[i].s[d];
+        v.s[d] += mDeltaVelocities[i].s[d];
+      }
+
+      mPositions[i].s[3] = sqrt(v.s[0] * v.s[0] + v.s[1] * v.s[1]
+                                + v.s[2] * v.s[2]);
+    }
+  });
+}
+
+void
+CpuSimulation::computeDensityError(void) {
+  // Serial, one pass over the densities is cheap next to the solver loops
+  cl_float maxError = 0.0f;
+  double sumError = 0.0;
+
+  for (cl_uint i = 0; i < mNumParticles; ++i) {
+    const cl_float error = std::max(mPredicted[i].s[3] / mRestDensity - 1.0f,
+                                    0.0f);
+
+    maxError = std::max(maxError, error);
+    sumError += error;
+  }
+
+  mMaxDensityError = maxError;
+  mAverageDensityError = sumError / mNumParticles;
+}
+
+void
+CpuSimulation::runStage(const char *name,
+                        void (CpuSimulation::*stage)(void)) {
+  if (!mProfiler.isEnabled()) {
+    (this->*stage)();
+    return;
+  }
+
+  const std::chrono::steady_clock::time_point start
+    = std::chrono::steady_clock::now();
+
+  (this->*stage)();
+
+  const std::chrono::duration<double, std::milli> elapsed
+    = std::chrono::steady_clock::now() - start;
+
+  mProfiler.addSample(name, elapsed.count());
+}
+
+void
+CpuSimulation::step(void) {
+  this->runStage("predictPositions", &CpuSimulation::predictPositions);
+  this->runStage("updateCells", &CpuSimulation::updateCells);
+
+  const cl_uint solver_iterations = mAdaptiveSolver ? mSolverMaxIterations
+                                    : mSolverIterations;
+  cl_uint iterations = 0;
+
+  for (cl_uint i = 0; i < solver_iterations; ++i) {
+    this->runStage("computeScaling", &CpuSimulation::computeScaling);
+
+    if (mAdaptiveSolver && i >= mSolverMinIterations) {
+      this->runStage("densityError", &CpuSimulation::computeDensityError);
+
+      if (mMaxDensityError < mSolverTolerance) {
+        break;
+      }
+    }
+
+    ++iterations;
+
+    this->runStage("computeDelta", &CpuSimulation::computeDelta);
+    this->runStage("updatePredicted", &CpuSimulation::updatePredicted);
+  }
+
+  mSolverIterationsTotal += iterations;
+  ++mSteps;
+
+  mProfiler.setCounter("solverIterations",
+                       (double) mSolverIterationsTotal / mSteps);
+
+  if (mAdaptiveSolver) {
+    mProfiler.setCounter("densityErrorMax", mMaxDensityError);
+    mProfiler.setCounter("densityErrorAverage", mAverageDensityError);
+  }
+
+  this->runStage("updateVelocities", &CpuSimulation::updateVelocities);
+  this->runStage("applyVorticityAndViscosity",
+                 &CpuSimulation::applyVorticityAndViscosity);
+  this->runStage("updatePositions", &CpuSimulation::updatePositions);
+}
+
+void
+CpuSimulation::dumpData( cl_float4 * (&positions),
+                         cl_float4 * (&velocities) ) {
+  positions = &mPositions[0];
+  velocities = &mVelocities[0];
+}
+
+void
+CpuSimulation::createSnapshotBuffer(SnapshotBuffer &buffer) {
+  buffer.positions = new cl_float4[mNumParticles];
+  buffer.velocities = new cl_float4[mNumParticles];
+  buffer.hasEvent = false;
+}
+
+void
+CpuSimulation::releaseSnapshotBuffer(SnapshotBuffer &buffer) {
+  delete[] buffer.positions;
+  delete[] buffer.velocities;
+
+  buffer.positions = NULL;
+  buffer.velocities = NULL;
+}
+
+void
+CpuSimulation::enqueueSnapshot(SnapshotBuffer &buffer) {
+  // A plain copy, complete on return
+  std::copy(mPositions.begin(), mPositions.end(), buffer.positions);
+  std::copy(mVelocities.begin(), mVelocities.end(), buffer.velocities);
+  buffer.hasEvent = false;
+}
+
+void
+CpuSimulation::enqueueStatistics(StatisticsBlock &block) {
+  // Serial like computeDensityError, complete on return
+  cl_float *values = block.values;
+
+  std::fill(values, values + _STAT_VALUES, 0.0f);
+  std::fill(block.histogram, block.histogram + _STAT_BINS, 0);
+
+  for (int d = 0; d < 3; ++d) {
+    values[_STAT_BOX_MIN + d] = FLT_MAX;
+    values[_STAT_BOX_MAX + d] = -FLT_MAX;
+  }
+
+  for (cl_uint i = 0; i < mNumParticles; ++i) {
+    const cl_float4 &x = mPositions[i];
+    const cl_float4 &v = mVelocities[i];
+    const cl_float m = v.s[3];
+    const cl_float speed2 = v.s[0] * v.s[0] + v.s[1] * v.s[1]
+                            + v.s[2] * v.s[2];
+    const cl_float ratio = mPredicted[i].s[3] / mRestDensity;
+    const cl_float error = std::max(ratio - 1.0f, 0.0f);
+
+    values[_STAT_MASS] += m;
+    values[_STAT_KINETIC_ENERGY] += 0.5f * m * speed2;
+    values[_STAT_MAX_SPEED2] = std::max(values[_STAT_MAX_SPEED2], speed2);
+    values[_STAT_DENSITY_ERROR_SUM] += error;
+    values[_STAT_DENSITY_ERROR_MAX] = std::max(values[_STAT_DENSITY_ERROR_MAX],
+                                      error);
+
+    for (int d = 0; d < 3; ++d) {
+      values[_STAT_MASS_POSITION + d] += m * x.s[d];
+      values[_STAT_BOX_MIN + d] = std::min(values[_STAT_BOX_MIN + d], x.s[d]);
+      values[_STAT_BOX_MAX + d] = std::max(values[_STAT_BOX_MAX + d], x.s[d]);
+    }
+
+    ++block.histogram[densityBin(ratio)];
+  }
+
+  block.hasEvent = false;
+}
+
+CheckpointHeader
+CpuSimulation::checkpointHeader(void) const {
+  CheckpointHeader header = Checkpoint::emptyHeader();
+
+  header.count = mNumParticles;
+  header.waveGenerator = mWaveGenerator;
+  header.timeStepLength = mTimestepLength;
+  header.restDensity = mRestDensity;
+  header.sizeMin = mSystemSizeMin;
+  header.sizeMax = mSystemSizeMax;
+  header.cellLength = mCellLength;
+  header.numberCells = mNumberCells;
+
+  return header;
+}
+
+void
+CpuSimulation::saveCheckpoint(const string &filename, const RunState &state) {
+  CheckpointHeader header = this->checkpointHeader();
+  header.time = state.time;
+  header.steps = state.steps;
+  header.wavePhase = state.wavePhase;
+  header.generateWaves = state.generateWaves;
+
+  Checkpoint::write(filename, header, &mPositions[0], &mVelocities[0]);
+}
+
+void
+CpuSimulation::loadCheckpoint(const string &filename, RunState &state) {
+  CheckpointHeader header;
+  Checkpoint::read(filename, this->checkpointHeader(), header,
+                   &mPositions[0], &mVelocities[0]);
+
+  mWaveGenerator = header.waveGenerator;
+
+  state.time = header.time;
+  state.steps = header.steps;
+  state.wavePhase = header.wavePhase;
+  state.generateWaves = header.generateWaves != 0;
+}
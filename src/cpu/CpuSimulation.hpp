@@ -0,0 +1,170 @@
+#ifndef __CPU_SIMULATION_HPP
+#define __CPU_SIMULATION_HPP
+
+#include <vector>
+#include <atomic>
+
+#include "../hesp.hpp"
+#include "../Parameters.hpp"
+#include "../Particle.hpp"
+#include "../Solver.hpp"
+#include "../KernelProfiler.hpp"
+#include "../io/Checkpoint.hpp"
+#include "ThreadPool.hpp"
+
+using std::vector;
+
+
+/**
+ *  \brief  Native multithreaded simulation backend.
+ *
+ *  Runs the same per-particle stages as the OpenCL kernels in
+ *  src/kernels, one parallel loop per kernel launch. Useful on nodes
+ *  without an OpenCL runtime and as a reference that can be profiled
+ *  with regular CPU tools.
+ */
+class CpuSimulation : public Solver {
+private:
+  // Avoid copy
+  CpuSimulation &operator=(const CpuSimulation &other);
+  CpuSimulation (const CpuSimulation &other);
+
+public:
+  explicit CpuSimulation(const ConfigParameters &parameters,
+                         const ParticleView &particles,
+                         const unsigned int numThreads = 0,
+                         const ThreadPool::Schedule schedule = ThreadPool::STATIC);
+
+  ~CpuSimulation ();
+
+  void init(void);
+  void initCells(void);
+  void step(void);
+
+  // Steps run synchronously on the host
+  void finishStep(void) {}
+
+  // Copy current positions and velocities
+  void dumpData( cl_float4 * (&positions),
+                 cl_float4 * (&velocities) );
+
+  void createSnapshotBuffer(SnapshotBuffer &buffer);
+  void releaseSnapshotBuffer(SnapshotBuffer &buffer);
+  void enqueueSnapshot(SnapshotBuffer &buffer);
+
+  void enqueueStatistics(StatisticsBlock &block);
+
+  void saveCheckpoint(const string &filename, const RunState &state);
+  void loadCheckpoint(const string &filename, RunState &state);
+
+  cl_uint getNumberParticles() const {
+    return mNumParticles;
+  }
+
+  const cl_float4
+  getSizesMin(void) const {
+    return mSystemSizeMin;
+  }
+
+  const cl_float4
+  getSizesMax(void) const {
+    return mSystemSizeMax;
+  }
+
+  void
+  setWaveGenerator(const double value) {
+    mWaveGenerator = value;
+  }
+
+  void
+  setProfiling(const bool enabled) {
+    mProfiler.setEnabled(enabled);
+  }
+
+  const KernelProfiler &
+  getProfiler(void) const {
+    return mProfiler;
+  }
+
+  void
+  clearProfile(void) {
+    mProfiler.clearSamples();
+  }
+
+private:
+  // Sizes of domain
+  cl_float4 mSystemSizeMin;
+  cl_float4 mSystemSizeMax;
+
+  // Number of cells in each direction and lengths of each cell
+  cl_int4 mNumberCells;
+  cl_float4 mCellLength;
+  cl_uint mCellCount;
+  // Cells are indexed by Morton key like the kernels with USE_MORTON
+  bool mMortonCells;
+
+  // Constants the OpenCL kernels get as build options
+  cl_float mTimestepLength;
+  cl_float mRestDensity;
+  cl_float mH;
+  cl_float mH2;
+  cl_float mPoly6Factor;
+  cl_float mGradSpikyFactor;
+
+  const cl_uint mNumParticles;
+
+  // View of the initial particles to setup data arrays
+  const ParticleView mParticles;
+
+  ThreadPool mPool;
+
+  // Simulation data, laid out like the OpenCL buffers
+  vector<cl_float4> mPositions;
+  vector<cl_float4> mPredicted;
+  vector<cl_float4> mVelocities;
+  vector<cl_float4> mDelta;
+  vector<cl_float4> mDeltaVelocities;
+  vector<cl_float> mScalingFactors;
+
+  // Linked cell lists, heads are exchanged atomically like in update_cells.cl
+  std::atomic<cl_int> *mCells;
+  vector<cl_int> mParticlesList;
+
+  // For generating waves
+  cl_float mWaveGenerator;
+
+  // Solver iterations, see Simulation
+  const cl_uint mSolverIterations;
+  const bool mAdaptiveSolver;
+  const cl_uint mSolverMinIterations;
+  const cl_uint mSolverMaxIterations;
+  const cl_float mSolverTolerance;
+  cl_ulong mSolverIterationsTotal;
+  cl_ulong mSteps;
+  cl_float mMaxDensityError;
+  cl_float mAverageDensityError;
+
+  // Wall time per stage
+  KernelProfiler mProfiler;
+
+  // Per-stage loops, each mirrors the kernel of the same name
+  void predictPositions(void);
+  void updateCells(void);
+  void computeScaling(void);
+  void computeDelta(void);
+  void updatePredicted(void);
+  void updateVelocities(void);
+  void applyVorticityAndViscosity(void);
+  void updatePositions(void);
+  void computeDensityError(void);
+
+  // Runs one stage, timed if profiling is enabled
+  void runStage(const char *name, void (CpuSimulation::*stage)(void));
+
+  void cellOf(const cl_float4 &position, int cell[3]) const;
+  cl_uint cellIndex(const int cell[3]) const;
+
+  CheckpointHeader checkpointHeader(void) const;
+};
+
+#endif // __CPU_SIMULATION_HPP
@@ -0,0 +1,143 @@
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+
+using std::min;
+using std::max;
+using std::thread;
+using std::mutex;
+using std::unique_lock;
+
+
+ThreadPool::ThreadPool(unsigned int numThreads,
+                       Schedule schedule,
+                       size_t chunkSize)
+  : mNumThreads(numThreads),
+    mSchedule(schedule),
+    mChunkSize(chunkSize),
+    mBody(NULL),
+    mRangeSize(0),
+    mJobChunk(1),
+    mNextIndex(0),
+    mGeneration(0),
+    mBusyWorkers(0),
+    mShutdown(false) {
+
+  if (mNumThreads == 0) {
+    mNumThreads = max(1u, thread::hardware_concurrency());
+  }
+
+  // The calling thread is worker 0
+  for (unsigned int t = 1; t < mNumThreads; ++t) {
+    mWorkers.push_back( thread(&ThreadPool::workerLoop, this, t) );
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    unique_lock<mutex> lock(mMutex);
+    mShutdown = true;
+  }
+
+  mStartCondition.notify_all();
+
+  for (size_t t = 0; t < mWorkers.size(); ++t) {
+    mWorkers[t].join();
+  }
+}
+
+void
+ThreadPool::parallelFor(size_t n, const RangeFunction &body) {
+  if (n == 0) {
+    return;
+  }
+
+  if (mNumThreads == 1) {
+    body(0, n);
+    return;
+  }
+
+  {
+    unique_lock<mutex> lock(mMutex);
+    mBody = &body;
+    mRangeSize = n;
+    mNextIndex = 0;
+
+    if (mChunkSize > 0) {
+      mJobChunk = mChunkSize;
+    } else {
+      // A few chunks per thread keeps the balance without much contention
+      mJobChunk = max<size_t>(64, n / (mNumThreads * 8));
+    }
+
+    mBusyWorkers = mNumThreads - 1;
+    ++mGeneration;
+  }
+
+  mStartCondition.notify_all();
+
+  runShare(0);
+
+  unique_lock<mutex> lock(mMutex);
+
+  while (mBusyWorkers > 0) {
+    mDoneCondition.wait(lock);
+  }
+
+  mBody = NULL;
+}
+
+void
+ThreadPool::runShare(unsigned int threadID) {
+  const RangeFunction &body = *mBody;
+
+  if (mSchedule == STATIC) {
+    const size_t block = (mRangeSize + mNumThreads - 1) / mNumThreads;
+    const size_t begin = min(mRangeSize, threadID * block);
+    const size_t end = min(mRangeSize, begin + block);
+
+    if (begin < end) {
+      body(begin, end);
+    }
+  } else {
+    for (;;) {
+      const size_t begin = mNextIndex.fetch_add(mJobChunk);
+
+      if (begin >= mRangeSize) {
+        break;
+      }
+
+      body( begin, min(mRangeSize, begin + mJobChunk) );
+    }
+  }
+}
+
+void
+ThreadPool::workerLoop(unsigned int threadID) {
+  unsigned long seenGeneration = 0;
+
+  for (;;) {
+    {
+      unique_lock<mutex> lock(mMutex);
+
+      while (!mShutdown && mGeneration == seenGeneration) {
+        mStartCondition.wait(lock);
+      }
+
+      if (mShutdown) {
+        return;
+      }
+
+      seenGeneration = mGeneration;
+    }
+
+    runShare(threadID);
+
+    {
+      unique_lock<mutex> lock(mMutex);
+      --mBusyWorkers;
+    }
+
+    mDoneCondition.notify_one();
+  }
+}
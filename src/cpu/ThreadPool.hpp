@@ -0,0 +1,81 @@
+#ifndef __THREAD_POOL_HPP
+#define __THREAD_POOL_HPP
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <cstddef>
+
+
+/**
+ *  \brief  Persistent worker threads running data-parallel loops.
+ *
+ *  parallelFor splits [0, n) into ranges that are handed to the body.
+ *  STATIC gives every thread one contiguous block, DYNAMIC lets threads
+ *  grab chunks of chunkSize from a shared counter until the range is done.
+ *  The calling thread takes part in the work.
+ */
+class ThreadPool {
+private:
+  // Avoid copy
+  ThreadPool &operator=(const ThreadPool &other);
+  ThreadPool (const ThreadPool &other);
+
+public:
+  enum Schedule {
+    STATIC,
+    DYNAMIC
+  };
+
+  typedef std::function<void (size_t begin, size_t end)> RangeFunction;
+
+  /**
+   *  \brief  Starts numThreads - 1 workers (0 = hardware concurrency).
+   *
+   *  A chunkSize of 0 picks a size from the range length.
+   */
+  explicit ThreadPool(unsigned int numThreads = 0,
+                      Schedule schedule = STATIC,
+                      size_t chunkSize = 0);
+
+  ~ThreadPool();
+
+  void parallelFor(size_t n, const RangeFunction &body);
+
+  unsigned int getNumberThreads() const {
+    return mNumThreads;
+  }
+
+  Schedule getSchedule() const {
+    return mSchedule;
+  }
+
+private:
+  void workerLoop(unsigned int threadID);
+  void runShare(unsigned int threadID);
+
+  unsigned int mNumThreads;
+  const Schedule mSchedule;
+  const size_t mChunkSize;
+
+  std::vector<std::thread> mWorkers;
+
+  std::mutex mMutex;
+  std::condition_variable mStartCondition;
+  std::condition_variable mDoneCondition;
+
+  // Current job, valid while a parallelFor is running
+  const RangeFunction *mBody;
+  size_t mRangeSize;
+  size_t mJobChunk;
+  std::atomic<size_t> mNextIndex;
+
+  unsigned long mGeneration;
+  unsigned int mBusyWorkers;
+  bool mShutdown;
+};
+
+#endif // __THREAD_POOL_HPP
@@ -27,6 +27,80 @@
 
 #endif
 
+// Particle buffers hold a float4 per particle, or with USE_SOA one plane
+// of PARTICLE_STRIDE floats per component: x, y, z, then w
+#if defined(USE_SOA)
+typedef float particle_t;
+
+#define LOAD3(b, i) ( (float3)( (b)[(i)], \
+                                (b)[(i) + PARTICLE_STRIDE], \
+                                (b)[(i) + 2 * PARTICLE_STRIDE] ) )
+#define LOAD_W(b, i) ( (b)[(i) + 3 * PARTICLE_STRIDE] )
+#define LOAD4(b, i) ( (float4)(LOAD3(b, i), LOAD_W(b, i)) )
+#define STORE3(b, i, v) do { const float3 _v = (v); \
+                             (b)[(i)] = _v.x; \
+                             (b)[(i) + PARTICLE_STRIDE] = _v.y; \
+                             (b)[(i) + 2 * PARTICLE_STRIDE] = _v.z; } while (0)
+#define STORE_W(b, i, v) ( (b)[(i) + 3 * PARTICLE_STRIDE] = (v) )
+#define STORE4(b, i, v) do { const float4 _w = (v); \
+                             STORE3(b, i, _w.xyz); \
+                             STORE_W(b, i, _w.w); } while (0)
+#else
+typedef float4 particle_t;
+
+#define LOAD3(b, i) ( (b)[(i)].xyz )
+#define LOAD_W(b, i) ( (b)[(i)].w )
+#define LOAD4(b, i) ( (b)[(i)] )
+#define STORE3(b, i, v) ( (b)[(i)].xyz = (v) )
+#define STORE_W(b, i, v) ( (b)[(i)].w = (v) )
+#define STORE4(b, i, v) ( (b)[(i)] = (v) )
+#endif // USE_SOA
+
+// Index of a cell in the cell arrays and the key it is sorted by
+#if defined(USE_HASHED_CELLS)
+#define CELL_INDEX(x, y, z) hashCell((x), (y), (z))
+#elif defined(USE_MORTON)
+#define CELL_INDEX(x, y, z) mortonKey((x), (y), (z))
+#else
+#define CELL_INDEX(x, y, z) ( (x) + (y) * (int) NUMBER_OF_CELLS_X \
+                              + (z) * (int) NUMBER_OF_CELLS_X \
+                              * (int) NUMBER_OF_CELLS_Y )
+#endif // USE_HASHED_CELLS
+
+// Cell of a position, clamped to the grid as particles can leave the
+// domain before the constraints push them back
+int3 gridCell(const float3 position) {
+  return clamp( convert_int3( (position - (float3)(SYSTEM_MIN_X,
+                                                   SYSTEM_MIN_Y,
+                                                   SYSTEM_MIN_Z))
+                              / (float3)(CELL_LENGTH_X, CELL_LENGTH_Y,
+                                         CELL_LENGTH_Z) ),
+                (int3) 0,
+                (int3)( (int) NUMBER_OF_CELLS_X - 1,
+                        (int) NUMBER_OF_CELLS_Y - 1,
+                        (int) NUMBER_OF_CELLS_Z - 1 ) );
+}
+
+#if defined(USE_HASHED_CELLS)
+// Spatial hash of Teschner et al., HASH_TABLE_SIZE is a power of two
+uint hashCell(const int x, const int y, const int z) {
+  return ( ( (uint) x * 73856093u ) ^ ( (uint) y * 19349663u )
+           ^ ( (uint) z * 83492791u ) ) & (HASH_TABLE_SIZE - 1u);
+}
+
+// Several cells share a slot of the table, so the particles of a slot are
+// checked against the cell visited
+bool inCell(const float3 position, const int *cell) {
+  const int3 own = gridCell(position);
+
+  return own.x == cell[0] && own.y == cell[1] && own.z == cell[2];
+}
+
+#define IN_CELL(position, cell) inCell((position), (cell))
+#else
+#define IN_CELL(position, cell) true
+#endif // USE_HASHED_CELLS
+
 #else
 
 #define CL_USE_DEPRECATED_OPENCL_1_1_APIS
@@ -46,4 +120,67 @@
 
 #endif // __OPENCL_VERSION__
 
+// Functions used by the kernels and the host, OpenCL 1.1 has no static
+#if defined(__OPENCL_VERSION__)
+#define _SHARED_INLINE
+#else
+#define _SHARED_INLINE static inline
+#endif // __OPENCL_VERSION__
+
+// Bits of each cell coordinate in a Morton key
+#define _MORTON_AXIS_BITS 10
+
+// Moves the low bits of v two bits apart
+_SHARED_INLINE unsigned int mortonSpread(unsigned int v) {
+  v &= 0x3ff;
+  v = (v | (v << 16)) & 0x030000ff;
+  v = (v | (v << 8)) & 0x0300f00f;
+  v = (v | (v << 4)) & 0x030c30c3;
+  v = (v | (v << 2)) & 0x09249249;
+
+  return v;
+}
+
+// Inverse of mortonSpread
+_SHARED_INLINE unsigned int mortonCompact(unsigned int v) {
+  v &= 0x09249249;
+  v = (v | (v >> 2)) & 0x030c30c3;
+  v = (v | (v >> 4)) & 0x0300f00f;
+  v = (v | (v >> 8)) & 0x030000ff;
+  v = (v | (v >> 16)) & 0x3ff;
+
+  return v;
+}
+
+// Z-order key of a cell, the coordinate bits interleaved with x lowest.
+// Neighbouring cells get close keys, unlike x + y * NX + z * NX * NY.
+_SHARED_INLINE unsigned int mortonKey(const unsigned int x,
+                                      const unsigned int y,
+                                      const unsigned int z) {
+  return mortonSpread(x) | (mortonSpread(y) << 1) | (mortonSpread(z) << 2);
+}
+
+// Statistics block of statistics.cl, sums, minima and maxima at these
+// offsets. Positions are summed weighted by mass, box corners take three.
+#define _STAT_MASS 0
+#define _STAT_KINETIC_ENERGY 1
+#define _STAT_MAX_SPEED2 2
+#define _STAT_DENSITY_ERROR_SUM 3
+#define _STAT_DENSITY_ERROR_MAX 4
+#define _STAT_MASS_POSITION 5
+#define _STAT_BOX_MIN 8
+#define _STAT_BOX_MAX 11
+#define _STAT_VALUES 14
+
+// Bins of the density histogram over rho / rho_0 in [0, 2), the last bin
+// also counts anything denser
+#define _STAT_BINS 16
+
+// Histogram bin of a density ratio rho / rho_0
+_SHARED_INLINE unsigned int densityBin(float ratio) {
+  ratio = ratio > 0.0f ? ratio * (_STAT_BINS / 2.0f) : 0.0f;
+
+  return ratio < _STAT_BINS - 1 ? (unsigned int) ratio : _STAT_BINS - 1;
+}
+
 #endif // __HESP_HPP
@@ -0,0 +1,39 @@
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <stdexcept>
+
+#include "io/PartReader.hpp"
+#include "io/PbfFile.hpp"
+
+using std::vector;
+using std::string;
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::exception;
+
+
+// Converts a text particle file (.in) into the binary format (.pbf)
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    cerr << "Usage: " << argv[0] << " input.in output.pbf" << endl;
+    return EXIT_FAILURE;
+  }
+
+  try {
+    PartReader partReader;
+    vector<Particle> particles = partReader.read(argv[1]);
+
+    PbfFile::write( argv[2], ParticleView(particles) );
+
+    cout << "Wrote " << particles.size() << " particles to "
+         << argv[2] << endl;
+  } catch (const exception &e) {
+    cerr << "STD Error caught: " << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
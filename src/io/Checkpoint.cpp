@@ -0,0 +1,180 @@
+#include "Checkpoint.hpp"
+
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+using std::string;
+using std::runtime_error;
+
+
+static const char CHECKPOINT_MAGIC[4] = { 'P', 'B', 'F', 'C' };
+
+
+// Writes all of data, retrying on short writes
+static bool writeAll(int fd, const void *data, size_t size) {
+  const char *bytes = (const char *) data;
+
+  while (size > 0) {
+    const ssize_t written = ::write(fd, bytes, size);
+
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return false;
+    }
+
+    bytes += written;
+    size -= written;
+  }
+
+  return true;
+}
+
+static bool readAll(int fd, void *data, size_t size) {
+  char *bytes = (char *) data;
+
+  while (size > 0) {
+    const ssize_t got = ::read(fd, bytes, size);
+
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (got <= 0) {
+      return false;
+    }
+
+    bytes += got;
+    size -= got;
+  }
+
+  return true;
+}
+
+CheckpointHeader
+Checkpoint::emptyHeader(void) {
+  CheckpointHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+  header.version = CHECKPOINT_VERSION;
+
+  return header;
+}
+
+void
+Checkpoint::write(const string &filename,
+                  const CheckpointHeader &header,
+                  const cl_float4 *positions,
+                  const cl_float4 *velocities,
+                  const vector<char> &solverState) {
+  const string tmpFilename = filename + ".tmp";
+  const size_t arraySize = header.count * sizeof(cl_float4);
+
+  int fd = ::open(tmpFilename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  if (fd < 0) {
+    throw runtime_error("Could not create checkpoint " + tmpFilename);
+  }
+
+  const bool ok = writeAll(fd, &header, sizeof(header))
+                  && writeAll(fd, positions, arraySize)
+                  && writeAll(fd, velocities, arraySize)
+                  && (solverState.empty()
+                      || writeAll(fd, &solverState[0], solverState.size()))
+                  // Data has to be on disk before the rename replaces
+                  // the previous checkpoint
+                  && fsync(fd) == 0;
+
+  if (::close(fd) != 0 || !ok) {
+    unlink( tmpFilename.c_str() );
+    throw runtime_error("Could not write checkpoint " + tmpFilename);
+  }
+
+  if (rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+    unlink( tmpFilename.c_str() );
+    throw runtime_error("Could not rename checkpoint to " + filename);
+  }
+}
+
+void
+Checkpoint::read(const string &filename,
+                 const CheckpointHeader &expected,
+                 CheckpointHeader &header,
+                 cl_float4 *positions,
+                 cl_float4 *velocities,
+                 vector<char> *solverState) {
+  int fd = ::open(filename.c_str(), O_RDONLY);
+
+  if (fd < 0) {
+    throw runtime_error("Could not open checkpoint " + filename);
+  }
+
+  if ( !readAll(fd, &header, sizeof(header)) ) {
+    ::close(fd);
+    throw runtime_error("Checkpoint too small for a header!");
+  }
+
+  if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0) {
+    ::close(fd);
+    throw runtime_error("Not a checkpoint file!");
+  }
+
+  if (header.version != CHECKPOINT_VERSION) {
+    ::close(fd);
+    throw runtime_error("Unsupported checkpoint version!");
+  }
+
+  if (header.count != expected.count) {
+    ::close(fd);
+    throw runtime_error("Checkpoint has a different number of particles!");
+  }
+
+  // Restarting with other constants would not continue the same run
+  const bool sameConfiguration =
+    header.timeStepLength == expected.timeStepLength
+    && header.restDensity == expected.restDensity
+    && memcmp(&header.sizeMin, &expected.sizeMin, sizeof(cl_float4)) == 0
+    && memcmp(&header.sizeMax, &expected.sizeMax, sizeof(cl_float4)) == 0
+    && memcmp(&header.cellLength, &expected.cellLength, sizeof(cl_float4)) == 0
+    && memcmp(&header.numberCells, &expected.numberCells, sizeof(cl_int4)) == 0;
+
+  if (!sameConfiguration) {
+    ::close(fd);
+    throw runtime_error("Checkpoint was written with different parameters!");
+  }
+
+  const size_t arraySize = header.count * sizeof(cl_float4);
+
+  bool ok = readAll(fd, positions, arraySize)
+             && readAll(fd, velocities, arraySize);
+
+  // Whatever follows the particles is the solver state
+  struct stat st;
+
+  if (ok && solverState != NULL) {
+    const off_t stateOffset = sizeof(header) + 2 * arraySize;
+
+    ok = fstat(fd, &st) == 0 && st.st_size >= stateOffset;
+
+    if (ok) {
+      solverState->resize(st.st_size - stateOffset);
+      ok = solverState->empty()
+           || readAll(fd, &(*solverState)[0], solverState->size());
+    }
+  }
+
+  ::close(fd);
+
+  if (!ok) {
+    throw runtime_error("Checkpoint is truncated!");
+  }
+}
@@ -0,0 +1,88 @@
+#ifndef __CHECKPOINT_HPP
+#define __CHECKPOINT_HPP
+
+#include <string>
+#include <vector>
+
+#include "../hesp.hpp"
+
+
+using std::string;
+using std::vector;
+
+
+static const cl_uint CHECKPOINT_VERSION = 1;
+
+// Bits of CheckpointHeader::solverState, what the trailing solver state
+// holds. Files without it restart from the original particle order.
+static const cl_uint CHECKPOINT_PARTICLE_ORDER = 1 << 0;
+static const cl_uint CHECKPOINT_NEIGHBOUR_LISTS = 1 << 1;
+static const cl_uint CHECKPOINT_SOA_LAYOUT = 1 << 2;
+
+/**
+ *  \brief  Header of a checkpoint file.
+ *
+ *  Followed by count positions and count velocities as cl_float4, the
+ *  fourth components included, and the solver state described by
+ *  solverState. All values are in the byte order of the writing machine.
+ */
+struct CheckpointHeader {
+  char magic[4]; /**< "PBFC" */
+  cl_uint version; /**< CHECKPOINT_VERSION */
+  cl_ulong count; /**< Number of particles */
+
+  // Runner state
+  cl_float time;
+  cl_uint steps;
+  cl_float wavePhase;
+  cl_uint generateWaves;
+
+  // Solver state besides the particles
+  cl_float waveGenerator;
+
+  // Configuration a restart has to match
+  cl_float timeStepLength;
+  cl_float restDensity;
+  cl_uint solverState; /**< CHECKPOINT_* bits, 0 in older files */
+  cl_float4 sizeMin;
+  cl_float4 sizeMax;
+  cl_float4 cellLength;
+  cl_int4 numberCells;
+};
+
+
+/**
+ *  \brief  Reads and writes checkpoint files.
+ */
+class Checkpoint {
+public:
+  /**
+   *  \brief  Writes to filename.tmp and renames it, so that an interrupted
+   *          write never destroys the previous checkpoint.
+   */
+  static void write(const string &filename,
+                    const CheckpointHeader &header,
+                    const cl_float4 *positions,
+                    const cl_float4 *velocities,
+                    const vector<char> &solverState = vector<char>());
+
+  /**
+   *  \brief  Reads a checkpoint that has to match the configuration given
+   *          in expected, positions and velocities need expected.count
+   *          elements. The rest of the file goes to solverState unless
+   *          it is NULL.
+   */
+  static void read(const string &filename,
+                   const CheckpointHeader &expected,
+                   CheckpointHeader &header,
+                   cl_float4 *positions,
+                   cl_float4 *velocities,
+                   vector<char> *solverState = NULL);
+
+  /**
+   *  \brief  Header with magic and version set and everything else zero.
+   */
+  static CheckpointHeader emptyHeader(void);
+};
+
+#endif // __CHECKPOINT_HPP
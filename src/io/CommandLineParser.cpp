@@ -0,0 +1,257 @@
+#include "CommandLineParser.hpp"
+
+#include <sstream>
+#include <stdexcept>
+#include <cstdlib>
+#include <limits>
+
+#include "ConfigReader.hpp"
+
+
+using std::istringstream;
+using std::runtime_error;
+using std::endl;
+
+
+// Value of "--name=value" if arg starts with prefix "--name="
+static bool
+matchValue(const string &arg, const string &prefix, string &value) {
+  if (arg.compare(0, prefix.size(), prefix) != 0) {
+    return false;
+  }
+
+  value = arg.substr( prefix.size() );
+
+  return true;
+}
+
+template<typename T>
+static T
+parseNumber(const string &name, const string &value) {
+  istringstream iss(value);
+  T number;
+
+  // Streams wrap negative values into unsigned types instead of failing
+  const bool negative = !std::numeric_limits<T>::is_signed
+                        && value.find('-') != string::npos;
+
+  if ( negative || !(iss >> number) || !iss.eof() ) {
+    throw runtime_error("Invalid value for " + name + ": " + value);
+  }
+
+  return number;
+}
+
+CommandLineOptions
+CommandLineParser::parse(const int argc, char **argv) const {
+  CommandLineOptions options;
+  bool scenarioGiven = false;
+
+  for (int i = 1; i < argc; ++i) {
+    const string arg(argv[i]);
+    string value;
+
+    if ( arg == "--help" || arg == "-h" ) {
+      options.help = true;
+    } else if ( arg == "--headless" ) {
+      options.headless = true;
+    } else if ( arg == "--profile" ) {
+      options.profile = true;
+    } else if ( arg == "--cpu" ) {
+      options.useCpuBackend = true;
+    } else if ( arg == "--list-devices" ) {
+      options.listDevices = true;
+    } else if ( matchValue(arg, "--scenario=", value) ) {
+      options.scenario = value;
+    } else if ( matchValue(arg, "--platform=", value) ) {
+      options.platform = value;
+    } else if ( matchValue(arg, "--device=", value) ) {
+      options.device = value;
+    } else if ( matchValue(arg, "--device-type=", value) ) {
+      if (value != "gpu" && value != "cpu" && value != "accelerator"
+          && value != "all") {
+        throw runtime_error("Unknown device type: " + value);
+      }
+
+      options.deviceType = value;
+    } else if ( matchValue(arg, "--steps=", value) ) {
+      options.maxSteps = parseNumber<cl_uint>("--steps", value);
+    } else if ( matchValue(arg, "--time=", value) ) {
+      options.timeEnd = parseNumber<cl_float>("--time", value);
+    } else if ( matchValue(arg, "--statistics=", value) ) {
+      options.statisticsFreq = parseNumber<cl_uint>("--statistics", value);
+    } else if ( matchValue(arg, "--output-dir=", value) ) {
+      options.outputDirectory = value;
+    } else if ( matchValue(arg, "--threads=", value) ) {
+      options.numThreads = parseNumber<unsigned int>("--threads", value);
+    } else if ( matchValue(arg, "--restart=", value) ) {
+      options.restartFile = value;
+    } else if ( matchValue(arg, "--kernel-cache=", value) ) {
+      options.kernelCache = value;
+    } else if ( arg == "--no-kernel-cache" ) {
+      options.kernelCache.clear();
+    } else if ( matchValue(arg, "--tuning-dir=", value) ) {
+      options.tuningDir = value;
+      options.tuningDirGiven = true;
+    } else if ( arg == "--autotune" ) {
+      options.autotune = true;
+    } else if ( arg == "--neighbour-lists" ) {
+      options.neighbourLists = true;
+    } else if ( arg == "--soa" ) {
+      options.structOfArrays = true;
+    } else if ( arg == "--morton" ) {
+      options.mortonCells = true;
+    } else if ( arg == "--hashed-cells" ) {
+      options.hashedCells = true;
+    } else if ( arg == "--tiled-solver" ) {
+      options.tiledSolver = true;
+    } else if ( arg == "--fused-update" ) {
+      options.fusedUpdate = true;
+    } else if ( arg == "--reorder" ) {
+      options.reorder = true;
+    } else if ( matchValue(arg, "--neighbour-search=", value) ) {
+      options.neighbourSearch = value;
+    } else if ( arg == "--schedule=static" ) {
+      options.schedule = ThreadPool::STATIC;
+    } else if ( arg == "--schedule=dynamic" ) {
+      options.schedule = ThreadPool::DYNAMIC;
+    } else if (arg.compare(0, 1, "-") != 0 && !scenarioGiven) {
+      // A single positional argument names the scenario
+      options.scenario = arg;
+      scenarioGiven = true;
+    } else {
+      throw runtime_error("Unknown argument: " + arg
+                          + " (see --help)");
+    }
+  }
+
+  if (options.timeEnd == 0.0f || options.timeEnd < -1.0f) {
+    throw runtime_error("--time has to be positive");
+  }
+
+  return options;
+}
+
+void
+CommandLineParser::printUsage(ostream &os, const string &program) const {
+  os << "Usage: " << program << " [options] [scenario.par]" << endl
+     << endl
+     << "Scenarios without a path are looked up in data/scenarios, "
+     << "default dam_coarse.par." << endl
+     << endl
+     << "Run:" << endl
+     << "  --headless                 no window, any OpenCL device" << endl
+     << "  --cpu                      native backend, implies headless" << endl
+     << "  --steps=N                  stop after N steps" << endl
+     << "  --time=T                   stop at time T instead of time_end" << endl
+     << "  --output-dir=DIR           directory for part, vtk, checkpoint "
+     << "and profile output" << endl
+     << "  --restart=FILE             continue from a checkpoint" << endl
+     << "  --profile                  per-kernel timings in profile.json" << endl
+     << "  --statistics=N             energy, density error and bounds "
+     << "every N steps in statistics.csv" << endl
+     << endl
+     << "OpenCL:" << endl
+     << "  --list-devices             print platforms and devices and exit" << endl
+     << "  --platform=INDEX|NAME      platform by index or name substring" << endl
+     << "  --device=INDEX|NAME        device by index or name substring" << endl
+     << "  --device-type=TYPE         gpu, cpu, accelerator or all" << endl
+     << "  --kernel-cache=DIR         program binary cache, default "
+     << "kernel_cache" << endl
+     << "  --no-kernel-cache          always build from source" << endl
+     << "  --tuning-dir=DIR           tuned work-group sizes, default "
+     << "tuning, empty disables" << endl
+     << "  --autotune                 measure work-group sizes again and "
+     << "store them" << endl
+     << endl
+     << "Solver:" << endl
+     << "  --neighbour-search=NAME    linkedcell, radix or counting" << endl
+     << "  --reorder                  sort the particle data by cell" << endl
+     << "  --neighbour-lists          per particle neighbour lists" << endl
+     << "  --fused-update             fuse the position update into "
+     << "computeDelta" << endl
+     << "  --tiled-solver             stage neighbour cells in local memory"
+     << endl
+     << "  --soa                      particle buffers in planes" << endl
+     << "  --morton                   number cells along a Z-order curve"
+     << endl
+     << "  --hashed-cells             hash table of cells instead of a grid"
+     << endl
+     << "  --threads=N                threads of the native backend" << endl
+     << "  --schedule=static|dynamic  loop schedule of the native backend"
+     << endl;
+}
+
+void
+CommandLineParser::apply(const CommandLineOptions &options,
+                         ConfigParameters &parameters) const {
+  if ( !options.neighbourSearch.empty()
+       && !ConfigReader::parseNeighbourSearch(options.neighbourSearch,
+           parameters.neighbourSearch) ) {
+    throw runtime_error("Unknown neighbour search: "
+                        + options.neighbourSearch);
+  }
+
+  if (options.reorder) {
+    parameters.reorderParticles = true;
+  }
+
+  if (options.neighbourLists) {
+    parameters.neighbourLists = true;
+  }
+
+  if (options.fusedUpdate) {
+    parameters.fusedUpdate = true;
+  }
+
+  if (options.tiledSolver) {
+    parameters.tiledSolver = true;
+  }
+
+  if (options.structOfArrays) {
+    parameters.structOfArrays = true;
+  }
+
+  if (options.mortonCells) {
+    parameters.mortonCells = true;
+  }
+
+  if (options.hashedCells) {
+    parameters.hashedCells = true;
+  }
+
+  if (options.tuningDirGiven) {
+    parameters.tuningDir = options.tuningDir;
+  }
+
+  if (options.autotune) {
+    parameters.autotune = true;
+  }
+
+  if (options.timeEnd > 0.0f) {
+    parameters.timeEnd = options.timeEnd;
+  }
+
+  if (options.maxSteps > 0) {
+    parameters.maxSteps = options.maxSteps;
+  }
+
+  if (options.statisticsFreq > 0) {
+    parameters.statisticsOutFreq = options.statisticsFreq;
+  }
+
+  // Continue a previous run from its checkpoint
+  if ( !options.restartFile.empty() ) {
+    parameters.restartFile = options.restartFile;
+  }
+
+  if ( !options.outputDirectory.empty() ) {
+    const string prefix = options.outputDirectory + "/";
+
+    parameters.partOutNameBase = prefix + parameters.partOutNameBase;
+    parameters.vtkOutNameBase = prefix + parameters.vtkOutNameBase;
+    parameters.checkpointOutName = prefix + parameters.checkpointOutName;
+    parameters.profileOutName = prefix + parameters.profileOutName;
+    parameters.statisticsOutName = prefix + parameters.statisticsOutName;
+  }
+}
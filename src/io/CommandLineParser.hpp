@@ -0,0 +1,111 @@
+#ifndef __COMMAND_LINE_PARSER_HPP
+#define __COMMAND_LINE_PARSER_HPP
+
+#include <string>
+#include <ostream>
+
+#include "../hesp.hpp"
+#include "../Parameters.hpp"
+#include "../cpu/ThreadPool.hpp"
+
+
+using std::string;
+using std::ostream;
+
+
+/**
+ *  \brief  Options given on the command line, empty strings and zero
+ *          limits keep the defaults.
+ */
+struct CommandLineOptions {
+  string scenario;
+
+  // Without a display (e.g. on compute nodes) run headless, without an
+  // OpenCL runtime use the native backend
+  bool headless;
+  bool useCpuBackend;
+  bool profile;
+  bool listDevices;
+  bool help;
+
+  // Platform and device by index or name substring, device type
+  string platform;
+  string device;
+  string deviceType;
+
+  unsigned int numThreads;
+  ThreadPool::Schedule schedule;
+
+  string restartFile;
+  string outputDirectory;
+  // Built programs are reused across runs, empty disables the cache
+  string kernelCache;
+  // Tuned work-group sizes, empty disables the file
+  string tuningDir;
+  bool tuningDirGiven;
+  bool autotune;
+
+  // Run limits overriding the scenario
+  cl_uint maxSteps;
+  cl_float timeEnd;
+  // Steps between statistics rows, 0 keeps the scenario setting
+  cl_uint statisticsFreq;
+
+  string neighbourSearch;
+  bool reorder;
+  bool neighbourLists;
+  bool fusedUpdate;
+  bool tiledSolver;
+  bool structOfArrays;
+  bool mortonCells;
+  bool hashedCells;
+
+  CommandLineOptions ()
+    : scenario("dam_coarse.par"),
+      headless(false),
+      useCpuBackend(false),
+      profile(false),
+      listDevices(false),
+      help(false),
+      numThreads(0),
+      schedule(ThreadPool::STATIC),
+      kernelCache("kernel_cache"),
+      tuningDirGiven(false),
+      autotune(false),
+      maxSteps(0),
+      timeEnd(-1.0f),
+      statisticsFreq(0),
+      reorder(false),
+      neighbourLists(false),
+      fusedUpdate(false),
+      tiledSolver(false),
+      structOfArrays(false),
+      mortonCells(false),
+      hashedCells(false) {}
+};
+
+
+class CommandLineParser {
+private:
+  // Avoid copy
+  CommandLineParser &operator=(const CommandLineParser &other);
+  CommandLineParser (const CommandLineParser &other);
+
+public:
+  CommandLineParser () {}
+
+  /**
+   *  \brief  Throws on unknown arguments or malformed values.
+   */
+  CommandLineOptions parse(const int argc, char **argv) const;
+
+  void printUsage(ostream &os, const string &program) const;
+
+  /**
+   *  \brief  Overrides the scenario parameters with the options given.
+   */
+  void apply(const CommandLineOptions &options,
+             ConfigParameters &parameters) const;
+};
+
+#endif // __COMMAND_LINE_PARSER_HPP
@@ -5,6 +5,7 @@
 #include <sstream>
 #include <stdexcept>
 #include <cassert>
+#include <algorithm>
 
 
 using std::string;
@@ -16,6 +17,94 @@ using std::endl;
 using std::runtime_error;
 
 
+// Work-items of a tiled work-group, see Simulation.cpp
+static const unsigned int _TILE_ITEMS = 64;
+
+
+void ConfigReader::check(ConfigParameters &parameters) {
+  // A skin keeps the neighbour lists for several steps
+  if (parameters.neighbourSkin > 0.0f && !parameters.neighbourLists) {
+    cout << "Neighbour skin given, using neighbour lists." << endl;
+    parameters.neighbourLists = true;
+  }
+
+  // Sorting the particle data needs the cell order of a sort
+  if (parameters.reorderParticles
+      && parameters.neighbourSearch == NEIGHBOUR_SEARCH_LINKED_CELL) {
+    cerr << "Reordering particles needs the radix or counting neighbour "
+         << "search, leaving it off." << endl;
+    parameters.reorderParticles = false;
+  }
+
+  // The tiled kernels stage whole cells, so the data has to be sorted
+  if (parameters.tiledSolver
+      && (!parameters.reorderParticles || parameters.neighbourLists)) {
+    cerr << "The tiled solver needs reordered particles and no neighbour "
+         << "lists, leaving it off." << endl;
+    parameters.tiledSolver = false;
+  }
+
+  // The tiled kernels find the cell of a work-group from its slot
+  if (parameters.tiledSolver && parameters.hashedCells) {
+    cerr << "The tiled solver needs a cell grid, not hashed cells, "
+         << "leaving it off." << endl;
+    parameters.tiledSolver = false;
+  }
+
+  // Morton keys interleave _MORTON_AXIS_BITS bits per axis, hashed cells
+  // do not use them
+  if ( parameters.mortonCells && !parameters.hashedCells
+       && std::max( std::max(parameters.xN, parameters.yN), parameters.zN )
+       > (1 << _MORTON_AXIS_BITS) ) {
+    throw runtime_error("Morton cell keys support at most 1024 cells per "
+                        "axis");
+  }
+
+  // The tiled kernels launch a work-group per cell slot, the range has to
+  // fit a 32 bit size_t. Empty slots, like the gaps of Morton keys, still
+  // cost a work-group each.
+  if ( parameters.tiledSolver
+       && cellSlots(parameters) > 0xffffffffu / _TILE_ITEMS ) {
+    cerr << "The tiled solver supports at most " << 0xffffffffu / _TILE_ITEMS
+         << " cell slots, leaving it off." << endl;
+    parameters.tiledSolver = false;
+  }
+
+  if (parameters.solverIterations == 0) {
+    throw runtime_error("solver_iterations has to be at least 1");
+  }
+
+  if (parameters.adaptiveSolver
+      && (parameters.solverMinIterations == 0
+          || parameters.solverMinIterations > parameters.solverMaxIterations)) {
+    throw runtime_error("Adaptive solver needs 1 <= solver_min_iterations "
+                        "<= solver_max_iterations");
+  }
+
+  if (parameters.substeps == 0) {
+    throw runtime_error("substeps has to be at least 1");
+  }
+
+  if (parameters.renderFps < 0.0f) {
+    throw runtime_error("render_fps must not be negative");
+  }
+}
+
+bool ConfigReader::parseNeighbourSearch(const string &value,
+                                        NeighbourSearch &search) {
+  if (value == "linkedcell") {
+    search = NEIGHBOUR_SEARCH_LINKED_CELL;
+  } else if (value == "radix") {
+    search = NEIGHBOUR_SEARCH_RADIX;
+  } else if (value == "counting") {
+    search = NEIGHBOUR_SEARCH_COUNTING;
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
 ConfigParameters ConfigReader::read(const string &filename) const {
   ConfigParameters parameters;
 
@@ -58,6 +147,10 @@ ConfigParameters ConfigReader::read(const string &filename) const {
           ss >> parameters.vtkOutNameBase;
         } else if ( parameter == "cl_workgroup_1dsize" ) {
           ss >> parameters.clWorkGroupSize1D;
+        } else if ( parameter == "tuning_dir" ) {
+          ss >> parameters.tuningDir;
+        } else if ( parameter == "autotune" ) {
+          ss >> parameters.autotune;
         } else if ( parameter == "x_min" ) {
           ss >> parameters.xMin;
         } else if ( parameter == "x_max" ) {
@@ -78,6 +171,60 @@ ConfigParameters ConfigReader::read(const string &filename) const {
           ss >> parameters.zN;
         } else if ( parameter == "restdensity" ) {
           ss >> parameters.restDensity;
+        } else if ( parameter == "checkpoint_out_freq" ) {
+          ss >> parameters.checkpointOutFreq;
+        } else if ( parameter == "checkpoint_out_name" ) {
+          ss >> parameters.checkpointOutName;
+        } else if ( parameter == "statistics_out_freq" ) {
+          ss >> parameters.statisticsOutFreq;
+        } else if ( parameter == "statistics_out_name" ) {
+          ss >> parameters.statisticsOutName;
+        } else if ( parameter == "restart_file" ) {
+          ss >> parameters.restartFile;
+        } else if ( parameter == "reorder_particles" ) {
+          ss >> parameters.reorderParticles;
+        } else if ( parameter == "neighbour_lists" ) {
+          ss >> parameters.neighbourLists;
+        } else if ( parameter == "max_neighbours" ) {
+          ss >> parameters.maxNeighbours;
+        } else if ( parameter == "fused_update" ) {
+          ss >> parameters.fusedUpdate;
+        } else if ( parameter == "soa_layout" ) {
+          ss >> parameters.structOfArrays;
+        } else if ( parameter == "tiled_solver" ) {
+          ss >> parameters.tiledSolver;
+        } else if ( parameter == "morton_cells" ) {
+          ss >> parameters.mortonCells;
+        } else if ( parameter == "hashed_cells" ) {
+          ss >> parameters.hashedCells;
+        } else if ( parameter == "hash_table_size" ) {
+          ss >> parameters.hashTableSize;
+        } else if ( parameter == "solver_iterations" ) {
+          ss >> parameters.solverIterations;
+        } else if ( parameter == "solver_adaptive" ) {
+          ss >> parameters.adaptiveSolver;
+        } else if ( parameter == "solver_min_iterations" ) {
+          ss >> parameters.solverMinIterations;
+        } else if ( parameter == "solver_max_iterations" ) {
+          ss >> parameters.solverMaxIterations;
+        } else if ( parameter == "solver_tolerance" ) {
+          ss >> parameters.solverTolerance;
+        } else if ( parameter == "substeps" ) {
+          ss >> parameters.substeps;
+        } else if ( parameter == "render_fps" ) {
+          ss >> parameters.renderFps;
+        } else if ( parameter == "max_steps" ) {
+          ss >> parameters.maxSteps;
+        } else if ( parameter == "neighbour_skin" ) {
+          ss >> parameters.neighbourSkin;
+        } else if ( parameter == "neighbour_search" ) {
+          string value;
+          ss >> value;
+
+          if ( !ConfigReader::parseNeighbourSearch(value, parameters.neighbourSearch) ) {
+            cerr << "Unknown neighbour search " << value << endl
+                 << "Using the linked cell lists." << endl;
+          }
         } else {
           cerr << "Unknown parameter " << parameter << endl
                << "Leaving it out." << endl;
@@ -21,6 +21,19 @@ public:
 
   ConfigParameters read(const string &filename) const;
 
+  /**
+   *  \brief  Turns off options whose requirements are not met and throws
+   *          on invalid values.
+   */
+  static void check(ConfigParameters &parameters);
+
+  /**
+   *  \brief  Parses "linkedcell", "radix" or "counting", returns false
+   *          otherwise.
+   */
+  static bool parseNeighbourSearch(const string &value,
+                                   NeighbourSearch &search);
+
 };
 
 #endif // __CONFIG_READER_HPP
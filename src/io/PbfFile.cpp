@@ -0,0 +1,200 @@
+#include "PbfFile.hpp"
+
+#include <fstream>
+#include <vector>
+#include <stdexcept>
+#include <cstring>
+#include <limits>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+using std::string;
+using std::vector;
+using std::ofstream;
+using std::runtime_error;
+
+
+static const char PBF_MAGIC[4] = { 'P', 'B', 'F', '\0' };
+
+// Arrays are padded to multiples of 16 floats (64 bytes)
+static const cl_ulong PBF_ALIGN_FLOATS = 16;
+
+
+PbfFile::PbfFile ()
+  : mData(NULL),
+    mSize(0),
+    mHeader(NULL) {
+}
+
+PbfFile::~PbfFile () {
+  this->close();
+}
+
+void
+PbfFile::open(const string &filename) {
+  this->close();
+
+  int fd = ::open(filename.c_str(), O_RDONLY);
+
+  if (fd < 0) {
+    throw runtime_error("Could not open particle file!");
+  }
+
+  struct stat st;
+
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(PbfHeader)) {
+    ::close(fd);
+    throw runtime_error("Particle file too small for a pbf header!");
+  }
+
+  int flags = MAP_PRIVATE;
+#if defined(MAP_POPULATE)
+  // Fault in all pages at once instead of one by one while uploading
+  flags |= MAP_POPULATE;
+#endif // MAP_POPULATE
+
+  void *data = mmap(NULL, st.st_size, PROT_READ, flags, fd, 0);
+  ::close(fd);
+
+  if (data == MAP_FAILED) {
+    throw runtime_error("Could not map particle file!");
+  }
+
+  mData = data;
+  mSize = st.st_size;
+  mHeader = (const PbfHeader *) mData;
+
+  madvise(mData, mSize, MADV_SEQUENTIAL);
+
+  if (memcmp(mHeader->magic, PBF_MAGIC, sizeof(PBF_MAGIC)) != 0) {
+    this->close();
+    throw runtime_error("Not a pbf particle file!");
+  }
+
+  if (mHeader->version != PBF_VERSION) {
+    this->close();
+    throw runtime_error("Unsupported pbf version!");
+  }
+
+  if ( !(mHeader->fieldMask & PBF_FIELD_POSITION_X)
+       || !(mHeader->fieldMask & PBF_FIELD_POSITION_Y)
+       || !(mHeader->fieldMask & PBF_FIELD_POSITION_Z) ) {
+    this->close();
+    throw runtime_error("pbf particle file has no positions!");
+  }
+
+  size_t numFields = 0;
+
+  for (int f = 0; f < PBF_NUMBER_FIELDS; ++f) {
+    if (mHeader->fieldMask & (1u << f)) {
+      ++numFields;
+    }
+  }
+
+  if (mHeader->headerSize < sizeof(PbfHeader)) {
+    this->close();
+    throw runtime_error("pbf header size is too small!");
+  }
+
+  // In 64 bits and checked for overflow, a corrupt stride must not wrap
+  // around the size check
+  const cl_ulong headerSize = mHeader->headerSize;
+  const cl_ulong fieldBytes = numFields * sizeof(cl_float);
+  const cl_ulong maxStride = (std::numeric_limits<cl_ulong>::max()
+                              - headerSize) / fieldBytes;
+
+  if (mHeader->stride < mHeader->count || mHeader->stride > maxStride
+      || mSize < headerSize + mHeader->stride * fieldBytes) {
+    this->close();
+    throw runtime_error("pbf particle file is truncated!");
+  }
+}
+
+void
+PbfFile::close(void) {
+  if (mData != NULL) {
+    munmap(mData, mSize);
+  }
+
+  mData = NULL;
+  mSize = 0;
+  mHeader = NULL;
+}
+
+ParticleView
+PbfFile::view(void) const {
+  if (mHeader == NULL) {
+    return ParticleView();
+  }
+
+  const cl_float *fields[PBF_NUMBER_FIELDS];
+  const cl_float *array = (const cl_float *) ( (const char *) mData
+                          + mHeader->headerSize );
+
+  for (int f = 0; f < PBF_NUMBER_FIELDS; ++f) {
+    if (mHeader->fieldMask & (1u << f)) {
+      fields[f] = array;
+      array += mHeader->stride;
+    } else {
+      fields[f] = NULL;
+    }
+  }
+
+  return ParticleView(mHeader->count, fields[0], &fields[1], &fields[4]);
+}
+
+void
+PbfFile::write(const string &filename, const ParticleView &particles) {
+  ofstream ofs(filename.c_str(), std::ios::binary);
+
+  if ( !ofs ) {
+    throw runtime_error("Could not open pbf file for writing!");
+  }
+
+  PbfHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, PBF_MAGIC, sizeof(PBF_MAGIC));
+  header.version = PBF_VERSION;
+  header.count = particles.size();
+  header.stride = (particles.size() + PBF_ALIGN_FLOATS - 1)
+                  / PBF_ALIGN_FLOATS * PBF_ALIGN_FLOATS;
+  header.fieldMask = (1u << PBF_NUMBER_FIELDS) - 1;
+  header.headerSize = sizeof(PbfHeader);
+
+  ofs.write( (const char *) &header, sizeof(header) );
+
+  vector<cl_float> array(header.stride, 0.0f);
+
+  for (int f = 0; f < PBF_NUMBER_FIELDS; ++f) {
+    for (size_t i = 0; i < particles.size(); ++i) {
+      if (f == 0) {
+        array[i] = particles.mass(i);
+      } else if (f <= DIMENSIONS) {
+        array[i] = particles.position(i, f - 1);
+      } else {
+        array[i] = particles.velocity(i, f - 1 - DIMENSIONS);
+      }
+    }
+
+    if ( !array.empty() ) {
+      ofs.write( (const char *) &array[0], array.size() * sizeof(cl_float) );
+    }
+  }
+
+  if ( !ofs ) {
+    throw runtime_error("Could not write pbf file!");
+  }
+}
+
+bool
+PbfFile::isPbf(const string &filename) {
+  const string extension(".pbf");
+
+  return filename.size() >= extension.size()
+         && filename.compare(filename.size() - extension.size(),
+                             extension.size(), extension) == 0;
+}
@@ -0,0 +1,83 @@
+#ifndef __PBF_FILE_HPP
+#define __PBF_FILE_HPP
+
+#include <string>
+
+#include "../hesp.hpp"
+#include "../Particle.hpp"
+
+
+using std::string;
+
+
+// Fields that can be present in a .pbf file, stored in this order
+enum PbfField {
+  PBF_FIELD_MASS       = 1 << 0,
+  PBF_FIELD_POSITION_X = 1 << 1,
+  PBF_FIELD_POSITION_Y = 1 << 2,
+  PBF_FIELD_POSITION_Z = 1 << 3,
+  PBF_FIELD_VELOCITY_X = 1 << 4,
+  PBF_FIELD_VELOCITY_Y = 1 << 5,
+  PBF_FIELD_VELOCITY_Z = 1 << 6
+};
+
+static const int PBF_NUMBER_FIELDS = 7;
+static const cl_uint PBF_VERSION = 1;
+
+/**
+ *  \brief  Header of a binary particle file.
+ *
+ *  Followed at headerSize by one float array per field set in fieldMask.
+ *  Every array holds stride floats of which the first count are valid,
+ *  stride is padded so that all arrays are 64 byte aligned. All values
+ *  are in the byte order of the writing machine.
+ */
+struct PbfHeader {
+  char magic[4]; /**< "PBF" and a zero byte */
+  cl_uint version; /**< PBF_VERSION */
+  cl_ulong count; /**< Number of particles */
+  cl_ulong stride; /**< Floats per field array */
+  cl_uint fieldMask; /**< PbfField bits */
+  cl_uint headerSize; /**< Offset of the first array in bytes */
+  char reserved[32];
+};
+
+
+/**
+ *  \brief  Memory mapped binary particle file (.pbf).
+ *
+ *  The mapping stays valid as long as the object lives, views returned
+ *  by view() point straight into it.
+ */
+class PbfFile {
+private:
+  // Avoid copy
+  PbfFile &operator=(const PbfFile &other);
+  PbfFile (const PbfFile &other);
+
+public:
+  PbfFile ();
+  ~PbfFile ();
+
+  void open(const string &filename);
+  void close(void);
+
+  ParticleView view(void) const;
+
+  /**
+   *  \brief  Writes particles in the binary format.
+   */
+  static void write(const string &filename, const ParticleView &particles);
+
+  /**
+   *  \brief  Checks whether a filename has the .pbf extension.
+   */
+  static bool isPbf(const string &filename);
+
+private:
+  void *mData;
+  size_t mSize;
+  const PbfHeader *mHeader;
+};
+
+#endif // __PBF_FILE_HPP
@@ -0,0 +1,274 @@
+#include "SnapshotWriter.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cstring>
+
+
+using std::string;
+using std::ofstream;
+using std::ostringstream;
+using std::cerr;
+using std::endl;
+using std::runtime_error;
+using std::unique_lock;
+using std::mutex;
+
+
+SnapshotWriter::SnapshotWriter (const ConfigParameters &parameters,
+                                Solver &solver,
+                                const size_t ringSize)
+  : mSolver(solver),
+    mNumParticles( solver.getNumberParticles() ),
+    mPartOutFreq(parameters.partOutFreq),
+    mPartOutNameBase(parameters.partOutNameBase),
+    mVtkOutFreq(parameters.vtkOutFreq),
+    mVtkOutNameBase(parameters.vtkOutNameBase),
+    mShutdown(false),
+    mStalls(0) {
+
+  if ( !this->isEnabled() ) {
+    return;
+  }
+
+  mSlots.resize(ringSize);
+
+  for (size_t s = 0; s < mSlots.size(); ++s) {
+    mSolver.createSnapshotBuffer(mSlots[s]);
+    mFreeSlots.push_back(s);
+  }
+
+  mWriter = std::thread(&SnapshotWriter::writerLoop, this);
+}
+
+SnapshotWriter::~SnapshotWriter () {
+  if ( !this->isEnabled() ) {
+    return;
+  }
+
+  {
+    unique_lock<mutex> lock(mMutex);
+    mShutdown = true;
+  }
+
+  mJobCondition.notify_one();
+  mWriter.join();
+
+  for (size_t s = 0; s < mSlots.size(); ++s) {
+    mSolver.releaseSnapshotBuffer(mSlots[s]);
+  }
+}
+
+void
+SnapshotWriter::afterStep(const unsigned int step, const cl_float time) {
+  Job job;
+  job.step = step;
+  job.time = time;
+  job.writePart = mPartOutFreq > 0 && step % mPartOutFreq == 0;
+  job.writeVtk = mVtkOutFreq > 0 && step % mVtkOutFreq == 0;
+
+  if (!job.writePart && !job.writeVtk) {
+    return;
+  }
+
+  {
+    unique_lock<mutex> lock(mMutex);
+
+    if ( mFreeSlots.empty() ) {
+      ++mStalls;
+    }
+
+    while ( mFreeSlots.empty() ) {
+      mFreeCondition.wait(lock);
+    }
+
+    job.slot = mFreeSlots.front();
+    mFreeSlots.pop_front();
+  }
+
+  // Outside the lock, the enqueue may synchronize with OpenGL and the
+  // writer must not wait for that. The readback is only enqueued, the
+  // writer waits for its completion.
+  mSolver.enqueueSnapshot(mSlots[job.slot]);
+
+  {
+    unique_lock<mutex> lock(mMutex);
+    mJobs.push_back(job);
+  }
+
+  mJobCondition.notify_one();
+}
+
+void
+SnapshotWriter::writerLoop(void) {
+  for (;;) {
+    Job job;
+
+    {
+      unique_lock<mutex> lock(mMutex);
+
+      while ( !mShutdown && mJobs.empty() ) {
+        mJobCondition.wait(lock);
+      }
+
+      // Drain remaining jobs before shutting down
+      if ( mJobs.empty() ) {
+        return;
+      }
+
+      job = mJobs.front();
+      mJobs.pop_front();
+    }
+
+    const SnapshotBuffer &buffer = mSlots[job.slot];
+    buffer.wait();
+
+    try {
+      if (job.writePart) {
+        ostringstream filename;
+        filename << mPartOutNameBase << job.step / mPartOutFreq << ".out";
+        this->writePart(filename.str(), buffer);
+      }
+
+      if (job.writeVtk) {
+        ostringstream filename;
+        filename << mVtkOutNameBase << job.step / mVtkOutFreq << ".vtk";
+        this->writeVtk(filename.str(), buffer, job);
+      }
+    } catch (const std::exception &e) {
+      // Losing a snapshot must not take down the simulation
+      cerr << "Snapshot of step " << job.step << " failed: "
+           << e.what() << endl;
+    }
+
+    {
+      unique_lock<mutex> lock(mMutex);
+      mFreeSlots.push_back(job.slot);
+    }
+
+    mFreeCondition.notify_one();
+  }
+}
+
+void
+SnapshotWriter::writePart(const string &filename,
+                          const SnapshotBuffer &buffer) const {
+  ofstream ofs( filename.c_str() );
+
+  if ( !ofs ) {
+    throw runtime_error("Could not open " + filename);
+  }
+
+  // Same layout as the particle input files (.in)
+  ofs << mNumParticles << "\n";
+
+  for (cl_uint i = 0; i < mNumParticles; ++i) {
+    const cl_float4 &x = buffer.positions[i];
+    const cl_float4 &v = buffer.velocities[i];
+
+    ofs << v.s[3] << " "
+        << x.s[0] << " " << x.s[1] << " " << x.s[2] << " "
+        << v.s[0] << " " << v.s[1] << " " << v.s[2] << "\n";
+  }
+
+  if ( !ofs ) {
+    throw runtime_error("Could not write " + filename);
+  }
+}
+
+// Legacy VTK binary data is big endian
+static inline void
+putBigEndian(char *out, const void *value) {
+  const char *bytes = (const char *) value;
+  static const int one = 1;
+
+  if ( *(const char *) &one == 1 ) {
+    out[0] = bytes[3];
+    out[1] = bytes[2];
+    out[2] = bytes[1];
+    out[3] = bytes[0];
+  } else {
+    memcpy(out, bytes, 4);
+  }
+}
+
+void
+SnapshotWriter::writeVtk(const string &filename,
+                         const SnapshotBuffer &buffer,
+                         const Job &job) const {
+  ofstream ofs(filename.c_str(), std::ios::binary);
+
+  if ( !ofs ) {
+    throw runtime_error("Could not open " + filename);
+  }
+
+  const cl_uint n = mNumParticles;
+  vector<char> data;
+
+  ofs << "# vtk DataFile Version 3.0\n";
+  ofs << "hesp step " << job.step << " time " << job.time << "\n";
+  ofs << "BINARY\n";
+  ofs << "DATASET UNSTRUCTURED_GRID\n";
+
+  ofs << "POINTS " << n << " float\n";
+  data.resize(n * 3 * 4);
+
+  for (cl_uint i = 0; i < n; ++i) {
+    for (int d = 0; d < 3; ++d) {
+      putBigEndian(&data[(i * 3 + d) * 4], &buffer.positions[i].s[d]);
+    }
+  }
+
+  ofs.write(&data[0], data.size());
+
+  // One vertex cell per particle
+  ofs << "\nCELLS " << n << " " << 2 * n << "\n";
+  data.resize(n * 2 * 4);
+
+  for (cl_uint i = 0; i < n; ++i) {
+    const cl_int count = 1;
+    const cl_int index = i;
+    putBigEndian(&data[(i * 2) * 4], &count);
+    putBigEndian(&data[(i * 2 + 1) * 4], &index);
+  }
+
+  ofs.write(&data[0], data.size());
+
+  ofs << "\nCELL_TYPES " << n << "\n";
+  data.resize(n * 4);
+
+  for (cl_uint i = 0; i < n; ++i) {
+    const cl_int vertex = 1;
+    putBigEndian(&data[i * 4], &vertex);
+  }
+
+  ofs.write(&data[0], data.size());
+
+  ofs << "\nPOINT_DATA " << n << "\n";
+  ofs << "SCALARS mass float 1\n";
+  ofs << "LOOKUP_TABLE default\n";
+
+  for (cl_uint i = 0; i < n; ++i) {
+    putBigEndian(&data[i * 4], &buffer.velocities[i].s[3]);
+  }
+
+  ofs.write(&data[0], n * 4);
+
+  ofs << "\nVECTORS velocity float\n";
+  data.resize(n * 3 * 4);
+
+  for (cl_uint i = 0; i < n; ++i) {
+    for (int d = 0; d < 3; ++d) {
+      putBigEndian(&data[(i * 3 + d) * 4], &buffer.velocities[i].s[d]);
+    }
+  }
+
+  ofs.write(&data[0], data.size());
+  ofs << "\n";
+
+  if ( !ofs ) {
+    throw runtime_error("Could not write " + filename);
+  }
+}
@@ -0,0 +1,104 @@
+#ifndef __SNAPSHOT_WRITER_HPP
+#define __SNAPSHOT_WRITER_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "../hesp.hpp"
+#include "../Parameters.hpp"
+#include "../Solver.hpp"
+
+
+using std::string;
+using std::vector;
+using std::deque;
+
+
+/**
+ *  \brief  Periodic particle (part) and legacy binary VTK output.
+ *
+ *  Snapshots are read back asynchronously into a ring of staging
+ *  buffers and serialized by a background thread. The simulation only
+ *  waits if all buffers of the ring are still being written.
+ */
+class SnapshotWriter {
+private:
+  // Avoid copy
+  SnapshotWriter &operator=(const SnapshotWriter &other);
+  SnapshotWriter (const SnapshotWriter &other);
+
+public:
+  /**
+   *  \brief  The solver has to be initialized already.
+   */
+  SnapshotWriter (const ConfigParameters &parameters,
+                  Solver &solver,
+                  const size_t ringSize = 4);
+
+  /**
+   *  \brief  Writes all pending snapshots before returning.
+   */
+  ~SnapshotWriter ();
+
+  bool
+  isEnabled(void) const {
+    return mPartOutFreq > 0 || mVtkOutFreq > 0;
+  }
+
+  /**
+   *  \brief  Requests output if step is a multiple of an output frequency.
+   */
+  void
+  afterStep(const unsigned int step, const cl_float time);
+
+  /**
+   *  \brief  Number of times the simulation had to wait for a free buffer.
+   */
+  unsigned int
+  getNumberStalls(void) const {
+    return mStalls;
+  }
+
+private:
+  struct Job {
+    size_t slot;
+    unsigned int step;
+    cl_float time;
+    bool writePart;
+    bool writeVtk;
+  };
+
+  void writerLoop(void);
+
+  void writePart(const string &filename,
+                 const SnapshotBuffer &buffer) const;
+  void writeVtk(const string &filename,
+                const SnapshotBuffer &buffer,
+                const Job &job) const;
+
+  Solver &mSolver;
+  const cl_uint mNumParticles;
+
+  const cl_uint mPartOutFreq;
+  const string mPartOutNameBase;
+  const cl_uint mVtkOutFreq;
+  const string mVtkOutNameBase;
+
+  vector<SnapshotBuffer> mSlots;
+  deque<size_t> mFreeSlots;
+  deque<Job> mJobs;
+
+  std::mutex mMutex;
+  std::condition_variable mJobCondition;
+  std::condition_variable mFreeCondition;
+  std::thread mWriter;
+  bool mShutdown;
+
+  unsigned int mStalls;
+};
+
+#endif // __SNAPSHOT_WRITER_HPP
@@ -0,0 +1,140 @@
+#include "StatisticsWriter.hpp"
+
+#include <cmath>
+#include <stdexcept>
+
+
+using std::runtime_error;
+using std::endl;
+
+
+StatisticsWriter::StatisticsWriter (const ConfigParameters &parameters,
+                                    Solver &solver,
+                                    const size_t ringSize)
+  : mSolver(solver),
+    mNumParticles( solver.getNumberParticles() ),
+    mOutFreq(parameters.statisticsOutFreq),
+    mOutName(parameters.statisticsOutName) {
+
+  if ( !this->isEnabled() ) {
+    return;
+  }
+
+  // Restarted runs append, the step column tells them apart
+  const bool append = !parameters.restartFile.empty();
+
+  mOutput.open(mOutName.c_str(), append ? std::ios::app : std::ios::out);
+
+  if ( !mOutput ) {
+    throw runtime_error("Could not open " + mOutName);
+  }
+
+  if (!append) {
+    mOutput << "step,time,kinetic_energy,max_speed,density_error_average,"
+            << "density_error_max,center_x,center_y,center_z,"
+            << "min_x,min_y,min_z,max_x,max_y,max_z";
+
+    // Bin b counts densities in [b, b + 1) * 2 rho_0 / _STAT_BINS
+    for (unsigned int b = 0; b < _STAT_BINS; ++b) {
+      mOutput << ",density_bin_" << b;
+    }
+
+    mOutput << endl;
+  }
+
+  mSlots.resize(ringSize);
+
+  for (size_t s = 0; s < mSlots.size(); ++s) {
+    mFreeSlots.push_back(s);
+  }
+}
+
+StatisticsWriter::~StatisticsWriter () {
+  if ( !this->isEnabled() ) {
+    return;
+  }
+
+  this->writeReady(true);
+}
+
+void
+StatisticsWriter::afterStep(const unsigned int step, const cl_float time) {
+  if (mOutFreq == 0 || step % mOutFreq != 0) {
+    return;
+  }
+
+  this->writeReady(false);
+
+  // All blocks in flight, the oldest is the first to land
+  if ( mFreeSlots.empty() ) {
+    const Row &oldest = mPending.front();
+
+    mSlots[oldest.slot].wait();
+    this->writeRow(oldest, mSlots[oldest.slot]);
+
+    mFreeSlots.push_back(oldest.slot);
+    mPending.pop_front();
+  }
+
+  Row row;
+  row.slot = mFreeSlots.front();
+  row.step = step;
+  row.time = time;
+  mFreeSlots.pop_front();
+
+  // Only enqueued, written by a later call once it has landed
+  mSolver.enqueueStatistics(mSlots[row.slot]);
+  mPending.push_back(row);
+}
+
+void
+StatisticsWriter::writeReady(const bool flush) {
+  while ( !mPending.empty() ) {
+    const Row &row = mPending.front();
+    const StatisticsBlock &block = mSlots[row.slot];
+
+    if (flush) {
+      block.wait();
+    } else if ( !block.isReady() ) {
+      return;
+    }
+
+    this->writeRow(row, block);
+
+    mFreeSlots.push_back(row.slot);
+    mPending.pop_front();
+  }
+
+  mOutput.flush();
+}
+
+void
+StatisticsWriter::writeRow(const Row &row, const StatisticsBlock &block) {
+  const cl_float *values = block.values;
+  const cl_float mass = values[_STAT_MASS];
+
+  mOutput << row.step << "," << row.time
+          << "," << values[_STAT_KINETIC_ENERGY]
+          << "," << std::sqrt(values[_STAT_MAX_SPEED2])
+          << "," << values[_STAT_DENSITY_ERROR_SUM] / mNumParticles
+          << "," << values[_STAT_DENSITY_ERROR_MAX];
+
+  for (int d = 0; d < 3; ++d) {
+    mOutput << "," << (mass > 0.0f
+                       ? values[_STAT_MASS_POSITION + d] / mass : 0.0f);
+  }
+
+  for (int d = 0; d < 3; ++d) {
+    mOutput << "," << values[_STAT_BOX_MIN + d];
+  }
+
+  for (int d = 0; d < 3; ++d) {
+    mOutput << "," << values[_STAT_BOX_MAX + d];
+  }
+
+  for (unsigned int b = 0; b < _STAT_BINS; ++b) {
+    mOutput << "," << block.histogram[b];
+  }
+
+  mOutput << "\n";
+}
@@ -0,0 +1,88 @@
+#ifndef __STATISTICS_WRITER_HPP
+#define __STATISTICS_WRITER_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <fstream>
+
+#include "../hesp.hpp"
+#include "../Parameters.hpp"
+#include "../Solver.hpp"
+
+
+using std::string;
+using std::vector;
+using std::deque;
+using std::ofstream;
+
+
+/**
+ *  \brief  Periodic diagnostics as rows of a CSV file.
+ *
+ *  Kinetic energy, maximum speed, density error, center of mass,
+ *  bounding box and density histogram are reduced by the solver and
+ *  read back into a ring of small blocks. Rows are written once their
+ *  block has landed, the simulation only waits if the ring is full.
+ */
+class StatisticsWriter {
+private:
+  // Avoid copy
+  StatisticsWriter &operator=(const StatisticsWriter &other);
+  StatisticsWriter (const StatisticsWriter &other);
+
+public:
+  /**
+   *  \brief  The solver has to be initialized already.
+   */
+  StatisticsWriter (const ConfigParameters &parameters,
+                    Solver &solver,
+                    const size_t ringSize = 16);
+
+  /**
+   *  \brief  Writes all pending rows before returning.
+   */
+  ~StatisticsWriter ();
+
+  bool
+  isEnabled(void) const {
+    return mOutFreq > 0;
+  }
+
+  /**
+   *  \brief  Requests a row if step is a multiple of the output frequency.
+   */
+  void
+  afterStep(const unsigned int step, const cl_float time);
+
+  const string &
+  getFilename(void) const {
+    return mOutName;
+  }
+
+private:
+  struct Row {
+    size_t slot;
+    unsigned int step;
+    cl_float time;
+  };
+
+  // Writes the rows whose blocks have landed, waits for all if flush
+  void writeReady(const bool flush);
+
+  void writeRow(const Row &row, const StatisticsBlock &block);
+
+  Solver &mSolver;
+  const cl_uint mNumParticles;
+
+  const cl_uint mOutFreq;
+  const string mOutName;
+
+  ofstream mOutput;
+
+  vector<StatisticsBlock> mSlots;
+  deque<size_t> mFreeSlots;
+  deque<Row> mPending;
+};
+
+#endif // __STATISTICS_WRITER_HPP
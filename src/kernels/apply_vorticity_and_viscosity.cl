@@ -1,7 +1,10 @@
-__kernel void applyVorticityAndViscosity(const __global float4 *predicted,
-    const __global float4 *velocities,
-    __global float4 *deltaVelocities,
-#if defined(USE_LINKEDCELL)
+__kernel void applyVorticityAndViscosity(const __global particle_t *predicted,
+    const __global particle_t *velocities,
+    __global particle_t *deltaVelocities,
+#if defined(USE_NEIGHBOUR_LISTS)
+    const __global int *neighbours,
+    const __global int *neighbour_counts,
+#elif defined(USE_LINKEDCELL)
     const __global int *cells,
     const __global int *particles_list,
 #else
@@ -14,17 +17,46 @@ __kernel void applyVorticityAndViscosity(const __global float4 *predicted,
 
   const int END_OF_CELL_LIST = -1;
 
+  const float3 position = LOAD3(predicted, i);
+  const float3 velocity = LOAD3(velocities, i);
+
+  float3 viscosity_sum = (float3) 0.0f;
+
+#if defined(USE_NEIGHBOUR_LISTS)
+  const int neighbour_count = neighbour_counts[i];
+
+  for (int k = 0; k < neighbour_count; ++k) {
+    const int next = neighbours[k * N + i];
+
+    if (i != next) {
+      float3 r = position - LOAD3(predicted, next);
+      float r_length_2 = (r.x * r.x + r.y * r.y + r.z * r.z);
+
+      if (r_length_2 > 0.0f && r_length_2 < PBF_H_2) {
+        float3 v = LOAD3(velocities, next) - velocity;
+        float poly6 = POLY6_FACTOR * (PBF_H_2 - r_length_2)
+                      * (PBF_H_2 - r_length_2)
+                      * (PBF_H_2 - r_length_2);
+
+        viscosity_sum += (1.0f / LOAD_W(predicted, next)) * v * poly6;
+
+        // #if defined(USE_DEBUG)
+        // printf("viscosity: i,j: %d,%d result: [%f,%f,%f] density: %f\n", i, next,
+        //        v.x, v.y, v.z, predicted[j].w);
+        // #endif // USE_DEBUG
+      }
+    }
+  }
+#else
   int current_cell[3];
 
-  current_cell[0] = (int) ( (predicted[i].x - SYSTEM_MIN_X)
+  current_cell[0] = (int) ( (position.x - SYSTEM_MIN_X)
                             / CELL_LENGTH_X );
-  current_cell[1] = (int) ( (predicted[i].y - SYSTEM_MIN_Y)
+  current_cell[1] = (int) ( (position.y - SYSTEM_MIN_Y)
                             / CELL_LENGTH_Y );
-  current_cell[2] = (int) ( (predicted[i].z - SYSTEM_MIN_Z)
+  current_cell[2] = (int) ( (position.z - SYSTEM_MIN_Z)
                             / CELL_LENGTH_Z );
 
-  float4 viscosity_sum = (float4) 0.0f;
-
   for (int x = -1; x <= 1; ++x) {
     for (int y = -1; y <= 1; ++y) {
       for (int z = -1; z <= 1; ++z) {
@@ -40,25 +72,25 @@ __kernel void applyVorticityAndViscosity(const __global float4 *predicted,
           continue;
         }
 
-        uint cell_index = neighbour_cell[0] +
-                          neighbour_cell[1] * NUMBER_OF_CELLS_X +
-                          neighbour_cell[2] * NUMBER_OF_CELLS_X * NUMBER_OF_CELLS_Y;
+        uint cell_index = CELL_INDEX(neighbour_cell[0], neighbour_cell[1],
+                                     neighbour_cell[2]);
 
 #if defined(USE_LINKEDCELL)
         int next = cells[cell_index];
 
         while (next != END_OF_CELL_LIST) {
-          if (i != next) {
-            float4 r = predicted[i] - predicted[next];
+          if (i != next
+              && IN_CELL(LOAD3(predicted, next), neighbour_cell)) {
+            float3 r = position - LOAD3(predicted, next);
             float r_length_2 = (r.x * r.x + r.y * r.y + r.z * r.z);
 
             if (r_length_2 > 0.0f && r_length_2 < PBF_H_2) {
-              float4 v = velocities[next] - velocities[i];
+              float3 v = LOAD3(velocities, next) - velocity;
               float poly6 = POLY6_FACTOR * (PBF_H_2 - r_length_2)
                             * (PBF_H_2 - r_length_2)
                             * (PBF_H_2 - r_length_2);
 
-              viscosity_sum += (1.0f / predicted[next].w) * v * poly6;
+              viscosity_sum += (1.0f / LOAD_W(predicted, next)) * v * poly6;
 
               // #if defined(USE_DEBUG)
               // printf("viscosity: i,j: %d,%d result: [%f,%f,%f] density: %f\n", i, next,
@@ -73,20 +105,26 @@ __kernel void applyVorticityAndViscosity(const __global float4 *predicted,
         int2 cellRange = foundCells[cell_index];
         if (cellRange.x == END_OF_CELL_LIST) continue;
 
-        for (uint n = cellRange.x; n <= cellRange.y; ++n) {
+        for (int n = cellRange.x; n <= cellRange.y; ++n) {
+#if defined(USE_SORTED_PARTICLES)
+          // Particle data is stored in the sorted order
+          const int next = n;
+#else
           const int next = radixCells[n].y;
+#endif // USE_SORTED_PARTICLES
 
-          if (i != next) {
-            float4 r = predicted[i] - predicted[next];
+          if (i != next
+              && IN_CELL(LOAD3(predicted, next), neighbour_cell)) {
+            float3 r = position - LOAD3(predicted, next);
             float r_length_2 = (r.x * r.x + r.y * r.y + r.z * r.z);
 
-            if (r_length_2 > 0.0f && r_length_2 < h2) {
-              float4 v = velocities[next] - velocities[i];
-              float poly6 = poly6_factor * (h2 - r_length_2)
-                            * (h2 - r_length_2)
-                            * (h2 - r_length_2);
+            if (r_length_2 > 0.0f && r_length_2 < PBF_H_2) {
+              float3 v = LOAD3(velocities, next) - velocity;
+              float poly6 = POLY6_FACTOR * (PBF_H_2 - r_length_2)
+                            * (PBF_H_2 - r_length_2)
+                            * (PBF_H_2 - r_length_2);
 
-              viscosity_sum += (1.0f / predicted[next].w) * v * poly6;
+              viscosity_sum += (1.0f / LOAD_W(predicted, next)) * v * poly6;
 
               // #if defined(USE_DEBUG)
               // printf("viscosity: i,j: %d,%d result: [%f,%f,%f] density: %f\n", i, next,
@@ -95,13 +133,14 @@ __kernel void applyVorticityAndViscosity(const __global float4 *predicted,
             }
           }
         }
-#endif
+#endif // USE_LINKEDCELL
       }
     }
   }
+#endif // USE_NEIGHBOUR_LISTS
 
   const float c = 0.01f;
-  deltaVelocities[i] = c * viscosity_sum;
+  STORE3(deltaVelocities, i, c * viscosity_sum);
 
   // #if defined(USE_DEBUG)
   // printf("viscosity: i: %d sum:%f result: [%f,%f,%f]\n", i,
@@ -0,0 +1,99 @@
+// Collects the neighbours of every particle within NEIGHBOUR_RADIUS, so
+// the solver iterations do not have to walk the neighbour cells again.
+// The radius includes a skin if lists are kept for several steps.
+// Neighbour k of particle i is stored at neighbours[k * N + i].
+__kernel void buildNeighbourLists(const __global particle_t *predicted,
+#if defined(USE_LINKEDCELL)
+                                  const __global int *cells,
+                                  const __global int *particles_list,
+#else
+                                  const __global int2 *radixCells,
+                                  const __global int2 *foundCells,
+#endif // USE_LINKEDCELL
+                                  __global int *neighbours,
+                                  __global int *neighbour_counts,
+                                  __global uint *overflow,
+                                  const uint maxNeighbours,
+                                  const int N) {
+  const int i = get_global_id(0);
+  if (i >= N) return;
+
+  const int END_OF_CELL_LIST = -1;
+
+  const float3 position = LOAD3(predicted, i);
+
+  int current_cell[3];
+
+  current_cell[0] = (int) ( (position.x - SYSTEM_MIN_X)
+                            / CELL_LENGTH_X );
+  current_cell[1] = (int) ( (position.y - SYSTEM_MIN_Y)
+                            / CELL_LENGTH_Y );
+  current_cell[2] = (int) ( (position.z - SYSTEM_MIN_Z)
+                            / CELL_LENGTH_Z );
+
+  uint count = 0;
+
+  for (int x = -NEIGHBOUR_CELL_RANGE; x <= NEIGHBOUR_CELL_RANGE; ++x) {
+    for (int y = -NEIGHBOUR_CELL_RANGE; y <= NEIGHBOUR_CELL_RANGE; ++y) {
+      for (int z = -NEIGHBOUR_CELL_RANGE; z <= NEIGHBOUR_CELL_RANGE; ++z) {
+        int neighbour_cell[3];
+
+        neighbour_cell[0] = current_cell[0] + x;
+        neighbour_cell[1] = current_cell[1] + y;
+        neighbour_cell[2] = current_cell[2] + z;
+
+        if (neighbour_cell[0] < 0 || neighbour_cell[0] >= NUMBER_OF_CELLS_X ||
+            neighbour_cell[1] < 0 || neighbour_cell[1] >= NUMBER_OF_CELLS_Y ||
+            neighbour_cell[2] < 0 || neighbour_cell[2] >= NUMBER_OF_CELLS_Z) {
+          continue;
+        }
+
+        uint cell_index = CELL_INDEX(neighbour_cell[0], neighbour_cell[1],
+                                     neighbour_cell[2]);
+
+#if defined(USE_LINKEDCELL)
+        int next = cells[cell_index];
+
+        while (next != END_OF_CELL_LIST) {
+#else
+        int2 cellRange = foundCells[cell_index];
+        if (cellRange.x == END_OF_CELL_LIST) continue;
+
+        for (int n = cellRange.x; n <= cellRange.y; ++n) {
+#if defined(USE_SORTED_PARTICLES)
+          const int next = n;
+#else
+          const int next = radixCells[n].y;
+#endif // USE_SORTED_PARTICLES
+#endif // USE_LINKEDCELL
+
+          if (i != next
+              && IN_CELL(LOAD3(predicted, next), neighbour_cell)) {
+            float3 r = position - LOAD3(predicted, next);
+            float r_length_2 = r.x * r.x + r.y * r.y + r.z * r.z;
+
+            if (r_length_2 > 0.0f && r_length_2 < NEIGHBOUR_RADIUS_2) {
+              if (count < maxNeighbours) {
+                neighbours[count * N + i] = next;
+              }
+
+              ++count;
+            }
+          }
+
+#if defined(USE_LINKEDCELL)
+          next = particles_list[next];
+#endif // USE_LINKEDCELL
+        }
+      }
+    }
+  }
+
+  // Neighbours beyond the cap are dropped, count how often that happens
+  if (count > maxNeighbours) {
+    atomic_inc(overflow);
+    count = maxNeighbours;
+  }
+
+  neighbour_counts[i] = count;
+}
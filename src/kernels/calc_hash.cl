@@ -1,4 +1,4 @@
-__kernel void calcHash(const __global float4 *predicted,
+__kernel void calcHash(const __global particle_t *predicted,
                        __global uint2 *radixCells,
                        const uint maxInt,
                        const uint numParticles,
@@ -11,16 +11,25 @@ __kernel void calcHash(const __global float4 *predicted,
   // #endif // USE_DEBUG
 
   if (i < numParticles) {
-    // Get cell that belongs to particle
-    uint cell_pos = (uint) ( (predicted[i].x - SYSTEM_MIN_X)
-                             / CELL_LENGTH_X )
-                    + (uint) ( (predicted[i].y - SYSTEM_MIN_Y)
-                               / CELL_LENGTH_Y ) * NUMBER_OF_CELLS_X
-                    + (uint) ( (predicted[i].z - SYSTEM_MIN_Z)
-                               / CELL_LENGTH_Z ) * NUMBER_OF_CELLS_X * NUMBER_OF_CELLS_Y;
+    const float3 position = LOAD3(predicted, i);
+
+    // Clamp to the grid, particles can leave the domain before the
+    // constraints push them back
+    const int cell_x = clamp( (int) ( (position.x - SYSTEM_MIN_X)
+                                      / CELL_LENGTH_X ),
+                              0, (int) NUMBER_OF_CELLS_X - 1 );
+    const int cell_y = clamp( (int) ( (position.y - SYSTEM_MIN_Y)
+                                      / CELL_LENGTH_Y ),
+                              0, (int) NUMBER_OF_CELLS_Y - 1 );
+    const int cell_z = clamp( (int) ( (position.z - SYSTEM_MIN_Z)
+                                      / CELL_LENGTH_Z ),
+                              0, (int) NUMBER_OF_CELLS_Z - 1 );
+
+    const uint cell_pos = CELL_INDEX(cell_x, cell_y, cell_z);
 
     radixCells[i] = (uint2)(cell_pos, i);
-  } else {
-    radixCells[i] = (uint2)(maxInt, 0);
+  } else if (i < numKeys) {
+    // Padding sorts behind all particles
+    radixCells[i] = (uint2)(maxInt, i);
   }
 }
@@ -1,7 +1,15 @@
-__kernel void computeDelta(__global float4 *delta,
-                           const __global float4 *predicted,
+__kernel void computeDelta(
+#if defined(USE_FUSED_UPDATE)
+                           __global particle_t *predictedOut,
+#else
+                           __global particle_t *delta,
+#endif // USE_FUSED_UPDATE
+                           const __global particle_t *predicted,
                            const __global float *scaling,
-#if defined(USE_LINKEDCELL)
+#if defined(USE_NEIGHBOUR_LISTS)
+                           const __global int *neighbours,
+                           const __global int *neighbour_counts,
+#elif defined(USE_LINKEDCELL)
                            const __global int *cells,
                            const __global int *particles_list,
 #else
@@ -15,18 +23,44 @@ __kernel void computeDelta(__global float4 *delta,
 
   const int END_OF_CELL_LIST = -1;
 
+  const float3 position = LOAD3(predicted, i);
+
+  // Sum of lambdas
+  float3 sum = (float3) 0.0f;
+
+#if defined(USE_NEIGHBOUR_LISTS)
+  const int neighbour_count = neighbour_counts[i];
+
+  for (int k = 0; k < neighbour_count; ++k) {
+    const int next = neighbours[k * N + i];
+
+    if (i != next) {
+      float3 r = position - LOAD3(predicted, next);
+      float r_length_2 = r.x * r.x + r.y * r.y + r.z * r.z;
+
+      if (r_length_2 > 0.0f && r_length_2 < PBF_H_2) {
+        float r_length = sqrt(r_length_2);
+        float3 gradient_spiky = -1.0f * r / (r_length)
+                                * GRAD_SPIKY_FACTOR
+                                * (PBF_H - r_length)
+                                * (PBF_H - r_length);
+
+        // Sum for delta p of scaling factors and grad spiky
+        // in equation (12)
+        sum += (scaling[i] + scaling[next]) * gradient_spiky;
+      }
+    }
+  }
+#else
   int current_cell[3];
 
-  current_cell[0] = (int) ( (predicted[i].x - SYSTEM_MIN_X)
+  current_cell[0] = (int) ( (position.x - SYSTEM_MIN_X)
                             / CELL_LENGTH_X );
-  current_cell[1] = (int) ( (predicted[i].y - SYSTEM_MIN_Y)
+  current_cell[1] = (int) ( (position.y - SYSTEM_MIN_Y)
                             / CELL_LENGTH_Y );
-  current_cell[2] = (int) ( (predicted[i].z - SYSTEM_MIN_Z)
+  current_cell[2] = (int) ( (position.z - SYSTEM_MIN_Z)
                             / CELL_LENGTH_Z );
 
-  // Sum of lambdas
-  float4 sum = (float4) 0.0f;
-
   for (int x = -1; x <= 1; ++x) {
     for (int y = -1; y <= 1; ++y) {
       for (int z = -1; z <= 1; ++z) {
@@ -42,22 +76,22 @@ __kernel void computeDelta(__global float4 *delta,
           continue;
         }
 
-        uint cell_index = neighbour_cell[0] +
-                          neighbour_cell[1] * NUMBER_OF_CELLS_X +
-                          neighbour_cell[2] * NUMBER_OF_CELLS_X * NUMBER_OF_CELLS_Y;
+        uint cell_index = CELL_INDEX(neighbour_cell[0], neighbour_cell[1],
+                                     neighbour_cell[2]);
 
 #if defined(USE_LINKEDCELL)
         // Next particle in list
         int next = cells[cell_index];
 
         while (next != END_OF_CELL_LIST) {
-          if (i != next) {
-            float4 r = predicted[i] - predicted[next];
+          if (i != next
+              && IN_CELL(LOAD3(predicted, next), neighbour_cell)) {
+            float3 r = position - LOAD3(predicted, next);
             float r_length_2 = r.x * r.x + r.y * r.y + r.z * r.z;
 
             if (r_length_2 > 0.0f && r_length_2 < PBF_H_2) {
               float r_length = sqrt(r_length_2);
-              float4 gradient_spiky = -1.0f * r / (r_length)
+              float3 gradient_spiky = -1.0f * r / (r_length)
                                       * GRAD_SPIKY_FACTOR
                                       * (PBF_H - r_length)
                                       * (PBF_H - r_length);
@@ -87,45 +121,42 @@ __kernel void computeDelta(__global float4 *delta,
         int2 cellRange = foundCells[cell_index];
         if (cellRange.x == END_OF_CELL_LIST) continue;
 
-        for (uint n = cellRange.x; n <= cellRange.y; ++n) {
+        for (int n = cellRange.x; n <= cellRange.y; ++n) {
+#if defined(USE_SORTED_PARTICLES)
+          // Particle data is stored in the sorted order
+          const int next = n;
+#else
           const int next = radixCells[n].y;
+#endif // USE_SORTED_PARTICLES
 
-          if (i != next) {
-            float4 r = predicted[i] - predicted[next];
+          if (i != next
+              && IN_CELL(LOAD3(predicted, next), neighbour_cell)) {
+            float3 r = position - LOAD3(predicted, next);
             float r_length_2 = r.x * r.x + r.y * r.y + r.z * r.z;
 
-            if (r_length_2 > 0.0f && r_length_2 < h2) {
+            if (r_length_2 > 0.0f && r_length_2 < PBF_H_2) {
               float r_length = sqrt(r_length_2);
-              float4 gradient_spiky = -1.0f * r / (r_length)
-                                      * gradSpiky_factor
-                                      * (h - r_length)
-                                      * (h - r_length);
-
-              float poly6_r = poly6_factor * (h2 - r_length_2)
-                              * (h2 - r_length_2) * (h2 - r_length_2);
-
-              // equation (13) correction term
-              const float q = 0.3f * h;
-              float poly6_q = poly6_factor * (h2 - q)
-                              * (h2 - q) * (h2 - q);
-              const float k = 0.1f;
-              const int n = 4;
-
-              float s_corr = -k * pow(poly6_r / poly6_q, n);
+              float3 gradient_spiky = -1.0f * r / (r_length)
+                                      * GRAD_SPIKY_FACTOR
+                                      * (PBF_H - r_length)
+                                      * (PBF_H - r_length);
 
+              // Sum for delta p of scaling factors and grad spiky
+              // in equation (12)
               sum += (scaling[i] + scaling[next]) * gradient_spiky;
             }
           }
         }
-#endif
+#endif // USE_LINKEDCELL
       }
     }
   }
+#endif // USE_NEIGHBOUR_LISTS
 
   // equation (12)
-  float4 delta_p = sum / REST_DENSITY;
+  float3 delta_p = sum / REST_DENSITY;
 
-  float4 future = predicted[i] + delta_p;
+  float3 future = position + delta_p;
 
   if ( (future.x - PBF_H) < (SYSTEM_MIN_X + wave_generator) ) {
     future.x = SYSTEM_MIN_X + wave_generator + PBF_H;
@@ -149,7 +180,14 @@ __kernel void computeDelta(__global float4 *delta,
     //future.z += (system_length_max.z - (future.z + radius)) * 2.0f;
   }
 
-  delta[i] = future - predicted[i];
+#if defined(USE_FUSED_UPDATE)
+  // Neighbours still read predicted, so the corrected position goes to
+  // the other buffer. The density in w is kept for the viscosity.
+  STORE3(predictedOut, i, future);
+  STORE_W(predictedOut, i, LOAD_W(predicted, i));
+#else
+  STORE3(delta, i, future - position);
+#endif // USE_FUSED_UPDATE
 
   // #if defined(USE_DEBUG)
   //     printf("compute_delta: result: i: %d\ndelta: [%f,%f,%f]\n",
@@ -0,0 +1,152 @@
+// computeDelta for particle data sorted by cell, one work-group per cell.
+// Staged like computeScalingTiled, the tile holds the neighbour position
+// with its scaling factor in w.
+__kernel void computeDeltaTiled(
+#if defined(USE_FUSED_UPDATE)
+                                __global particle_t *predictedOut,
+#else
+                                __global particle_t *delta,
+#endif // USE_FUSED_UPDATE
+                                const __global particle_t *predicted,
+                                const __global float *scaling,
+                                const __global int2 *foundCells,
+                                __local float4 *tile,
+                                const float wave_generator,
+                                const int N) {
+  const int END_OF_CELL_LIST = -1;
+
+  const int cells_x = (int) NUMBER_OF_CELLS_X;
+  const int cells_y = (int) NUMBER_OF_CELLS_Y;
+  const int cells_z = (int) NUMBER_OF_CELLS_Z;
+
+  const int cell = get_group_id(0);
+  const int l = get_local_id(0);
+  const int L = get_local_size(0);
+
+  const int2 own = foundCells[cell];
+  if (own.x == END_OF_CELL_LIST) return;
+
+#if defined(USE_MORTON)
+  // Slots of keys outside the grid are empty and returned above
+  const int current_cell[3] = { mortonCompact(cell),
+                                mortonCompact(cell >> 1),
+                                mortonCompact(cell >> 2)
+                              };
+
+  // Morton keys interleave the cells of a row in x
+  const int span_cells = 1;
+#else
+  const int current_cell[3] = { cell % cells_x,
+                                (cell / cells_x) % cells_y,
+                                cell / (cells_x * cells_y)
+                              };
+
+  const int span_cells = 3;
+#endif // USE_MORTON
+
+  const int x_first = max(current_cell[0] - 1, 0);
+  const int x_last = min(current_cell[0] + 1, cells_x - 1);
+
+  for (int base = own.x; base <= own.y; base += L) {
+    const int i = base + l;
+    const bool active = i <= own.y;
+    const float4 position = active ? LOAD4(predicted, i) : (float4) 0.0f;
+    const float scaling_i = active ? scaling[i] : 0.0f;
+
+    // Sum of lambdas
+    float3 sum = (float3) 0.0f;
+
+    for (int z = -1; z <= 1; ++z) {
+      for (int y = -1; y <= 1; ++y) {
+        const int neighbour_y = current_cell[1] + y;
+        const int neighbour_z = current_cell[2] + z;
+
+        if (neighbour_y < 0 || neighbour_y >= cells_y ||
+            neighbour_z < 0 || neighbour_z >= cells_z) {
+          continue;
+        }
+
+        // A span of cells in x is one range of the sorted particles
+        for (int x_span = x_first; x_span <= x_last;
+             x_span += span_cells) {
+          int first = END_OF_CELL_LIST;
+          int last = END_OF_CELL_LIST;
+
+          const int x_end = min(x_span + span_cells - 1, x_last);
+
+          for (int x = x_span; x <= x_end; ++x) {
+            const int2 cellRange = foundCells[CELL_INDEX(x, neighbour_y,
+                                                         neighbour_z)];
+
+            if (cellRange.x != END_OF_CELL_LIST) {
+              first = (first == END_OF_CELL_LIST) ? cellRange.x : first;
+              last = cellRange.y;
+            }
+          }
+
+          if (first == END_OF_CELL_LIST) continue;
+
+          for (int t = first; t <= last; t += L) {
+            const int count = min(L, last - t + 1);
+
+            barrier(CLK_LOCAL_MEM_FENCE);
+
+            if (l < count) {
+              tile[l] = (float4)(LOAD3(predicted, t + l), scaling[t + l]);
+            }
+
+            barrier(CLK_LOCAL_MEM_FENCE);
+
+            if (!active) continue;
+
+            for (int k = 0; k < count; ++k) {
+              if (t + k == i) continue;
+
+              float3 r = position.xyz - tile[k].xyz;
+              float r_length_2 = r.x * r.x + r.y * r.y + r.z * r.z;
+
+              if (r_length_2 > 0.0f && r_length_2 < PBF_H_2) {
+                float r_length = sqrt(r_length_2);
+                float3 gradient_spiky = -1.0f * r / (r_length)
+                                        * GRAD_SPIKY_FACTOR
+                                        * (PBF_H - r_length)
+                                        * (PBF_H - r_length);
+
+                // Sum for delta p of scaling factors and grad spiky
+                // in equation (12)
+                sum += (scaling_i + tile[k].w) * gradient_spiky;
+              }
+            }
+          }
+        }
+      }
+    }
+
+    if (!active) continue;
+
+    // equation (12)
+    float4 future = position + (float4)(sum / REST_DENSITY, 0.0f);
+
+    if ( (future.x - PBF_H) < (SYSTEM_MIN_X + wave_generator) ) {
+      future.x = SYSTEM_MIN_X + wave_generator + PBF_H;
+    } else if ( (future.x + PBF_H) > SYSTEM_MAX_X ) {
+      future.x = SYSTEM_MAX_X - PBF_H;
+    }
+    if ( (future.y - PBF_H) < SYSTEM_MIN_Y ) {
+      future.y = SYSTEM_MIN_Y + PBF_H;
+    } else if ( (future.y + PBF_H) > SYSTEM_MAX_Y ) {
+      future.y = SYSTEM_MAX_Y - PBF_H;
+    }
+    if ( (future.z - PBF_H) < SYSTEM_MIN_Z ) {
+      future.z = SYSTEM_MIN_Z + PBF_H;
+    } else if ( (future.z + PBF_H) > SYSTEM_MAX_Z ) {
+      future.z = SYSTEM_MAX_Z - PBF_H;
+    }
+
+#if defined(USE_FUSED_UPDATE)
+    STORE4(predictedOut, i, future);
+#else
+    STORE3(delta, i, future.xyz - position.xyz);
+#endif // USE_FUSED_UPDATE
+  }
+}
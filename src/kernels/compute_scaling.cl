@@ -1,6 +1,9 @@
-__kernel void computeScaling(__global float4 *predicted,
+__kernel void computeScaling(__global particle_t *predicted,
                              __global float *scaling,
-#if defined(USE_LINKEDCELL)
+#if defined(USE_NEIGHBOUR_LISTS)
+                             const __global int *neighbours,
+                             const __global int *neighbour_counts,
+#elif defined(USE_LINKEDCELL)
                              const __global int *cells,
                              const __global int *particles_list,
 #else
@@ -15,21 +18,60 @@ __kernel void computeScaling(__global float4 *predicted,
   const int END_OF_CELL_LIST = -1;
   const float e = 10000.0f;
 
+  const float3 position = LOAD3(predicted, i);
+
   // calculate $$$\Delta p_i$$$
+  // Sum of rho_i, |nabla p_k C_i|^2 and nabla p_k C_i for k = i
+  float density_sum = 0.0f;
+  float gradient_sum_k = 0.0f;
+  float3 gradient_sum_k_i = (float3) 0.0f;
+
+#if defined(USE_NEIGHBOUR_LISTS)
+  const int neighbour_count = neighbour_counts[i];
+
+  for (int k = 0; k < neighbour_count; ++k) {
+    const int next = neighbours[k * N + i];
+
+    if (i != next) {
+      float3 r = position - LOAD3(predicted, next);
+      float r_length_2 = (r.x * r.x + r.y * r.y + r.z * r.z);
+
+      // If h == r every term gets zero, so < h not <= h
+      if (r_length_2 > 0.0f && r_length_2 < PBF_H_2) {
+        float r_length = sqrt(r_length_2);
+
+        //CAUTION: the two spiky kernels are only the same
+        //because the result is only used sqaured
+        // equation (8), if k = i
+        float3 gradient_spiky = r / (r_length)
+                                * GRAD_SPIKY_FACTOR
+                                * (PBF_H - r_length)
+                                * (PBF_H - r_length);
+
+        // equation (2)
+        float poly6 = POLY6_FACTOR * (PBF_H_2 - r_length_2)
+                      * (PBF_H_2 - r_length_2)
+                      * (PBF_H_2 - r_length_2);
+        density_sum += poly6;
+
+        // equation (9), denominator, if k = j
+        gradient_sum_k += length(gradient_spiky);
+
+        // equation (8), if k = i
+        gradient_sum_k_i += gradient_spiky;
+      }
+    }
+  }
+#else
   int current_cell[3];
 
-  current_cell[0] = (int) ( (predicted[i].x - SYSTEM_MIN_X)
+  current_cell[0] = (int) ( (position.x - SYSTEM_MIN_X)
                             / CELL_LENGTH_X );
-  current_cell[1] = (int) ( (predicted[i].y - SYSTEM_MIN_Y)
+  current_cell[1] = (int) ( (position.y - SYSTEM_MIN_Y)
                             / CELL_LENGTH_Y );
-  current_cell[2] = (int) ( (predicted[i].z - SYSTEM_MIN_Z)
+  current_cell[2] = (int) ( (position.z - SYSTEM_MIN_Z)
                             / CELL_LENGTH_Z );
 
-  // Sum of rho_i, |nabla p_k C_i|^2 and nabla p_k C_i for k = i
-  float density_sum = 0.0f;
-  float gradient_sum_k = 0.0f;
-  float3 gradient_sum_k_i = (float3) 0.0f;
-
   for (int x = -1; x <= 1; ++x) {
     for (int y = -1; y <= 1; ++y) {
       for (int z = -1; z <= 1; ++z) {
@@ -45,17 +87,17 @@ __kernel void computeScaling(__global float4 *predicted,
           continue;
         }
 
-        uint cell_index = neighbour_cell[0] +
-                          neighbour_cell[1] * NUMBER_OF_CELLS_X +
-                          neighbour_cell[2] * NUMBER_OF_CELLS_X * NUMBER_OF_CELLS_Y;
+        uint cell_index = CELL_INDEX(neighbour_cell[0], neighbour_cell[1],
+                                     neighbour_cell[2]);
 
 #if defined(USE_LINKEDCELL)
         // Next particle in list
         int next = cells[cell_index];
 
         while (next != END_OF_CELL_LIST) {
-          if (i != next) {
-            float3 r = predicted[i].xyz - predicted[next].xyz;
+          if (i != next
+              && IN_CELL(LOAD3(predicted, next), neighbour_cell)) {
+            float3 r = position - LOAD3(predicted, next);
             float r_length_2 = (r.x * r.x + r.y * r.y + r.z * r.z);
 
             // If h == r every term gets zero, so < h not <= h
@@ -90,28 +132,35 @@ __kernel void computeScaling(__global float4 *predicted,
         int2 cellRange = foundCells[cell_index];
         if (cellRange.x == END_OF_CELL_LIST) continue;
 
-        for (uint r = cellRange.x; r <= cellRange.y; ++r) {
-          const int next = radixCells[r].y;
+        for (int n = cellRange.x; n <= cellRange.y; ++n) {
+#if defined(USE_SORTED_PARTICLES)
+          // Particle data is stored in the sorted order
+          const int next = n;
+#else
+          const int next = radixCells[n].y;
+#endif // USE_SORTED_PARTICLES
 
-          if (i != next) {
-            float3 r = predicted[i].xyz - predicted[next].xyz;
+          if (i != next
+              && IN_CELL(LOAD3(predicted, next), neighbour_cell)) {
+            float3 r = position - LOAD3(predicted, next);
             float r_length_2 = (r.x * r.x + r.y * r.y + r.z * r.z);
 
             // If h == r every term gets zero, so < h not <= h
-            if (r_length_2 > 0.0f && r_length_2 < h2) {
+            if (r_length_2 > 0.0f && r_length_2 < PBF_H_2) {
               float r_length = sqrt(r_length_2);
 
               //CAUTION: the two spiky kernels are only the same
               //because the result is only used sqaured
               // equation (8), if k = j
               float3 gradient_spiky = r / (r_length)
-                                      * gradSpiky_factor
-                                      * (h - r_length)
-                                      * (h - r_length);
+                                      * GRAD_SPIKY_FACTOR
+                                      * (PBF_H - r_length)
+                                      * (PBF_H - r_length);
 
               // equation (2)
-              float poly6 = poly6_factor * (h2 - r_length_2)
-                            * (h2 - r_length_2) * (h2 - r_length_2);
+              float poly6 = POLY6_FACTOR * (PBF_H_2 - r_length_2)
+                            * (PBF_H_2 - r_length_2)
+                            * (PBF_H_2 - r_length_2);
               density_sum += poly6;
 
               // equation (9), denominator, if k = j
@@ -122,15 +171,16 @@ __kernel void computeScaling(__global float4 *predicted,
             }
           }
         }
-#endif
+#endif // USE_LINKEDCELL
       }
     }
   }
+#endif // USE_NEIGHBOUR_LISTS
 
   // equation (9), denominator, if k = i
   gradient_sum_k += length(gradient_sum_k_i);
 
-  predicted[i].w = density_sum;
+  STORE_W(predicted, i, density_sum);
 
   // equation (1)
   float density_constraint = (density_sum / REST_DENSITY) - 1.0f;
@@ -0,0 +1,151 @@
+// computeScaling for particle data sorted by cell, one work-group per
+// cell. The particles of the neighbouring cells are staged into local
+// memory tile by tile and shared by all particles of the cell. With cells
+// numbered x fastest, the three cells of a row in x are one range.
+__kernel void computeScalingTiled(__global particle_t *predicted,
+                                  __global float *scaling,
+                                  const __global int2 *foundCells,
+                                  __local float4 *tile,
+                                  const int N) {
+  const int END_OF_CELL_LIST = -1;
+  const float e = 10000.0f;
+
+  const int cells_x = (int) NUMBER_OF_CELLS_X;
+  const int cells_y = (int) NUMBER_OF_CELLS_Y;
+  const int cells_z = (int) NUMBER_OF_CELLS_Z;
+
+  const int cell = get_group_id(0);
+  const int l = get_local_id(0);
+  const int L = get_local_size(0);
+
+  // Everything up to the loop over the tiles is uniform in the group,
+  // so all work-items reach the barriers
+  const int2 own = foundCells[cell];
+  if (own.x == END_OF_CELL_LIST) return;
+
+#if defined(USE_MORTON)
+  // Slots of keys outside the grid are empty and returned above
+  const int current_cell[3] = { mortonCompact(cell),
+                                mortonCompact(cell >> 1),
+                                mortonCompact(cell >> 2)
+                              };
+
+  // Morton keys interleave the cells of a row in x
+  const int span_cells = 1;
+#else
+  const int current_cell[3] = { cell % cells_x,
+                                (cell / cells_x) % cells_y,
+                                cell / (cells_x * cells_y)
+                              };
+
+  const int span_cells = 3;
+#endif // USE_MORTON
+
+  const int x_first = max(current_cell[0] - 1, 0);
+  const int x_last = min(current_cell[0] + 1, cells_x - 1);
+
+  // Cells with more particles than work-items take several rounds
+  for (int base = own.x; base <= own.y; base += L) {
+    const int i = base + l;
+    const bool active = i <= own.y;
+    const float3 position = active ? LOAD3(predicted, i) : (float3) 0.0f;
+
+    // Sum of rho_i, |nabla p_k C_i|^2 and nabla p_k C_i for k = i
+    float density_sum = 0.0f;
+    float gradient_sum_k = 0.0f;
+    float3 gradient_sum_k_i = (float3) 0.0f;
+
+    for (int z = -1; z <= 1; ++z) {
+      for (int y = -1; y <= 1; ++y) {
+        const int neighbour_y = current_cell[1] + y;
+        const int neighbour_z = current_cell[2] + z;
+
+        if (neighbour_y < 0 || neighbour_y >= cells_y ||
+            neighbour_z < 0 || neighbour_z >= cells_z) {
+          continue;
+        }
+
+        // A span of cells in x is one range of the sorted particles
+        for (int x_span = x_first; x_span <= x_last;
+             x_span += span_cells) {
+          int first = END_OF_CELL_LIST;
+          int last = END_OF_CELL_LIST;
+
+          const int x_end = min(x_span + span_cells - 1, x_last);
+
+          for (int x = x_span; x <= x_end; ++x) {
+            const int2 cellRange = foundCells[CELL_INDEX(x, neighbour_y,
+                                                         neighbour_z)];
+
+            if (cellRange.x != END_OF_CELL_LIST) {
+              first = (first == END_OF_CELL_LIST) ? cellRange.x : first;
+              last = cellRange.y;
+            }
+          }
+
+          if (first == END_OF_CELL_LIST) continue;
+
+          for (int t = first; t <= last; t += L) {
+            const int count = min(L, last - t + 1);
+
+            // The previous tile has been used by all work-items
+            barrier(CLK_LOCAL_MEM_FENCE);
+
+            if (l < count) {
+              tile[l] = (float4)(LOAD3(predicted, t + l), 0.0f);
+            }
+
+            barrier(CLK_LOCAL_MEM_FENCE);
+
+            if (!active) continue;
+
+            for (int k = 0; k < count; ++k) {
+              if (t + k == i) continue;
+
+              float3 r = position - tile[k].xyz;
+              float r_length_2 = (r.x * r.x + r.y * r.y + r.z * r.z);
+
+              // If h == r every term gets zero, so < h not <= h
+              if (r_length_2 > 0.0f && r_length_2 < PBF_H_2) {
+                float r_length = sqrt(r_length_2);
+
+                // equation (8), if k = i
+                float3 gradient_spiky = r / (r_length)
+                                        * GRAD_SPIKY_FACTOR
+                                        * (PBF_H - r_length)
+                                        * (PBF_H - r_length);
+
+                // equation (2)
+                float poly6 = POLY6_FACTOR * (PBF_H_2 - r_length_2)
+                              * (PBF_H_2 - r_length_2)
+                              * (PBF_H_2 - r_length_2);
+                density_sum += poly6;
+
+                // equation (9), denominator, if k = j
+                gradient_sum_k += length(gradient_spiky);
+
+                // equation (8), if k = i
+                gradient_sum_k_i += gradient_spiky;
+              }
+            }
+          }
+        }
+      }
+    }
+
+    if (active) {
+      // equation (9), denominator, if k = i
+      gradient_sum_k += length(gradient_sum_k_i);
+
+      STORE_W(predicted, i, density_sum);
+
+      // equation (1)
+      float density_constraint = (density_sum / REST_DENSITY) - 1.0f;
+
+      // equation (11)
+      scaling[i] = -1.0f * density_constraint
+                   / (gradient_sum_k * gradient_sum_k
+                      / (REST_DENSITY * REST_DENSITY) + e);
+    }
+  }
+}
@@ -0,0 +1,51 @@
+// Counting sort of the particles by cell, an alternative to the radix
+// passes as cell keys are bounded by the number of cells. countCells
+// ranks every particle within its cell, scan and paste turn the counts
+// into the first index of every cell and scatterCells writes the sorted
+// cells together with their ranges.
+
+__kernel void clearCellCounts(__global uint *counts,
+                              const uint N) {
+  const uint i = get_global_id(0);
+  if (i >= N) return;
+
+  counts[i] = 0;
+}
+
+__kernel void countCells(const __global particle_t *predicted,
+                         __global uint *counts,
+                         __global uint2 *cellRanks,
+                         const uint N) {
+  const uint i = get_global_id(0);
+  if (i >= N) return;
+
+  const int3 cell = gridCell( LOAD3(predicted, i) );
+  const uint cell_pos = CELL_INDEX(cell.x, cell.y, cell.z);
+
+  // The order within a cell is the order of the atomics
+  cellRanks[i] = (uint2)(cell_pos, atomic_inc(&counts[cell_pos]));
+}
+
+// offsets holds the exclusive scan of the counts, so offsets[numCells] is
+// the number of particles. Replaces initCells and findCells.
+__kernel void scatterCells(const __global uint2 *cellRanks,
+                           const __global uint *offsets,
+                           __global uint2 *radixCells,
+                           __global int2 *foundCells,
+                           const uint numParticles,
+                           const uint numCells) {
+  const uint i = get_global_id(0);
+
+  if (i < numParticles) {
+    const uint2 cellRank = cellRanks[i];
+
+    radixCells[offsets[cellRank.x] + cellRank.y] = (uint2)(cellRank.x, i);
+  }
+
+  if (i < numCells) {
+    const int first = offsets[i];
+    const int end = offsets[i + 1];
+
+    foundCells[i] = first < end ? (int2)(first, end - 1) : (int2)(-1, -1);
+  }
+}
@@ -0,0 +1,33 @@
+// Per work-group maximum and sum of the density error
+// max(rho / rho_0 - 1, 0), rho being the density computeScaling stored in
+// predicted.w. Underdense particles at the free surface are not counted.
+// The local size has to be a power of two.
+__kernel void densityError(const __global particle_t *predicted,
+                           __global float2 *groupError,
+                           __local float2 *scratch,
+                           const uint N) {
+  const uint l = get_local_id(0);
+  float2 result = (float2)(0.0f, 0.0f);
+
+  for (uint i = get_global_id(0); i < N; i += get_global_size(0)) {
+    const float error = max(LOAD_W(predicted, i) / REST_DENSITY - 1.0f, 0.0f);
+
+    result.x = max(result.x, error);
+    result.y += error;
+  }
+
+  scratch[l] = result;
+
+  for (uint d = get_local_size(0) / 2; d > 0; d >>= 1) {
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (l < d) {
+      scratch[l].x = max(scratch[l].x, scratch[l + d].x);
+      scratch[l].y += scratch[l + d].y;
+    }
+  }
+
+  if (l == 0) {
+    groupError[get_group_id(0)] = scratch[0];
+  }
+}
@@ -1,5 +1,5 @@
 __kernel void findCells(const __global uint2 *cells,
-                        const __global int2 *foundCells,
+                        __global int2 *foundCells,
                         const uint numParticles) {
   const int i = get_global_id(0);
   if (i >= numParticles) return;
@@ -0,0 +1,36 @@
+// Per work-group maximum of the squared distance between the positions
+// the next step will predict and the positions the neighbour lists were
+// built from. The local size has to be a power of two.
+__kernel void maxDisplacement(const __global particle_t *positions,
+                              const __global particle_t *velocities,
+                              const __global particle_t *buildPositions,
+                              __global float *groupMax,
+                              __local float *scratch,
+                              const uint N) {
+  const uint l = get_local_id(0);
+  float result = 0.0f;
+
+  for (uint i = get_global_id(0); i < N; i += get_global_size(0)) {
+    // Same as predictPositions of the next step
+    const float3 velocity = LOAD3(velocities, i)
+                            + TIMESTEP * (float3)(0.0f, -9.81f, 0.0f);
+    const float3 r = LOAD3(positions, i) + TIMESTEP * velocity
+                     - LOAD3(buildPositions, i);
+
+    result = max(result, dot(r, r));
+  }
+
+  scratch[l] = result;
+
+  for (uint d = get_local_size(0) / 2; d > 0; d >>= 1) {
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (l < d) {
+      scratch[l] = max(scratch[l], scratch[l + d]);
+    }
+  }
+
+  if (l == 0) {
+    groupMax[get_group_id(0)] = scratch[0];
+  }
+}
@@ -0,0 +1,54 @@
+// Gathers the particle data into the order of the sorted cells, so that
+// particles of the same cell are contiguous in memory
+__kernel void permuteParticles(const __global uint2 *radixCells,
+                               const __global particle_t *positions,
+                               const __global particle_t *predicted,
+                               const __global particle_t *velocities,
+                               const __global uint *ids,
+                               __global particle_t *positionsOut,
+                               __global particle_t *predictedOut,
+                               __global particle_t *velocitiesOut,
+                               __global uint *idsOut,
+                               const uint N) {
+  const uint i = get_global_id(0);
+  if (i >= N) return;
+
+  const uint from = radixCells[i].y;
+
+  STORE4(positionsOut, i, LOAD4(positions, from));
+  STORE4(predictedOut, i, LOAD4(predicted, from));
+  STORE4(velocitiesOut, i, LOAD4(velocities, from));
+  idsOut[i] = ids[from];
+}
+
+// Scatters permuted data back to the original particle order, the
+// output is always a float4 per particle
+__kernel void unpermuteParticles(const __global particle_t *data,
+                                 const __global uint *ids,
+                                 __global float4 *dataOut,
+                                 const uint N) {
+  const uint i = get_global_id(0);
+  if (i >= N) return;
+
+  dataOut[ids[i]] = LOAD4(data, i);
+}
+
+// Converts between the float4 per particle of the display buffer and
+// host transfers and the layout of the solver buffers
+__kernel void interleaveParticles(const __global particle_t *data,
+                                  __global float4 *dataOut,
+                                  const uint N) {
+  const uint i = get_global_id(0);
+  if (i >= N) return;
+
+  dataOut[i] = LOAD4(data, i);
+}
+
+__kernel void deinterleaveParticles(const __global float4 *data,
+                                    __global particle_t *dataOut,
+                                    const uint N) {
+  const uint i = get_global_id(0);
+  if (i >= N) return;
+
+  STORE4(dataOut, i, data[i]);
+}
@@ -1,10 +1,13 @@
-__kernel void predictPositions(const __global float4 *positions,
-                               __global float4 *predicted,
-                               __global float4 *velocities,
+__kernel void predictPositions(const __global particle_t *positions,
+                               __global particle_t *predicted,
+                               __global particle_t *velocities,
                                const uint N) {
   const uint i = get_global_id(0);
   if (i >= N) return;
 
-  velocities[i].xyz = velocities[i].xyz + TIMESTEP * (float3)(0.0f, -9.81f, 0.0f);
-  predicted[i].xyz = positions[i].xyz + TIMESTEP * velocities[i].xyz;
+  const float3 velocity = LOAD3(velocities, i)
+                          + TIMESTEP * (float3)(0.0f, -9.81f, 0.0f);
+
+  STORE3(velocities, i, velocity);
+  STORE3(predicted, i, LOAD3(positions, i) + TIMESTEP * velocity);
 }
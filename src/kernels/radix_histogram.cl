@@ -24,7 +24,8 @@ __kernel void histogram(const __global uint2 *radixCells,
   int size = numKeys / groups / items; // size of the sub-list
   int start = ig * size; // beginning of the sub-list
 
-  int key = 0, shortkey = 0, k = 0;
+  uint key = 0, shortkey = 0;
+  int k = 0;
 
   for (int j = 0; j < size; j++) {
     k = j + start;
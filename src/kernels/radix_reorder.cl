@@ -25,7 +25,8 @@ __kernel void reorder(const __global uint2 *radixCells,
 
   barrier(CLK_LOCAL_MEM_FENCE);
 
-  int newpos, key, shortkey, k, newpost;
+  uint newpos, key, shortkey;
+  int k;
 
   for (int j = 0; j < size; j++) {
     k = j + start;
@@ -33,11 +34,11 @@ __kernel void reorder(const __global uint2 *radixCells,
 
     shortkey = ((key >> (pass * _BITS)) & (_RADIX - 1));
 
-    newpost = local_histograms[shortkey * items + it];
+    // the scanned histogram holds the next free slot for this digit
+    newpos = local_histograms[shortkey * items + it];
 
-    cells[newpost] = radixCells[k]; // killing line !!!
+    cells[newpos] = radixCells[k];
 
-    newpos++;
-    local_histograms[shortkey * items + it] = newpos;
+    local_histograms[shortkey * items + it] = newpos + 1;
   }
 }
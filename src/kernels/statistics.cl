@@ -0,0 +1,161 @@
+// Reductions over a work-group, the local size has to be a power of two.
+// Every work-item gets the result, scratch holds a float per work-item.
+#define REDUCE_SUM 0
+#define REDUCE_MIN 1
+#define REDUCE_MAX 2
+
+float reduceGroup(const float value, __local float *scratch, const int op) {
+  const uint l = get_local_id(0);
+
+  scratch[l] = value;
+
+  for (uint d = get_local_size(0) / 2; d > 0; d >>= 1) {
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (l < d) {
+      const float other = scratch[l + d];
+
+      scratch[l] = op == REDUCE_SUM ? scratch[l] + other
+                   : op == REDUCE_MIN ? min(scratch[l], other)
+                   : max(scratch[l], other);
+    }
+  }
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+  const float result = scratch[0];
+
+  // The next reduction overwrites scratch
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  return result;
+}
+
+// Reduces value over the work-group into out[k]
+void storeReduced(__global float *out, const uint k, const float value,
+                  __local float *scratch, const int op) {
+  const float result = reduceGroup(value, scratch, op);
+
+  if (get_local_id(0) == 0) {
+    out[k] = result;
+  }
+}
+
+// How the entries of the statistics block combine, see hesp.hpp
+int statisticsOp(const uint k) {
+  if (k >= _STAT_BOX_MIN && k < _STAT_BOX_MIN + 3) {
+    return REDUCE_MIN;
+  }
+
+  if ( k == _STAT_MAX_SPEED2 || k == _STAT_DENSITY_ERROR_MAX
+       || (k >= _STAT_BOX_MAX && k < _STAT_BOX_MAX + 3) ) {
+    return REDUCE_MAX;
+  }
+
+  return REDUCE_SUM;
+}
+
+// Per work-group statistics block and density histogram of the state at
+// the end of a step. Velocities carry the mass in w, predicted the
+// density computeScaling stored last.
+__kernel void particleStatistics(const __global particle_t *positions,
+                                 const __global particle_t *velocities,
+                                 const __global particle_t *predicted,
+                                 __global float *groupValues,
+                                 __global uint *groupHistogram,
+                                 __local float *scratch,
+                                 const uint N) {
+  __local uint histogram[_STAT_BINS];
+
+  const uint l = get_local_id(0);
+
+  for (uint b = l; b < _STAT_BINS; b += get_local_size(0)) {
+    histogram[b] = 0;
+  }
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  float mass = 0.0f;
+  float energy = 0.0f;
+  float speed2 = 0.0f;
+  float errorSum = 0.0f;
+  float errorMax = 0.0f;
+  float3 massPosition = (float3)(0.0f, 0.0f, 0.0f);
+  // Relaxed math has no infinities
+  float3 boxMin = (float3)(MAXFLOAT, MAXFLOAT, MAXFLOAT);
+  float3 boxMax = (float3)(-MAXFLOAT, -MAXFLOAT, -MAXFLOAT);
+
+  for (uint i = get_global_id(0); i < N; i += get_global_size(0)) {
+    const float3 x = LOAD3(positions, i);
+    const float3 v = LOAD3(velocities, i);
+    const float m = LOAD_W(velocities, i);
+    const float ratio = LOAD_W(predicted, i) / REST_DENSITY;
+    // Underdense particles at the free surface count as no error
+    const float error = max(ratio - 1.0f, 0.0f);
+
+    mass += m;
+    energy += 0.5f * m * dot(v, v);
+    speed2 = max(speed2, dot(v, v));
+    errorSum += error;
+    errorMax = max(errorMax, error);
+    massPosition += m * x;
+    boxMin = min(boxMin, x);
+    boxMax = max(boxMax, x);
+
+    atomic_inc(&histogram[densityBin(ratio)]);
+  }
+
+  __global float *out = groupValues + get_group_id(0) * _STAT_VALUES;
+
+  storeReduced(out, _STAT_MASS, mass, scratch, REDUCE_SUM);
+  storeReduced(out, _STAT_KINETIC_ENERGY, energy, scratch, REDUCE_SUM);
+  storeReduced(out, _STAT_MAX_SPEED2, speed2, scratch, REDUCE_MAX);
+  storeReduced(out, _STAT_DENSITY_ERROR_SUM, errorSum, scratch, REDUCE_SUM);
+  storeReduced(out, _STAT_DENSITY_ERROR_MAX, errorMax, scratch, REDUCE_MAX);
+  storeReduced(out, _STAT_MASS_POSITION, massPosition.x, scratch, REDUCE_SUM);
+  storeReduced(out, _STAT_MASS_POSITION + 1, massPosition.y, scratch,
+               REDUCE_SUM);
+  storeReduced(out, _STAT_MASS_POSITION + 2, massPosition.z, scratch,
+               REDUCE_SUM);
+  storeReduced(out, _STAT_BOX_MIN, boxMin.x, scratch, REDUCE_MIN);
+  storeReduced(out, _STAT_BOX_MIN + 1, boxMin.y, scratch, REDUCE_MIN);
+  storeReduced(out, _STAT_BOX_MIN + 2, boxMin.z, scratch, REDUCE_MIN);
+  storeReduced(out, _STAT_BOX_MAX, boxMax.x, scratch, REDUCE_MAX);
+  storeReduced(out, _STAT_BOX_MAX + 1, boxMax.y, scratch, REDUCE_MAX);
+  storeReduced(out, _STAT_BOX_MAX + 2, boxMax.z, scratch, REDUCE_MAX);
+
+  // The reductions ended with a barrier, the histogram is complete
+  for (uint b = l; b < _STAT_BINS; b += get_local_size(0)) {
+    groupHistogram[get_group_id(0) * _STAT_BINS + b] = histogram[b];
+  }
+}
+
+// Combines the blocks of particleStatistics into one, run as a single
+// work-group of a power of two work-items, at least one per block
+__kernel void combineStatistics(const __global float *groupValues,
+                                const __global uint *groupHistogram,
+                                __global float *values,
+                                __global uint *histogram,
+                                __local float *scratch,
+                                const uint groups) {
+  const uint l = get_local_id(0);
+
+  for (uint k = 0; k < _STAT_VALUES; ++k) {
+    const int op = statisticsOp(k);
+    const float identity = op == REDUCE_SUM ? 0.0f
+                           : op == REDUCE_MIN ? MAXFLOAT : -MAXFLOAT;
+
+    storeReduced(values, k,
+                 l < groups ? groupValues[l * _STAT_VALUES + k] : identity,
+                 scratch, op);
+  }
+
+  for (uint b = l; b < _STAT_BINS; b += get_local_size(0)) {
+    uint count = 0;
+
+    for (uint g = 0; g < groups; ++g) {
+      count += groupHistogram[g * _STAT_BINS + b];
+    }
+
+    histogram[b] = count;
+  }
+}
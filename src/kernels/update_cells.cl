@@ -1,4 +1,4 @@
-__kernel void updateCells(const __global float4 *predicted,
+__kernel void updateCells(const __global particle_t *predicted,
                           __global int *cells,
                           __global int *particles_list,
                           const uint N) {
@@ -6,13 +6,21 @@ __kernel void updateCells(const __global float4 *predicted,
   const uint i = get_global_id(0);
   if (i >= N) return;
 
-  // Get cell that belongs to particle
-  uint cell_pos = (int) ( (predicted[i].x - SYSTEM_MIN_X)
-                          / CELL_LENGTH_X )
-                  + (int) ( (predicted[i].y - SYSTEM_MIN_Y)
-                            / CELL_LENGTH_Y ) * NUMBER_OF_CELLS_X
-                  + (int) ( (predicted[i].z - SYSTEM_MIN_Z)
-                            / CELL_LENGTH_Z ) * NUMBER_OF_CELLS_X * NUMBER_OF_CELLS_Y;
+  const float3 position = LOAD3(predicted, i);
+
+  // Get cell that belongs to particle, clamped like calcHash so particles
+  // outside the domain never write beyond the cells
+  const int cell_x = clamp( (int) ( (position.x - SYSTEM_MIN_X)
+                                    / CELL_LENGTH_X ),
+                            0, (int) NUMBER_OF_CELLS_X - 1 );
+  const int cell_y = clamp( (int) ( (position.y - SYSTEM_MIN_Y)
+                                    / CELL_LENGTH_Y ),
+                            0, (int) NUMBER_OF_CELLS_Y - 1 );
+  const int cell_z = clamp( (int) ( (position.z - SYSTEM_MIN_Z)
+                                    / CELL_LENGTH_Z ),
+                            0, (int) NUMBER_OF_CELLS_Z - 1 );
+
+  uint cell_pos = CELL_INDEX(cell_x, cell_y, cell_z);
 
   // Exchange cells[cell_pos] and particle_list at i
   particles_list[i] = atomic_xchg(&cells[cell_pos], i);
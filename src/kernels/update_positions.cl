@@ -1,15 +1,17 @@
-__kernel void updatePositions(__global float4 *positions,
-                              const __global float4 *predicted,
-                              __global float4 *velocities,
-                              const __global float4 *deltaVelocities,
+__kernel void updatePositions(__global particle_t *positions,
+                              const __global particle_t *predicted,
+                              __global particle_t *velocities,
+                              const __global particle_t *deltaVelocities,
                               const uint N) {
   const uint i = get_global_id(0);
   if (i >= N) return;
 
-  positions[i].xyz = predicted[i].xyz;
-  velocities[i].xyz += deltaVelocities[i].xyz;
+  const float3 velocity = LOAD3(velocities, i) + LOAD3(deltaVelocities, i);
 
-  positions[i].w = length(velocities[i].xyz);
+  STORE3(positions, i, LOAD3(predicted, i));
+  STORE3(velocities, i, velocity);
+
+  STORE_W(positions, i, length(velocity));
 
   // #if defined(USE_DEBUG)
   // printf("%d: pos:[%f,%f,%f]\nvel: [%f,%f,%f]\n", i,
@@ -1,10 +1,10 @@
-__kernel void updatePredicted(__global float4 *predicted,
-                              const __global float4 *delta,
+__kernel void updatePredicted(__global particle_t *predicted,
+                              const __global particle_t *delta,
                               const uint N) {
   const uint i = get_global_id(0);
   if (i >= N) return;
 
-  predicted[i].xyz = predicted[i].xyz + delta[i].xyz;
+  STORE3(predicted, i, LOAD3(predicted, i) + LOAD3(delta, i));
 
   // #if defined(USE_DEBUG)
   //     // printf("UPDATE_PREDICTED: %d: predict:[%f,%f,%f]\n",
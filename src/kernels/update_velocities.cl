@@ -1,11 +1,12 @@
-__kernel void updateVelocities(const __global float4 *positions,
-                               const __global float4 *predicted,
-                               __global float4 *velocities,
+__kernel void updateVelocities(const __global particle_t *positions,
+                               const __global particle_t *predicted,
+                               __global particle_t *velocities,
                                const uint N) {
   const uint i = get_global_id(0);
   if (i >= N) return;
 
-  velocities[i].xyz = (predicted[i].xyz - positions[i].xyz) / TIMESTEP;
+  STORE3(velocities, i,
+         (LOAD3(predicted, i) - LOAD3(positions, i)) / TIMESTEP);
 
   // #if defined(USE_DEBUG)
   // printf("updateVelocites: i,t: %d,%f\npos: [%f,%f,%f]\npredict: [%f,%f,%f]\nvel: [%f,%f,%f]\n",
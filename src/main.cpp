@@ -5,6 +5,7 @@
 #include <fstream>
 #include <stdexcept>
 #include <sstream>
+#include <sys/stat.h>
 
 #if defined(__APPLE__)
 #include <OpenGL/OpenGL.h>
@@ -16,12 +17,17 @@
 
 #include "hesp.hpp"
 #include "ocl/clsetup.hpp"
+#include "ocl/programcache.hpp"
 #include "io/ConfigReader.hpp"
+#include "io/CommandLineParser.hpp"
 #include "io/PartReader.hpp"
+#include "io/PbfFile.hpp"
 #include "visual/visual.hpp"
 #include "Simulation.hpp"
 #include "Runner.hpp"
+#include "HeadlessRunner.hpp"
 #include "DataLoader.hpp"
+#include "cpu/CpuSimulation.hpp"
 
 static const int WINDOW_WIDTH = 1280;
 static const int WINDOW_HEIGHT = 720;
@@ -37,72 +43,118 @@ using std::string;
 using std::exception;
 using std::runtime_error;
 
-int main() {
+int main(int argc, char **argv) {
+  CommandLineParser commandLineParser;
+
   try {
+    const CommandLineOptions options = commandLineParser.parse(argc, argv);
+    const bool headless = options.headless;
+
+    if (options.help) {
+      commandLineParser.printUsage(cout, argv[0]);
+      return 0;
+    }
+
+    if (options.listDevices) {
+      CSetupCL clSetup;
+      clSetup.listDevices(cout);
+      return 0;
+    }
+
     DataLoader dataLoader;
-    // Reading the configuration file
-    string parameters_filename = dataLoader.getPathForScenario("dam_coarse.par");
+    // Reading the configuration file, scenarios with a path are read as is
+    string parameters_filename = options.scenario;
+
+    if (parameters_filename.find('/') == string::npos) {
+      parameters_filename = dataLoader.getPathForScenario(options.scenario);
+    }
+
     cout << parameters_filename << endl;
     ConfigReader configReader;
     ConfigParameters parameters = configReader.read(parameters_filename);
 
-    // reading the part(particle) file
-    string part_filename = dataLoader.getPathForScenario(parameters.partInputFile);
+    commandLineParser.apply(options, parameters);
+
+    // Already existing is fine, anything else shows when writing output
+    if ( !options.outputDirectory.empty() ) {
+      mkdir(options.outputDirectory.c_str(), 0755);
+    }
+
+    ConfigReader::check(parameters);
+
+    // reading the part(particle) file, relative to the directory of a
+    // scenario given as a path
+    string part_filename = parameters.partInputFile;
+
+    if ( part_filename.empty() || part_filename[0] != '/' ) {
+      const size_t slash = parameters_filename.rfind('/');
+
+      if (options.scenario.find('/') == string::npos) {
+        part_filename = dataLoader.getPathForScenario(part_filename);
+      } else if (slash != string::npos) {
+        part_filename = parameters_filename.substr(0, slash + 1)
+                        + part_filename;
+      }
+    }
+
     cout << part_filename << endl;
-    PartReader partReader;
-    vector<Particle> particles = partReader.read(part_filename);
+    // .pbf files are memory mapped, everything else is read as text
+    vector<Particle> particleVector;
+    PbfFile pbfFile;
+    ParticleView particles;
+
+    if ( PbfFile::isPbf(part_filename) ) {
+      pbfFile.open(part_filename);
+      particles = pbfFile.view();
+    } else {
+      PartReader partReader;
+      particleVector = partReader.read(part_filename);
+      particles = ParticleView(particleVector);
+    }
+
+    if (options.useCpuBackend) {
+      CpuSimulation simulation(parameters, particles, options.numThreads,
+                               options.schedule);
+      simulation.setProfiling(options.profile);
+
+      HeadlessRunner runner;
+      runner.run(parameters, simulation);
+
+      return 0;
+    }
 
     // For visualization
     CVisual renderer(&dataLoader, WINDOW_WIDTH, WINDOW_HEIGHT);
-    renderer.initWindow("HESP Project");
-    GLuint sharingBufferID = renderer.createSharingBuffer( particles.size()
-                             * sizeof(cl_float4) );
+    GLuint sharingBufferID = 0;
+    GLuint renderBufferID = 0;
+
+    if (!headless) {
+      renderer.initWindow("HESP Project");
+      // Steps alternate between both, one is drawn while the other is
+      // written
+      sharingBufferID = renderer.createSharingBuffer( particles.size()
+                        * sizeof(cl_float4) );
+      renderBufferID = renderer.createSharingBuffer( particles.size()
+                       * sizeof(cl_float4) );
+    }
 
     // setup kernel sources
     CSetupCL clSetup;
     vector<string> kernelSources;
     string header = clSetup.readSource(dataLoader.getPathForKernel("hesp.hpp"));
-    string source;
-
-    source = clSetup.readSource(dataLoader.getPathForKernel("predict_positions.cl"));
-    kernelSources.push_back(header + source);
-    source = clSetup.readSource(dataLoader.getPathForKernel("init_cells_old.cl"));
-    kernelSources.push_back(header + source);
-    source = clSetup.readSource(dataLoader.getPathForKernel("update_cells.cl"));
-    kernelSources.push_back(header + source);
-    source = clSetup.readSource(dataLoader.getPathForKernel("compute_scaling.cl"));
-    kernelSources.push_back(header + source);
-    source = clSetup.readSource(dataLoader.getPathForKernel("compute_delta.cl"));
-    kernelSources.push_back(header + source);
-    source = clSetup.readSource(dataLoader.getPathForKernel("update_predicted.cl"));
-    kernelSources.push_back(header + source);
-    source = clSetup.readSource(dataLoader.getPathForKernel("update_velocities.cl"));
-    kernelSources.push_back(header + source);
-    source = clSetup.readSource(dataLoader.getPathForKernel("apply_vorticity_and_viscosity.cl"));
-    kernelSources.push_back(header + source);
-    source = clSetup.readSource(dataLoader.getPathForKernel("update_positions.cl"));
-    kernelSources.push_back(header + source);
-    source = clSetup.readSource(dataLoader.getPathForKernel("calc_hash.cl"));
-    kernelSources.push_back(header + source);
-#if !defined(USE_LINKEDCELL)
-    source = clSetup.readSource(dataLoader.getPathForKernel("radix_histogram.cl"));
-    kernelSources.push_back(header + source);
-    source = clSetup.readSource(dataLoader.getPathForKernel("radix_scan.cl"));
-    kernelSources.push_back(header + source);
-    source = clSetup.readSource(dataLoader.getPathForKernel("radix_paste.cl"));
-    kernelSources.push_back(header + source);
-    source = clSetup.readSource(dataLoader.getPathForKernel("radix_reorder.cl"));
-    kernelSources.push_back(header + source);
-    source = clSetup.readSource(dataLoader.getPathForKernel("init_cells.cl"));
-    kernelSources.push_back(header + source);
-    source = clSetup.readSource(dataLoader.getPathForKernel("find_cells.cl"));
-    kernelSources.push_back(header + source);
-#endif
+    const vector<string> kernelFiles = Simulation::kernelFiles();
+
+    for (vector<string>::const_iterator cit = kernelFiles.begin();
+         cit != kernelFiles.end(); ++cit) {
+      kernelSources.push_back( header + clSetup.readSource(
+                                 dataLoader.getPathForKernel(*cit) ) );
+    }
 
     cout << "Setting up OpenCL..." << endl;
 
-    cl::Platform platform = clSetup.selectPlatform();
-    //cl::Platform platform = clSetup.getPlatforms()[1];
+    // Never asks, batch jobs have no one to answer
+    cl::Platform platform = clSetup.selectPlatform(options.platform);
+    cout << "Using platform: " << platform.getInfo<CL_PLATFORM_NAME>() << endl;
 
 #if defined(__APPLE__)
     CGLContextObj glContext = CGLGetCurrentContext();
@@ -111,6 +163,7 @@ int main() {
     cl_context_properties properties[] = {
       CL_CONTEXT_PROPERTY_USE_CGL_SHAREGROUP_APPLE,
       (cl_context_properties)shareGroup,
+      CL_CONTEXT_PLATFORM, (cl_context_properties) (platform)(),
       0
     };
 #elif defined(UNIX)
@@ -129,53 +182,58 @@ int main() {
     };
 #endif // __APPLE__
 
-    vector<cl::Device> devices;
-    // Get a vector of devices on this platform
-    platform.getDevices(CL_DEVICE_TYPE_GPU, &devices);
-    cl::Device device = devices.at(0);
-    cl::Context context = clSetup.createContext(properties);
-
-    std::ostringstream clflags;
-    clflags << "-cl-mad-enable -cl-no-signed-zeros -cl-fast-relaxed-math ";
-
-#ifdef USE_DEBUG
-    clflags << "-DUSE_DEBUG ";
-#endif // USE_DEBUG
-
-#ifdef USE_LINKEDCELL
-    clflags << "-DUSE_LINKEDCELL ";
-#endif // USE_LINKEDCELL
-
-    clflags << std::showpoint;
-    clflags << "-DSYSTEM_MIN_X=" << parameters.xMin << "f ";
-    clflags << "-DSYSTEM_MAX_X=" << parameters.xMax << "f ";
-    clflags << "-DSYSTEM_MIN_Y=" << parameters.yMin << "f ";
-    clflags << "-DSYSTEM_MAX_Y=" << parameters.yMax << "f ";
-    clflags << "-DSYSTEM_MIN_Z=" << parameters.zMin << "f ";
-    clflags << "-DSYSTEM_MAX_Z=" << parameters.zMax << "f ";
-    clflags << "-DNUMBER_OF_CELLS_X=" << parameters.xN << "f ";
-    clflags << "-DNUMBER_OF_CELLS_Y=" << parameters.yN << "f ";
-    clflags << "-DNUMBER_OF_CELLS_Z=" << parameters.zN << "f ";
-    clflags << "-DCELL_LENGTH_X=" << (parameters.xMax - parameters.xMin) / parameters.xN << "f ";
-    clflags << "-DCELL_LENGTH_Y=" << (parameters.yMax - parameters.yMin) / parameters.yN << "f ";
-    clflags << "-DCELL_LENGTH_Z=" << (parameters.zMax - parameters.zMin) / parameters.zN << "f ";
-    clflags << "-DTIMESTEP=" << parameters.timeStepLength << "f ";
-    clflags << "-DREST_DENSITY=" << parameters.restDensity << "f ";
-    float h = (parameters.xMax - parameters.xMin) / parameters.xN;
-    clflags << "-DPBF_H=" << h << "f ";
-    clflags << "-DPBF_H_2=" << pow(h, 2) << "f ";
-    clflags << "-DPOLY6_FACTOR=" << 315.0f / (64.0f * M_PI * pow(h, 9)) << "f ";
-    clflags << "-DGRAD_SPIKY_FACTOR=" << 45.0f / (M_PI * pow(h, 6)) << "f ";
-
-    cl::Program program = clSetup.createProgram(kernelSources, context,
-                          device, clflags.str());
+    // Headless any device will do, e.g. a CPU runtime such as POCL,
+    // sharing with OpenGL needs the GPU
+    cl_device_type deviceType = headless ? CL_DEVICE_TYPE_ALL
+                                : CL_DEVICE_TYPE_GPU;
+
+    if (options.deviceType == "gpu") {
+      deviceType = CL_DEVICE_TYPE_GPU;
+    } else if (options.deviceType == "cpu") {
+      deviceType = CL_DEVICE_TYPE_CPU;
+    } else if (options.deviceType == "accelerator") {
+      deviceType = CL_DEVICE_TYPE_ACCELERATOR;
+    } else if (options.deviceType == "all") {
+      deviceType = CL_DEVICE_TYPE_ALL;
+    }
+
+    cl::Device device = clSetup.selectDevice(platform, deviceType,
+                        options.device);
+    cl::Context context;
+
+    if (headless) {
+      context = cl::Context( vector<cl::Device>(1, device) );
+    } else {
+      // The context shares with OpenGL, so it has to hold the selected
+      // device and that has to be the GPU driving the window
+      if ( !(device.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_GPU) ) {
+        throw runtime_error("Sharing buffers with OpenGL needs a GPU device, "
+                            "use --headless for other devices");
+      }
+
+      context = cl::Context(vector<cl::Device>(1, device), properties);
+    }
+
+    cout << "Using device: " << device.getInfo<CL_DEVICE_NAME>() << endl;
+
+    ProgramCache programCache(options.kernelCache);
+    cl::Program program = programCache.build(clSetup, kernelSources, context,
+                          platform, device,
+                          Simulation::buildOptions( parameters, particles.size() ));
 
     map<string, cl::Kernel> kernels = clSetup.createKernelsMap(program);
     Simulation simulation(parameters, particles, kernels,
-                          context, device, sharingBufferID);
-
-    Runner runner;
-    runner.run(parameters, simulation, renderer);
+                          context, device, sharingBufferID,
+                          renderBufferID);
+    simulation.setProfiling(options.profile);
+
+    if (headless) {
+      HeadlessRunner runner;
+      runner.run(parameters, simulation);
+    } else {
+      Runner runner;
+      runner.run(parameters, simulation, renderer);
+    }
 
   } catch (const cl::Error &ecl) {
     cerr << "OpenCL Error caught: " << ecl.what() << "(" << ecl.err() << ")" << endl;
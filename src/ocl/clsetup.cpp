@@ -1,5 +1,7 @@
 #include "clsetup.hpp"
 
+#include <cstdlib>
+
 
 using std::string;
 using std::vector;
@@ -127,6 +129,53 @@ CSetupCL::selectPlatform(void) const {
   return platforms.at(platformID);
 }
 
+// Index of the selected name: a number is an index, anything else the
+// first name containing it
+static size_t
+matchSelector(const string &selector, const vector<string> &names,
+              const string &what) {
+  if (selector.empty()) {
+    return 0;
+  }
+
+  if (selector.find_first_not_of("0123456789") == string::npos) {
+    const size_t index = atoi( selector.c_str() );
+
+    if ( index >= names.size() ) {
+      throw runtime_error("No " + what + " with index " + selector);
+    }
+
+    return index;
+  }
+
+  for (size_t i = 0; i < names.size(); ++i) {
+    if (names[i].find(selector) != string::npos) {
+      return i;
+    }
+  }
+
+  throw runtime_error("No " + what + " matches " + selector);
+}
+
+cl::Platform
+CSetupCL::selectPlatform(const string &selector) const {
+  vector<cl::Platform> platforms;
+  vector<string> names;
+
+  cl::Platform::get(&platforms);
+
+  if (platforms.size() == 0) {
+    throw runtime_error("No platforms found.");
+  }
+
+  for (vector<cl::Platform>::const_iterator cit = platforms.begin();
+       cit != platforms.end(); ++cit) {
+    names.push_back( cit->getInfo<CL_PLATFORM_NAME>() );
+  }
+
+  return platforms.at( matchSelector(selector, names, "platform") );
+}
+
 cl::Context
 CSetupCL::createContext(cl_context_properties properties[],
                         const cl_device_type deviceType) const {
@@ -242,6 +291,53 @@ CSetupCL::selectDevice(const cl::Platform &platform,
   return devices.at(deviceID);
 }
 
+cl::Device
+CSetupCL::selectDevice(const cl::Platform &platform,
+                       const cl_device_type deviceType,
+                       const string &selector) const {
+  vector<cl::Device> devices;
+  vector<string> names;
+
+  platform.getDevices(deviceType, &devices);
+
+  if (devices.size() == 0) {
+    throw runtime_error("No devices found!");
+  }
+
+  for (vector<cl::Device>::const_iterator cit = devices.begin();
+       cit != devices.end(); ++cit) {
+    names.push_back( cit->getInfo<CL_DEVICE_NAME>() );
+  }
+
+  return devices.at( matchSelector(selector, names, "device") );
+}
+
+void
+CSetupCL::listDevices(ostream &os) const {
+  vector<cl::Platform> platforms;
+
+  cl::Platform::get(&platforms);
+
+  for (size_t p = 0; p < platforms.size(); ++p) {
+    os << "Platform #" << p << ": "
+       << platforms[p].getInfo<CL_PLATFORM_NAME>() << endl;
+
+    vector<cl::Device> devices;
+
+    // Platforms without devices report an error instead of none
+    try {
+      platforms[p].getDevices(CL_DEVICE_TYPE_ALL, &devices);
+    } catch (const cl::Error &e) {
+      continue;
+    }
+
+    for (size_t d = 0; d < devices.size(); ++d) {
+      os << "  Device #" << d << ": "
+         << devices[d].getInfo<CL_DEVICE_NAME>() << endl;
+    }
+  }
+}
+
 string
 CSetupCL::readSource(const string &filename) const {
   ifstream ifs( filename.c_str() );
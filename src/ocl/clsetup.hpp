@@ -43,6 +43,13 @@ public:
   cl::Platform
   selectPlatform(void) const;
 
+  /**
+   *  \brief  Selects a platform by index or name substring without
+   *          asking, the first one if the selector is empty.
+   */
+  cl::Platform
+  selectPlatform(const string &selector) const;
+
   /**
    *  \brief  Return a context from properties.
    */
@@ -83,6 +90,21 @@ public:
   selectDevice(const cl::Platform &platform,
                const cl_device_type deviceType = CL_DEVICE_TYPE_ALL) const;
 
+  /**
+   *  \brief  Selects a device of the platform by index or name substring
+   *          without asking, the first one if the selector is empty.
+   */
+  cl::Device
+  selectDevice(const cl::Platform &platform,
+               const cl_device_type deviceType,
+               const string &selector) const;
+
+  /**
+   *  \brief  Prints the index and name of all platforms and devices.
+   */
+  void
+  listDevices(ostream &os) const;
+
   /**
    *  \brief  Creates a program from kernel filenames, context and devices.
    */
@@ -0,0 +1,157 @@
+#include "programcache.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <cstdio>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+using std::ifstream;
+using std::ofstream;
+using std::ostringstream;
+using std::istreambuf_iterator;
+using std::cout;
+using std::cerr;
+using std::endl;
+
+
+// 64 bit FNV-1a, fed with each part and a separator
+static void
+hashString(cl_ulong &hash, const string &value) {
+  static const cl_ulong prime = 1099511628211ULL;
+
+  for (size_t i = 0; i < value.size(); ++i) {
+    hash ^= (unsigned char) value[i];
+    hash *= prime;
+  }
+
+  hash ^= 0xff;
+  hash *= prime;
+}
+
+cl::Program
+ProgramCache::build(const CSetupCL &clSetup,
+                    const vector<string> &sources,
+                    const cl::Context &context,
+                    const cl::Platform &platform,
+                    const cl::Device &device,
+                    const string &compileOptions) const {
+  if ( mDirectory.empty() ) {
+    return clSetup.createProgram(sources, context, device, compileOptions);
+  }
+
+  const string file = this->filename(sources, platform, device,
+                                     compileOptions);
+
+  cl::Program program = this->load(file, context, device, compileOptions);
+
+  if (program() != NULL) {
+    cout << "Kernel binary loaded: " << file << endl;
+    return program;
+  }
+
+  program = clSetup.createProgram(sources, context, device, compileOptions);
+
+  this->store(file, program);
+
+  return program;
+}
+
+string
+ProgramCache::filename(const vector<string> &sources,
+                       const cl::Platform &platform,
+                       const cl::Device &device,
+                       const string &compileOptions) const {
+  cl_ulong hash = 14695981039346656037ULL;
+
+  for (vector<string>::const_iterator cit = sources.begin();
+       cit != sources.end(); ++cit) {
+    hashString(hash, *cit);
+  }
+
+  hashString(hash, compileOptions);
+  hashString( hash, platform.getInfo<CL_PLATFORM_NAME>() );
+  hashString( hash, platform.getInfo<CL_PLATFORM_VERSION>() );
+  hashString( hash, device.getInfo<CL_DEVICE_NAME>() );
+  hashString( hash, device.getInfo<CL_DEVICE_VENDOR>() );
+  hashString( hash, device.getInfo<CL_DEVICE_VERSION>() );
+  hashString( hash, device.getInfo<CL_DRIVER_VERSION>() );
+
+  ostringstream oss;
+  oss << mDirectory << "/" << std::hex << std::setw(16)
+      << std::setfill('0') << hash << ".bin";
+
+  return oss.str();
+}
+
+cl::Program
+ProgramCache::load(const string &filename,
+                   const cl::Context &context,
+                   const cl::Device &device,
+                   const string &compileOptions) const {
+  ifstream ifs(filename.c_str(), std::ios::binary);
+
+  if ( !ifs.is_open() ) {
+    return cl::Program();
+  }
+
+  const vector<char> binary( (istreambuf_iterator<char>(ifs)),
+                             istreambuf_iterator<char>() );
+
+  if ( binary.empty() ) {
+    return cl::Program();
+  }
+
+  const vector<cl::Device> devices(1, device);
+  cl::Program::Binaries binaries(1, std::make_pair( (const void *) &binary[0],
+                                 binary.size() ));
+
+  // Binaries of another driver build are rejected, compile them again
+  try {
+    cl::Program program(context, devices, binaries);
+    program.build( devices, compileOptions.c_str() );
+
+    return program;
+  } catch (const cl::Error &e) {
+    cerr << "Kernel binary " << filename << " not usable (" << e.err()
+         << "), building from source." << endl;
+  }
+
+  return cl::Program();
+}
+
+void
+ProgramCache::store(const string &filename,
+                    const cl::Program &program) const {
+  const vector<size_t> sizes = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
+
+  if (sizes.size() != 1 || sizes[0] == 0) {
+    return;
+  }
+
+  vector<char> binary(sizes[0]);
+  vector<char *> binaries(1, &binary[0]);
+  program.getInfo(CL_PROGRAM_BINARIES, &binaries);
+
+  // Already existing is fine, anything else shows when writing
+  mkdir(mDirectory.c_str(), 0755);
+
+  // Concurrent runs never read a partially written binary
+  ostringstream tmp;
+  tmp << filename << "." << getpid() << ".tmp";
+
+  ofstream ofs(tmp.str().c_str(), std::ios::binary);
+  ofs.write( &binary[0], binary.size() );
+  ofs.close();
+
+  if ( !ofs || std::rename( tmp.str().c_str(), filename.c_str() ) != 0 ) {
+    cerr << "Could not store kernel binary: " << filename << endl;
+    std::remove( tmp.str().c_str() );
+    return;
+  }
+
+  cout << "Kernel binary stored: " << filename << endl;
+}
@@ -0,0 +1,66 @@
+#ifndef __PROGRAMCACHE_HPP
+#define __PROGRAMCACHE_HPP
+
+#include <string>
+#include <vector>
+
+#include "../hesp.hpp"
+#include "clsetup.hpp"
+
+
+using std::string;
+using std::vector;
+
+
+/**
+ *  \brief  On-disk cache of program binaries.
+ *
+ *  Binaries are keyed by a hash of the sources, the compile options,
+ *  the platform and the device including its driver version. A miss or
+ *  a binary the device rejects falls back to building from source and
+ *  stores the result.
+ */
+class ProgramCache {
+private:
+  // Avoid copy
+  ProgramCache &operator=(const ProgramCache &other);
+  ProgramCache (const ProgramCache &other);
+
+public:
+  /**
+   *  \brief  An empty directory disables the cache.
+   */
+  explicit ProgramCache(const string &directory) : mDirectory(directory) {}
+
+  /**
+   *  \brief  Returns the program built for the device.
+   */
+  cl::Program
+  build(const CSetupCL &clSetup,
+        const vector<string> &sources,
+        const cl::Context &context,
+        const cl::Platform &platform,
+        const cl::Device &device,
+        const string &compileOptions) const;
+
+private:
+  string mDirectory;
+
+  string
+  filename(const vector<string> &sources,
+           const cl::Platform &platform,
+           const cl::Device &device,
+           const string &compileOptions) const;
+
+  // Empty program if there is no usable binary
+  cl::Program
+  load(const string &filename,
+       const cl::Context &context,
+       const cl::Device &device,
+       const string &compileOptions) const;
+
+  void
+  store(const string &filename, const cl::Program &program) const;
+};
+
+#endif // __PROGRAMCACHE_HPP
@@ -36,18 +36,22 @@ CVisual::CVisual (DataLoader *dataLoader,
     mNumParticles(0),
     mParticles(NULL),
     mCamTarget( glm::vec3(0.0f, 0.0f, 0.0f) ),
-    mCamSphere( glm::vec3(0.0f, 20.0f, -0.5f) ),
-    mSharingBufferID(0) {
+    mCamSphere( glm::vec3(0.0f, 20.0f, -0.5f) ) {
 
 }
 
 CVisual::~CVisual () {
   // Destructor never reached if ESC is pressed in GLFW
   //cout << "Finish." << endl;
-  glDeleteProgram(mProgramID);
-
   delete[] mParticles;
 
+  // Nothing to clean up if no window was ever opened (headless run)
+  if (mWindow == NULL) {
+    return;
+  }
+
+  glDeleteProgram(mProgramID);
+
   glFinish();
   glfwTerminate();
 }
@@ -262,13 +266,11 @@ CVisual::createSharingBuffer(const GLsizeiptr size) const {
   // STATIC seems only be in respect to the host
   glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STATIC_DRAW);
 
-  mSharingBufferID = bufferID;
-
   return bufferID;
 }
 
 GLvoid
-CVisual::visualizeParticles(void) {
+CVisual::visualizeParticles(const GLuint particleBufferID) {
   glClearColor(0.05f, 0.05f, 0.05f, 0.0f); // Dark blue background
   glClearDepth(1.0f);
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -316,7 +318,7 @@ CVisual::visualizeParticles(void) {
     glm::value_ptr(lookAtMat)
   );
 
-  glBindBuffer(GL_ARRAY_BUFFER, mSharingBufferID);
+  glBindBuffer(GL_ARRAY_BUFFER, particleBufferID);
   glEnableVertexAttribArray(mParticlePositionAttrib);
   glVertexAttribPointer(mParticlePositionAttrib, 4, GL_FLOAT,
                         GL_FALSE, 0, 0);
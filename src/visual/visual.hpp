@@ -60,8 +60,12 @@ public:
   initSystemVisual(const cl_float4 sizesMin,
                    const cl_float4 sizesMax);
 
+  /**
+   *  \brief  Draws the system and the particle positions in the given
+   *          buffer.
+   */
   GLvoid
-  visualizeParticles(void);
+  visualizeParticles(const GLuint particleBufferID);
 
   GLuint
   createSharingBuffer(const GLsizeiptr size) const;
@@ -116,8 +120,6 @@ private:
   glm::vec3 mCamTarget;
   glm::vec3 mCamSphere;
 
-  mutable GLuint mSharingBufferID;
-
   GLuint mParticlePositionAttrib;
   GLint mParticleCameraToClipMatrixUnif;
   GLint mParticleWorldToCameraMatrixUnif;